@@ -0,0 +1,139 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+
+#include "../include/JFApp.h"
+
+// Multi-pixels are on chip borders - these are columns 255/256, 511/512, 767/768 and lines 255/256
+// Each multi-pixel is extended to 2 pixels in the composed image (so 4 pixels for corners)
+inline bool is_multipixel(int64_t coord, int64_t size) {
+    return (coord != 0) && (coord != size - 1) && ((coord % 256 == 255) || (coord % 256 == 0));
+}
+
+// Position in composed module (with gaps between chips)
+inline int64_t expanded_coord(int64_t coord) {
+    return coord + (coord / 256) * 2;
+}
+
+// Module line is split into runs of regular pixels and single multi-pixels
+// For multi-pixel lines, all segments have 2x more copies
+void add_line_segments(detector_geometry_t &geometry, int64_t module, int64_t line) {
+    int64_t module_row = module / geometry.modules_per_row;
+    int64_t module_col = module % geometry.modules_per_row;
+
+    // Output lines for this module line (1 or 2 for multi-pixel lines)
+    int64_t nlines_out = 1;
+    int64_t line_out0 = module_row * EXPANDED_MODULE_LINES + expanded_coord(line);
+    if (is_multipixel(line, MODULE_LINES)) {
+        // multi-pixel line 255 goes to 255 and 256, line 256 goes to 257 and 258
+        if (line % 256 == 0) line_out0 -= 1;
+        nlines_out = 2;
+    }
+    int64_t lines_out[2];
+    for (int64_t i = 0; i < nlines_out; i++) {
+        int64_t line_out = line_out0 + i;
+        if (geometry.upside_down) line_out = geometry.ypixel - 1 - line_out;
+        lines_out[i] = line_out;
+    }
+
+    int64_t col = 0;
+    while (col < MODULE_COLS) {
+        geometry_segment_t segment;
+        segment.source = line * MODULE_COLS + col;
+
+        int64_t ncols_out;
+        int64_t col_out0 = module_col * EXPANDED_MODULE_COLS + expanded_coord(col);
+        if (is_multipixel(col, MODULE_COLS)) {
+            // column 255 goes to 255 and 256, column 256 goes to 257 and 258
+            if (col % 256 == 0) col_out0 -= 1;
+            ncols_out = 2;
+            segment.length = 1;
+        } else {
+            // Run till next multi-pixel or end of line
+            int64_t end = col + 1;
+            while ((end < MODULE_COLS) && !is_multipixel(end, MODULE_COLS)) end++;
+            ncols_out = 1;
+            segment.length = end - col;
+        }
+
+        segment.ncopies = 0;
+        for (int64_t i = 0; i < nlines_out; i++) {
+            for (int64_t j = 0; j < ncols_out; j++)
+                segment.destination[segment.ncopies++] = lines_out[i] * geometry.xpixel + col_out0 + j;
+        }
+        // Value is split equally between copies
+        segment.divisor_shift = (nlines_out == 2 ? 1 : 0) + (ncols_out == 2 ? 1 : 0);
+
+        geometry.segments.push_back(segment);
+        col += segment.length;
+    }
+}
+
+// Build remap description for nmodules, arranged in rows of modules_per_row modules
+// upside_down = true means module 0 is in the bottom row and lines are flipped
+void setup_geometry(detector_geometry_t &geometry, int64_t nmodules, int64_t modules_per_row, bool upside_down) {
+    geometry.nmodules = nmodules;
+    geometry.modules_per_row = modules_per_row;
+    geometry.upside_down = upside_down;
+    geometry.xpixel = modules_per_row * EXPANDED_MODULE_COLS;
+    geometry.ypixel = (nmodules / modules_per_row) * EXPANDED_MODULE_LINES;
+
+    geometry.segments.clear();
+    geometry.line_first_segment.clear();
+    for (int64_t module = 0; module < nmodules; module++) {
+        for (int64_t line = 0; line < MODULE_LINES; line++) {
+            geometry.line_first_segment.push_back(geometry.segments.size());
+            add_line_segments(geometry, module, line);
+        }
+    }
+    geometry.line_first_segment.push_back(geometry.segments.size());
+}
+
+// Pixel mask is copied to all pixels created from multi-pixel, so no division is done
+void geometry_transform_mask(const detector_geometry_t &geometry, const uint16_t *input, uint32_t *output) {
+    for (int64_t module = 0; module < geometry.nmodules; module++) {
+        const uint16_t *module_input = input + module * MODULE_LINES * MODULE_COLS;
+        for (size_t s = geometry.line_first_segment[module * MODULE_LINES];
+             s < geometry.line_first_segment[(module + 1) * MODULE_LINES]; s++) {
+            const geometry_segment_t &segment = geometry.segments[s];
+            for (int c = 0; c < segment.ncopies; c++) {
+                for (int i = 0; i < segment.length; i++)
+                    output[segment.destination[c] + i] = module_input[segment.source + i];
+            }
+        }
+    }
+}
+
+// Bitmap of pixels with non-zero mask in composed image, bit (pixel % 64) of word (pixel / 64)
+// Mask is first transformed to composed image and then packed in one pass over the image
+// Returns number of pixels set
+size_t geometry_mask_bitmap(const detector_geometry_t &geometry, const uint16_t *input, uint64_t *bitmap) {
+    size_t npixel = geometry.xpixel * geometry.ypixel;
+    std::vector<uint32_t> mask(npixel, 0);
+    geometry_transform_mask(geometry, input, mask.data());
+
+    size_t count = 0;
+    for (size_t word = 0; word < (npixel + 63) / 64; word++) {
+        uint64_t value = 0;
+        size_t n = std::min<size_t>(64, npixel - word * 64);
+        for (size_t j = 0; j < n; j++)
+            value |= ((uint64_t) (mask[word * 64 + j] != 0)) << j;
+        bitmap[word] = value;
+        count += __builtin_popcountll(value);
+    }
+    return count;
+}
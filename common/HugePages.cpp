@@ -0,0 +1,236 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Allocation of large buffers with huge pages
+// Fewer pages mean fewer TLB misses when buffers are processed and faster ibv_reg_mr/cudaHostRegister
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "../include/JFApp.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#define HUGE_PAGE_2MB (2UL*1024*1024)
+#define HUGE_PAGE_1GB (1024UL*1024*1024)
+
+// Size of each mapping is kept, as munmap of huge pages needs length rounded to page size
+static std::map<void *, size_t> huge_mappings;
+static pthread_mutex_t huge_mappings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+inline size_t round_up(size_t size, size_t page_size) {
+    return ((size + page_size - 1) / page_size) * page_size;
+}
+
+inline int log2_page(size_t page_size) {
+    return 63 - __builtin_clzll(page_size);
+}
+
+static void *mmap_hugetlb(size_t size, size_t page_size, size_t &mapped_size) {
+    mapped_size = round_up(size, page_size);
+    // Pages are reserved by mmap, but populated only on first touch
+    void *ret = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (log2_page(page_size) << MAP_HUGE_SHIFT),
+                     -1, 0);
+    if (ret == MAP_FAILED) return NULL;
+    return ret;
+}
+
+// Page size used by kernel for mapping at address and amount of transparent huge pages in it
+// Read from /proc/self/smaps, returns 0 if mapping was not found
+size_t mapping_page_size(void *ptr, size_t &thp_bytes) {
+    std::ifstream smaps("/proc/self/smaps");
+    std::string line;
+    bool found = false;
+    size_t page_size = 0;
+    thp_bytes = 0;
+    uintptr_t addr = (uintptr_t) ptr;
+    while (std::getline(smaps, line)) {
+        uintptr_t start, end;
+        char dash;
+        std::istringstream header(line);
+        // Header line of a mapping is "start-end perms ...", other lines start with "Name:"
+        if ((header >> std::hex >> start >> dash >> end) && (dash == '-')) {
+            if (found) break;
+            found = (addr >= start) && (addr < end);
+        } else if (found) {
+            size_t value;
+            if (sscanf(line.c_str(), "KernelPageSize: %lu kB", &value) == 1) page_size = value * 1024;
+            if (sscanf(line.c_str(), "AnonHugePages: %lu kB", &value) == 1) thp_bytes = value * 1024;
+        }
+    }
+    return page_size;
+}
+
+void print_page_size(void *ptr, const char *name) {
+    size_t thp_bytes;
+    size_t page_size = mapping_page_size(ptr, thp_bytes);
+    if (page_size == 0) return;
+    std::cout << name << ": " << page_size / 1024 << " kB pages";
+    if (thp_bytes > 0) std::cout << " (" << thp_bytes / (1024*1024) << " MiB in transparent huge pages)";
+    std::cout << std::endl;
+}
+
+// Try 1 GiB pages (for buffers of at least 1 GiB), then 2 MiB pages and finally regular pages with transparent huge pages enabled
+// Huge pages must be reserved by administrator (e.g. /sys/kernel/mm/hugepages), otherwise mmap fails and next option is used
+// Memory is not populated, this is left to the caller (see populate_parallel)
+// Returns NULL if allocation failed
+void *mmap_huge(size_t size, const char *name) {
+    void *ret = NULL;
+    size_t mapped_size = 0;
+
+    if (size >= HUGE_PAGE_1GB) ret = mmap_hugetlb(size, HUGE_PAGE_1GB, mapped_size);
+    if ((ret == NULL) && (size >= HUGE_PAGE_2MB)) ret = mmap_hugetlb(size, HUGE_PAGE_2MB, mapped_size);
+
+    if (ret == NULL) {
+        mapped_size = size;
+        ret = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ret == MAP_FAILED) {
+            std::cerr << "Memory allocation error for " << name << std::endl;
+            return NULL;
+        }
+        madvise(ret, mapped_size, MADV_HUGEPAGE);
+    }
+
+    pthread_mutex_lock(&huge_mappings_mutex);
+    huge_mappings[ret] = mapped_size;
+    pthread_mutex_unlock(&huge_mappings_mutex);
+    return ret;
+}
+
+void munmap_huge(void *ptr) {
+    if (ptr == NULL) return;
+    pthread_mutex_lock(&huge_mappings_mutex);
+    auto it = huge_mappings.find(ptr);
+    if (it != huge_mappings.end()) {
+        munmap(ptr, it->second);
+        huge_mappings.erase(it);
+    }
+    pthread_mutex_unlock(&huge_mappings_mutex);
+}
+
+// Maximum number of threads used to populate buffer
+#define POPULATE_MAX_THREADS 32
+
+struct populate_arg_t {
+    char *ptr;
+    size_t size;
+    int cpu;
+};
+
+void *run_populate_thread(void *in_threadarg) {
+    populate_arg_t *arg = (populate_arg_t *) in_threadarg;
+
+    // Page is placed on NUMA node of the CPU, which touched it first
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(arg->cpu, &cpuset);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+
+    volatile char *ptr = arg->ptr;
+    for (size_t i = 0; i < arg->size; i += 4096)
+        ptr[i] = 0;
+    pthread_exit(0);
+}
+
+// Fault in all pages of freshly mapped buffer with multiple threads
+// Kernel zeroes pages on first touch, so there is no need for memset, only one byte per page is written
+// Threads are spread over all allowed CPUs, so buffer is distributed over NUMA nodes
+// Must not be used for buffers with content, as the written bytes are set to zero
+void populate_parallel(void *ptr, size_t size) {
+    if ((ptr == NULL) || (size == 0)) return;
+
+    cpu_set_t allowed;
+    std::vector<int> cpus;
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == 0) {
+        for (int i = 0; i < CPU_SETSIZE; i++)
+            if (CPU_ISSET(i, &allowed)) cpus.push_back(i);
+    }
+    if (cpus.empty()) cpus.push_back(0);
+
+    size_t nthreads = std::min<size_t>(cpus.size(), POPULATE_MAX_THREADS);
+    // Each thread gets a range aligned to 2 MiB, so huge page is not shared between threads
+    size_t block = round_up((size + nthreads - 1) / nthreads, HUGE_PAGE_2MB);
+
+    std::vector<pthread_t> threads(nthreads);
+    std::vector<populate_arg_t> args(nthreads);
+    std::vector<bool> running(nthreads, false);
+    for (size_t i = 0; i < nthreads; i++) {
+        size_t offset = i * block;
+        if (offset >= size) break;
+        args[i].ptr  = (char *) ptr + offset;
+        args[i].size = std::min(block, size - offset);
+        args[i].cpu  = cpus[i * cpus.size() / nthreads];
+        if (pthread_create(&threads[i], NULL, run_populate_thread, &args[i]) == 0)
+            running[i] = true;
+        else {
+            // Range is done by this thread instead
+            volatile char *p = args[i].ptr;
+            for (size_t j = 0; j < args[i].size; j += 4096) p[j] = 0;
+        }
+    }
+    for (size_t i = 0; i < nthreads; i++) {
+        if (running[i]) pthread_join(threads[i], NULL);
+    }
+}
+
+// Counter of data TLB misses for the calling process, including threads created later
+// Returns -1 if counter is not available (e.g. no permission, check /proc/sys/kernel/perf_event_paranoid)
+int open_dtlb_miss_counter() {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0) {
+        std::cout << "dTLB miss counter not available" << std::endl;
+        return -1;
+    }
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    return fd;
+}
+
+// Counts of threads, which already finished, are included
+// Returns -1 on error
+int64_t close_dtlb_miss_counter(int fd) {
+    if (fd < 0) return -1;
+    uint64_t value = 0;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    ssize_t ret = read(fd, &value, sizeof(value));
+    close(fd);
+    if (ret != sizeof(value)) return -1;
+    return value;
+}
@@ -52,7 +52,13 @@ int setup_ibverbs(ib_settings_t &settings, std::string ib_device_name, size_t se
 		return 1;
 	}
 
-	settings.cq = ibv_create_cq(settings.context, send_queue_size + receive_queue_size, NULL, NULL, 0);
+	settings.comp_channel = ibv_create_comp_channel(settings.context);
+	if (settings.comp_channel == NULL) {
+		std::cerr << "Failed to create IB completion channel." << std::endl;
+		return 1;
+	}
+
+	settings.cq = ibv_create_cq(settings.context, send_queue_size + receive_queue_size, NULL, settings.comp_channel, 0);
 	if (settings.cq == NULL) {
 		std::cerr << "Failed to create IB completion queue." << std::endl;
 		return 1;
@@ -101,6 +107,14 @@ int switch_to_init(ib_settings_t &settings) {
              std::cerr << "Cannot query port" << std::endl;
              return 1;
         }
+
+        // GID is necessary for RoCE, where LID is not assigned
+        ret = ibv_query_gid(settings.context, 1, 0, &settings.gid);
+        if (ret != 0)
+        {
+             std::cerr << "Cannot query GID" << std::endl;
+             return 1;
+        }
         return 0;
 }
 
@@ -125,7 +139,7 @@ int switch_to_reset(ib_settings_t &settings) {
 
 }
 
-int switch_to_rtr(ib_settings_t &settings, uint32_t rq_psn, uint16_t dlid, uint32_t dest_qp_num) {
+int switch_to_rtr(ib_settings_t &settings, uint32_t rq_psn, uint16_t dlid, uint32_t dest_qp_num, const ibv_gid &dgid) {
 	int qp_flags = IBV_QP_STATE | 
 			IBV_QP_AV| 
 			IBV_QP_PATH_MTU | 
@@ -144,6 +158,13 @@ int switch_to_rtr(ib_settings_t &settings, uint32_t rq_psn, uint16_t dlid, uint3
 	qp_attr.min_rnr_timer      = 12; // recommended from Mellanox
 	qp_attr.ah_attr.dlid       = dlid;
         qp_attr.ah_attr.port_num   = 1;
+        if (dlid == 0) {
+                // RoCE - address by GID
+                qp_attr.ah_attr.is_global      = 1;
+                qp_attr.ah_attr.grh.dgid       = dgid;
+                qp_attr.ah_attr.grh.sgid_index = 0;
+                qp_attr.ah_attr.grh.hop_limit  = 1;
+        }
 	int ret = ibv_modify_qp(settings.qp, &qp_attr, qp_flags);
 
 	if (ret) {
@@ -184,6 +205,7 @@ int switch_to_rts(ib_settings_t &settings, uint32_t sq_psn) {
 int close_ibverbs(ib_settings_t &settings) {
 	ibv_destroy_qp(settings.qp);
 	ibv_destroy_cq(settings.cq);
+	ibv_destroy_comp_channel(settings.comp_channel);
 	ibv_dealloc_pd(settings.pd);
 	ibv_close_device(settings.context);
     return 0;
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+#include "../include/JFApp.h"
+
+static const char *latency_stage_names[LATENCY_STAGES] = {
+        "Arrival to send", "Transform", "Batch and post", "IB completion", "GPU hand-off", "Total"
+};
+
+inline size_t latency_bucket(uint64_t value) {
+    if (value < (1UL << LATENCY_SUB_BITS)) return value;
+    if (value >= (1UL << LATENCY_MAX_BITS)) return LATENCY_BUCKETS - 1;
+    // Position of highest bit selects power of 2, next LATENCY_SUB_BITS bits select bucket within
+    int exponent = 63 - __builtin_clzll(value);
+    size_t sub = (value >> (exponent - LATENCY_SUB_BITS)) & ((1UL << LATENCY_SUB_BITS) - 1);
+    return ((exponent - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) + sub;
+}
+
+// Upper limit of values in the bucket
+inline uint64_t latency_bucket_limit(size_t bucket) {
+    if (bucket < (1UL << LATENCY_SUB_BITS)) return bucket;
+    int exponent = (bucket >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1UL << LATENCY_SUB_BITS) - 1);
+    return (((1UL << LATENCY_SUB_BITS) + sub + 1) << (exponent - LATENCY_SUB_BITS)) - 1;
+}
+
+void latency_histogram_add(latency_histogram_t &histogram, uint64_t value_ns) {
+    histogram.count++;
+    histogram.sum_ns += value_ns;
+    if (value_ns > histogram.max_ns) histogram.max_ns = value_ns;
+    histogram.buckets[latency_bucket(value_ns)]++;
+}
+
+// Percentile in range 0-100, result is upper limit of the bucket (but not more than max)
+uint64_t latency_histogram_percentile(const latency_histogram_t &histogram, double percentile) {
+    if (histogram.count == 0) return 0;
+    uint64_t threshold = (uint64_t) (histogram.count * percentile / 100.0);
+    if (threshold == 0) threshold = 1;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+        sum += histogram.buckets[i];
+        if (sum >= threshold) return std::min(latency_bucket_limit(i), histogram.max_ns);
+    }
+    return histogram.max_ns;
+}
+
+void print_latency_statistics(const latency_statistics_t &statistics) {
+    std::streamsize precision = std::cout.precision();
+    std::cout << "Latency [us]          count      mean       p50       p99     p99.9       max" << std::endl;
+    for (int i = 0; i < LATENCY_STAGES; i++) {
+        const latency_histogram_t &h = statistics.stage[i];
+        if (h.count == 0) continue;
+        std::cout << std::left << std::setw(16) << latency_stage_names[i] << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(11) << h.count
+                  << std::setw(10) << h.sum_ns / 1000.0 / h.count
+                  << std::setw(10) << latency_histogram_percentile(h, 50.0) / 1000.0
+                  << std::setw(10) << latency_histogram_percentile(h, 99.0) / 1000.0
+                  << std::setw(10) << latency_histogram_percentile(h, 99.9) / 1000.0
+                  << std::setw(10) << h.max_ns / 1000.0 << std::endl;
+    }
+    std::cout.unsetf(std::ios::floatfield);
+    std::cout.precision(precision);
+    if (statistics.dropped_events > 0)
+        std::cout << "Latency trace: " << statistics.dropped_events << " events dropped" << std::endl;
+}
@@ -19,6 +19,8 @@
 
 #include <stdlib.h>
 #include <string>
+#include <vector>
+#include <utility>
 #include <pthread.h>
 #include <lz4.h>
 #include <infiniband/verbs.h>
@@ -26,7 +28,14 @@
 // Contains variables shared with FPGA
 #include "action_rx100G.h"
 
-#define COMPOSED_IMAGE_SIZE (514L*1030L*NMODULES)
+// Module size after expanding multi-pixels (chips are separated by 2 pixel gap)
+#define EXPANDED_MODULE_COLS  1030L
+#define EXPANDED_MODULE_LINES  514L
+
+#define COMPOSED_IMAGE_SIZE (EXPANDED_MODULE_LINES*EXPANDED_MODULE_COLS*NMODULES)
+
+// Set in RDMA immediate value (together with image number), if image was compressed by receiver with bitshuffle/LZ4
+#define RDMA_IMM_COMPRESSED 0x80000000U
 
 #define TCPIP_CONN_MAGIC_NUMBER 123434L
 #define TCPIP_DONE_MAGIC_NUMBER  56789L
@@ -35,6 +44,11 @@
 // This number is 1/2 if 32-bit pixel depth is used
 #define NIMAGES_PER_STREAM 320L
 
+// Local background box of spot finding is (2*NBX+1) x (2*NBY+1) pixels (NBX/NBY in XDS)
+// Receiver kernels are compiled for half-widths from 1 to SPOT_BOX_MAX_HALF_WIDTH
+#define SPOT_BOX_MAX_HALF_WIDTH 5
+#define SPOT_BOX_DEFAULT_HALF_WIDTH 3
+
 // Number of FPGA boards in total for the whole setup
 #define NCARDS 2
 
@@ -93,6 +107,11 @@ struct experiment_settings_t {
     double   strong_pixel;                 // STRONG_PIXEL in XDS
     uint16_t max_spot_depth;               // Maximum images per spot
     uint16_t min_pixels_per_spot;          // Minimum pixels per spot
+    uint16_t spot_finding_nbx;             // Half-width of local background box in X (NBX in XDS)
+    uint16_t spot_finding_nby;             // Half-width of local background box in Y (NBY in XDS)
+
+    bool     receiver_compression;  // true = images are compressed with bitshuffle/LZ4 by receiver before sending over IB
+    bool     latency_trace;         // true = receiver records per-image latency of pipeline stages
 
     double   scattering_vector[3];  // S0 in Kabsch Acta D paper
     double   rotation_axis[3];      // m2 in Kabsch Acta D paper
@@ -103,9 +122,41 @@ struct receiver_output_t {
     uint64_t packets_collected_ok;
 };
 
+// Latency histogram with log-linear buckets (HDR style), values in ns
+// Values below 2^LATENCY_SUB_BITS have own bucket, above each power of 2 is split into 2^LATENCY_SUB_BITS buckets
+// So relative error is below 1/2^LATENCY_SUB_BITS, values above 2^LATENCY_MAX_BITS ns (~18 min.) go to the last bucket
+#define LATENCY_SUB_BITS  4
+#define LATENCY_MAX_BITS 40
+#define LATENCY_BUCKETS  ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+struct latency_histogram_t {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[LATENCY_BUCKETS];
+};
+
+// Stages of receiver pipeline, for which latency is measured
+enum latency_stage_t {
+    LATENCY_ARRIVAL_TO_SEND,   // all frames of image arrived -> send thread starts image
+    LATENCY_TRANSFORM,         // conversion/summation/compression or copy of image
+    LATENCY_BATCH,             // image ready -> RDMA send posted
+    LATENCY_IB_COMPLETION,     // RDMA send posted -> completion retrieved
+    LATENCY_GPU_HANDOFF,       // image ready -> GPU takes the chunk with the image
+    LATENCY_TOTAL,             // all frames of image arrived -> completion retrieved
+    LATENCY_STAGES
+};
+
+// Sent by receiver after online statistics
+struct latency_statistics_t {
+    latency_histogram_t stage[LATENCY_STAGES];
+    uint64_t dropped_events;  // events lost, because trace buffer was full
+};
+
 // Settings for IB connection
 struct ib_comm_settings_t {
-    uint16_t dlid;
+    uint16_t dlid;      // LID is zero for RoCE (including soft-RoCE), then GID is used for addressing
+    ibv_gid  gid;
     uint32_t qp_num;
     uint32_t rq_psn;
     uint32_t frame_buffer_rkey;
@@ -119,8 +170,10 @@ struct ib_settings_t {
     ibv_context *context;
     ibv_pd *pd;
     ibv_cq *cq;
+    ibv_comp_channel *comp_channel; // to sleep while waiting for completions
     ibv_qp *qp;
     ibv_port_attr port_attr;
+    ibv_gid gid;
 };
 
 // Definition of Bragg spot
@@ -132,9 +185,72 @@ struct spot_t {
     uint32_t first_frame, last_frame; // Limits of the spot in time direction
 };
 
+// Spot stream - during data collection receiver sends one message per spot finding chunk
+// Header is followed by length bytes (nspots * spot_t), chunks can arrive in any order
+// Spots joined across chunk boundary are sent with the chunk, which completed them
+#define SPOT_MESSAGE_MAGIC    0x53504F54U // "SPOT"
+#define SPOT_STREAM_VERSION   1
+#define SPOT_MESSAGE_OVERFLOW 0x1         // strong pixels were lost in some images of the chunk
+struct spot_message_header_t {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint64_t length;          // bytes following the header
+    uint64_t chunk;
+    uint64_t image0;          // first image of the chunk
+    uint64_t nimages;
+    uint64_t nspots;
+    uint64_t overflow_images; // images with more strong pixels than receiver can save
+};
+
+// Hot pixel histogram entry sent by receiver after data collection
+// Number of images, in which pixel (col + line * image width, in the same coordinates as spots) was found strong
+struct strong_pixel_count_t {
+    uint32_t pixel;
+    uint32_t count;
+};
+
+// Geometry of composed image - mapping of module pixels to image pixels
+// One segment is a run of pixels in one module line, copied to one or more places in the composed image
+// Multi-pixels are single pixel segments with 2 (or 4 in corners) copies, value is split between copies
+struct geometry_segment_t {
+    uint32_t source;          // pixel in the module (line * MODULE_COLS + col)
+    uint32_t destination[4];  // first pixel in the composed image for each copy
+    uint16_t length;          // number of pixels in the run
+    uint8_t  ncopies;         // number of copies (1, 2 or 4)
+    uint8_t  divisor_shift;   // value is divided by (1 << divisor_shift)
+};
+
+struct detector_geometry_t {
+    int64_t nmodules;
+    int64_t modules_per_row;
+    bool    upside_down;
+    int64_t xpixel;                  // size of composed image
+    int64_t ypixel;
+    std::vector<geometry_segment_t> segments;
+    std::vector<size_t> line_first_segment; // index of first segment for (module * MODULE_LINES + line)
+};
+
+void setup_geometry(detector_geometry_t &geometry, int64_t nmodules, int64_t modules_per_row, bool upside_down);
+void geometry_transform_mask(const detector_geometry_t &geometry, const uint16_t *input, uint32_t *output);
+size_t geometry_mask_bitmap(const detector_geometry_t &geometry, const uint16_t *input, uint64_t *bitmap);
+
+// Latency histograms
+void latency_histogram_add(latency_histogram_t &histogram, uint64_t value_ns);
+uint64_t latency_histogram_percentile(const latency_histogram_t &histogram, double percentile);
+void print_latency_statistics(const latency_statistics_t &statistics);
+
+// Large buffers backed by huge pages (HugePages.cpp)
+void *mmap_huge(size_t size, const char *name);
+void munmap_huge(void *ptr);
+void populate_parallel(void *ptr, size_t size);
+void print_page_size(void *ptr, const char *name);
+int open_dtlb_miss_counter();
+int64_t close_dtlb_miss_counter(int fd);
+
 // IB Verbs function wrappers
 int setup_ibverbs(ib_settings_t &settings, std::string ib_device_name, size_t send_queue_size, size_t receive_queue_size);
-int switch_to_rtr(ib_settings_t &settings, uint32_t rq_psn, uint16_t dlid, uint32_t dest_qp_num);
+int switch_to_rtr(ib_settings_t &settings, uint32_t rq_psn, uint16_t dlid, uint32_t dest_qp_num, const ibv_gid &dgid);
 int switch_to_rts(ib_settings_t &settings, uint32_t sq_psn);
 int switch_to_init(ib_settings_t &settings);
 int switch_to_reset(ib_settings_t &settings);
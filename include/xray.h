@@ -94,4 +94,15 @@ inline float get_resolution(float lab[3], float wavelength) {
     return wavelength / (2*sin_theta);
 }
 
+// 1/d^2 [A^-2] of detector position, same geometry as get_resolution(), but without the second sqrt
+// 1/d^2 = 4 sin(theta)^2 / wavelength^2 = 2 (1 - cos(2theta)) / wavelength^2
+inline float get_one_over_d2(float x, float y, float beam_x, float beam_y, float dist, float wavelength) {
+    float lab[3];
+    detector_to_lab(x, y, lab, beam_x, beam_y, dist);
+    float beam_path = sqrt(lab[0]*lab[0] + lab[1]*lab[1] + lab[2]*lab[2]);
+    if (lab[2] == beam_path) beam_path += 1e-3;
+    float cos_2theta = lab[2] / beam_path;
+    return 2 * (1 - cos_2theta) / (wavelength * wavelength);
+}
+
 #endif
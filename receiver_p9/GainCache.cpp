@@ -0,0 +1,180 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Gain maps are mapped from files once at startup and kept as doubles
+// Fixed-point gain factors used by FPGA depend on energy, these are calculated by multiple threads
+// and kept for last GAIN_CACHE_SIZE energies, so repeated data collections at the same energy don't need to recalculate
+
+#include <iostream>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "JFReceiver.h"
+
+#define MODULE_PIXELS (MODULE_COLS * MODULE_LINES)
+// Gain file has 3 gains (G0, G1, G2) for each pixel of module
+#define GAIN_FILE_SIZE (3 * MODULE_PIXELS * sizeof(double))
+// Size of fixed-point gain factors in gain_pedestal_data
+#define GAIN_TABLE_SIZE (3 * NPIXEL * sizeof(uint16_t))
+
+struct gain_cache_entry_t {
+    double    energy_in_keV;
+    uint64_t  last_used;     // 0 = entry empty
+    uint16_t *table;
+};
+
+static const double *gain_map[NMODULES];
+static gain_cache_entry_t gain_cache[GAIN_CACHE_SIZE];
+static uint64_t gain_cache_clock = 0;
+
+// Module without gain map has all gain factors equal to zero
+// Returns 1 if any of the gain files couldn't be mapped
+int load_gain_maps() {
+    int ret = 0;
+    for (int i = 0; i < GAIN_CACHE_SIZE; i++) {
+        gain_cache[i].last_used = 0;
+        gain_cache[i].table = NULL;
+    }
+    for (int i = 0; i < NMODULES; i++) {
+        gain_map[i] = NULL;
+        int fd = open(receiver_settings.gain_file_name[i].c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Error opening file " << receiver_settings.gain_file_name[i] << std::endl;
+            ret = 1;
+            continue;
+        }
+        struct stat st;
+        if ((fstat(fd, &st) != 0) || (st.st_size < (off_t) GAIN_FILE_SIZE)) {
+            std::cerr << "Gain file " << receiver_settings.gain_file_name[i] << " too small" << std::endl;
+            close(fd);
+            ret = 1;
+            continue;
+        }
+        void *map = mmap(NULL, GAIN_FILE_SIZE, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            std::cerr << "Error mapping file " << receiver_settings.gain_file_name[i] << std::endl;
+            ret = 1;
+            continue;
+        }
+        gain_map[i] = (const double *) map;
+    }
+    return ret;
+}
+
+void close_gain_maps() {
+    for (int i = 0; i < NMODULES; i++) {
+        if (gain_map[i] != NULL) munmap((void *) gain_map[i], GAIN_FILE_SIZE);
+        gain_map[i] = NULL;
+    }
+    for (int i = 0; i < GAIN_CACHE_SIZE; i++) {
+        free(gain_cache[i].table);
+        gain_cache[i].table = NULL;
+        gain_cache[i].last_used = 0;
+    }
+}
+
+// Plain loop without dependencies, so it is vectorized by compiler
+// G0 has 14-bit fractional part: 512 / (gain * energy), G1 and G2 have 13-bit fractional part: -1 / (gain * energy)
+inline void gain_to_fixed_point(uint16_t *output, const double *input, size_t npixel,
+                                double numerator, double scale, double energy_in_keV) {
+    for (size_t i = 0; i < npixel; i++)
+        output[i] = (uint16_t) ((numerator / (input[i] * energy_in_keV)) * scale + 0.5);
+}
+
+struct gain_thread_arg_t {
+    uint16_t *table;
+    double energy_in_keV;
+    size_t first_pixel;   // part of module processed by the thread
+    size_t npixel;
+};
+
+void *run_gain_thread(void *in_threadarg) {
+    gain_thread_arg_t *arg = (gain_thread_arg_t *) in_threadarg;
+    for (int module = 0; module < NMODULES; module++) {
+        if (gain_map[module] == NULL) continue;
+        for (int gain = 0; gain < 3; gain++) {
+            uint16_t *output = arg->table + gain * NPIXEL + module * MODULE_PIXELS + arg->first_pixel;
+            const double *input = gain_map[module] + gain * MODULE_PIXELS + arg->first_pixel;
+            if (gain == 0) gain_to_fixed_point(output, input, arg->npixel, 512.0, 16384.0, arg->energy_in_keV);
+            else gain_to_fixed_point(output, input, arg->npixel, -1.0, 8192.0, arg->energy_in_keV);
+        }
+    }
+    pthread_exit(0);
+}
+
+// Each thread processes the same part of every module and gain
+void calculate_gain_table(uint16_t *table, double energy_in_keV) {
+    pthread_t thread[GAIN_THREADS];
+    gain_thread_arg_t arg[GAIN_THREADS];
+    size_t pixels_per_thread = MODULE_PIXELS / GAIN_THREADS;
+
+    for (int i = 0; i < GAIN_THREADS; i++) {
+        arg[i].table = table;
+        arg[i].energy_in_keV = energy_in_keV;
+        arg[i].first_pixel = i * pixels_per_thread;
+        arg[i].npixel = (i == GAIN_THREADS - 1) ? MODULE_PIXELS - arg[i].first_pixel : pixels_per_thread;
+        int ret = pthread_create(thread + i, NULL, run_gain_thread, arg + i);
+        PTHREAD_ERROR(ret, pthread_create);
+    }
+    for (int i = 0; i < GAIN_THREADS; i++) {
+        int ret = pthread_join(thread[i], NULL);
+        PTHREAD_ERROR(ret, pthread_join);
+    }
+}
+
+// Fill fixed-point gain factors in gain_pedestal_data for given energy
+// If energy is not in the cache, least recently used entry is replaced
+int set_gain_energy(double energy_in_keV) {
+    timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    gain_cache_clock++;
+    gain_cache_entry_t *entry = NULL;
+    bool hit = false;
+    for (int i = 0; i < GAIN_CACHE_SIZE; i++) {
+        if ((gain_cache[i].last_used != 0) && (gain_cache[i].energy_in_keV == energy_in_keV)) {
+            entry = gain_cache + i;
+            hit = true;
+            break;
+        }
+        if ((entry == NULL) || (gain_cache[i].last_used < entry->last_used))
+            entry = gain_cache + i;
+    }
+
+    if (!hit) {
+        // calloc, so modules without gain map stay zero
+        if (entry->table == NULL) entry->table = (uint16_t *) calloc(1, GAIN_TABLE_SIZE);
+        if (entry->table == NULL) {
+            std::cerr << "Memory allocation error for gain table" << std::endl;
+            return 1;
+        }
+        calculate_gain_table(entry->table, energy_in_keV);
+        entry->energy_in_keV = energy_in_keV;
+    }
+    entry->last_used = gain_cache_clock;
+
+    memcpy(gain_pedestal_data, entry->table, GAIN_TABLE_SIZE);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    std::cout << "Gain for " << energy_in_keV << " keV " << (hit ? "taken from cache" : "calculated") << " in "
+              << (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6 << " ms" << std::endl;
+    return 0;
+}
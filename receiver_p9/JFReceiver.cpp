@@ -21,13 +21,17 @@
 #include <cstdio>
 #include <cstring>
 #include <unistd.h>
+#include <algorithm>
 
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 
+#include "../bitshuffle/bitshuffle.h"
+
 #include "JFReceiver.h"
 
 int parse_input(int argc, char **argv) {
@@ -44,6 +48,12 @@ int parse_input(int argc, char **argv) {
     receiver_settings.tcp_port = 52320;
     receiver_settings.pedestal_file_name = "pedestal_card0.dat";
     receiver_settings.gpu_device = 0;
+    receiver_settings.scalar_transform = false;
+    receiver_settings.send_batch = 1;
+    receiver_settings.cpu_spot_finding = false;
+    receiver_settings.cpu_spot_threads = 8;
+    receiver_settings.sat_spot_kernel = false;
+    receiver_settings.spot_assembly_threads = 4;
 
     receiver_settings.gain_file_name[0] =
             "/home/jungfrau/JF4M_X06SA_200511/gainMaps_M352_2020-01-31.bin";
@@ -54,7 +64,7 @@ int parse_input(int argc, char **argv) {
     receiver_settings.gain_file_name[3] =
             "/home/jungfrau/JF4M_X06SA_200511/gainMaps_M253_2019-07-29.bin";
 
-    while ((opt = getopt(argc,argv,":C:t:I:P:p:0:1:2:3:G")) != EOF)
+    while ((opt = getopt(argc,argv,":C:t:I:P:p:0:1:2:3:Gsk:c:Ta:")) != EOF)
         switch(opt)
         {
             case 'C':
@@ -92,6 +102,36 @@ int parse_input(int argc, char **argv) {
             case 'p':
                 receiver_settings.pedestal_file_name = std::string(optarg);
                 break;
+            case 's':
+                receiver_settings.scalar_transform = true;
+                break;
+            case 'k': {
+                int send_batch = atoi(optarg);
+                if ((send_batch < 1) || (send_batch > SEND_BATCH_MAX)) {
+                    std::cerr << "Send batch must be in range 1 to " << SEND_BATCH_MAX << std::endl;
+                    return 1;
+                }
+                receiver_settings.send_batch = send_batch;
+                break;
+            }
+            case 'c':
+                receiver_settings.cpu_spot_finding = true;
+                receiver_settings.cpu_spot_threads = atoi(optarg);
+                if (receiver_settings.cpu_spot_threads < 1) {
+                    std::cerr << "Number of CPU spot finding threads must be at least 1" << std::endl;
+                    return 1;
+                }
+                break;
+            case 'T':
+                receiver_settings.sat_spot_kernel = true;
+                break;
+            case 'a':
+                receiver_settings.spot_assembly_threads = atoi(optarg);
+                if ((receiver_settings.spot_assembly_threads < 1) || (receiver_settings.spot_assembly_threads > NCUDA_STREAMS)) {
+                    std::cerr << "Number of spot assembly threads must be in range 1 to " << NCUDA_STREAMS << std::endl;
+                    return 1;
+                }
+                break;
             case 0:
                 receiver_settings.gain_file_name[0] = std::string(optarg);
                 break;
@@ -116,41 +156,104 @@ int allocate_memory() {
     jf_packet_headers_size  = FRAME_LIMIT * NMODULES * sizeof(header_info_t);
 
     // Arrays are allocated with mmap for the higest possible performance. Output is page aligned, so it will be also 64b aligned.
-    frame_buffer       = (int16_t *)  mmap (NULL, frame_buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0) ;
+    // Large buffers use huge pages, if available
+    frame_buffer       = (int16_t *) mmap_huge(frame_buffer_size, "Frame buffer");
     status_buffer      = (char *) mmap (NULL, status_buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
-    gain_pedestal_data = (uint16_t *) mmap (NULL, gain_pedestal_data_size, PROT_READ | PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
-    jf_packet_headers  = (header_info_t *) mmap (NULL, jf_packet_headers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
-    ib_buffer          = (char *) mmap (NULL, ib_buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
-    strong_pixel_count = (uint64_t *) malloc(strong_pixel_count_size);
+    gain_pedestal_data = (uint16_t *) mmap_huge(gain_pedestal_data_size, "Gain/pedestal");
+    jf_packet_headers  = (header_info_t *) mmap_huge(jf_packet_headers_size, "Packet headers");
+    ib_buffer          = (char *) mmap_huge(ib_buffer_size, "IB buffer");
+
+    if (status_buffer == MAP_FAILED) status_buffer = NULL;
 
     if ((frame_buffer == NULL) || (status_buffer == NULL) ||
         (gain_pedestal_data == NULL) || (jf_packet_headers == NULL) ||
-        (ib_buffer == NULL) || (strong_pixel_count == NULL)) {
+        (ib_buffer == NULL)) {
         std::cerr << "Memory allocation error" << std::endl;
         return 1;
     }
 
-    // Fill output arrays with zeros
-    memset(frame_buffer, 0x0, frame_buffer_size);
-    memset(status_buffer, 0x0, status_buffer_size);
-    memset(gain_pedestal_data, 0x0, gain_pedestal_data_size);
-    memset(jf_packet_headers, 0x0, jf_packet_headers_size);
-    memset(ib_buffer, 0x0, ib_buffer_size);
-
+    // Freshly mapped memory is already filled with zeros, so there is no memset
     packet_counter = (char *) (status_buffer + 64);
     online_statistics = (online_statistics_t *) status_buffer;
 
     return 0;
 }
 
+// Buffers registered with IB Verbs and CUDA are populated in parallel, otherwise registration faults in pages one by one
+// Packet headers and gain/pedestal array are accessed by FPGA, first access to a missing page would be a translation fault
+// during acquisition, so these are populated as well (before pedestal and gain are loaded)
+void populate_memory() {
+    populate_parallel(frame_buffer, frame_buffer_size);
+    populate_parallel(ib_buffer, ib_buffer_size);
+    populate_parallel(jf_packet_headers, jf_packet_headers_size);
+    populate_parallel(gain_pedestal_data, gain_pedestal_data_size);
+
+    // Page size is known only after memory is touched
+    print_page_size(frame_buffer, "Frame buffer");
+    print_page_size(ib_buffer, "IB buffer");
+    print_page_size(jf_packet_headers, "Packet headers");
+    print_page_size(gain_pedestal_data, "Gain/pedestal");
+}
+
+// Startup timeline - duration of each step is recorded, so restart time can be tracked
+std::vector<std::pair<std::string, uint64_t> > startup_timeline;
+uint64_t startup_step_start = 0;
+
+inline uint64_t startup_time_us() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void startup_step_done(const std::string &name) {
+    uint64_t now = startup_time_us();
+    startup_timeline.push_back(std::make_pair(name, now - startup_step_start));
+    startup_step_start = now;
+}
+
+void print_startup_timeline() {
+    uint64_t total = 0;
+    std::cout << "Startup timeline:" << std::endl;
+    for (size_t i = 0; i < startup_timeline.size(); i++) {
+        std::cout << "   " << startup_timeline[i].first << ": " << startup_timeline[i].second / 1000 << " ms" << std::endl;
+        total += startup_timeline[i].second;
+    }
+    std::cout << "Startup time: " << total / 1000 << " ms" << std::endl;
+}
+
+// Slot must fit the worst case of bitshuffle/LZ4 compression and the header
+size_t ib_compressed_slot_size() {
+    return bshuf_compress_lz4_bound(COMPOSED_IMAGE_SIZE, experiment_settings.pixel_depth, 0) + 12;
+}
+
+int setup_compressed_buffer() {
+    if (ib_compressed_buffer != NULL) return 0;
+
+    // Buffer is sized for both pixel depths
+    size_t size_16bit = (bshuf_compress_lz4_bound(COMPOSED_IMAGE_SIZE, 2, 0) + 12) * RDMA_SQ_SIZE;
+    size_t size_32bit = (bshuf_compress_lz4_bound(COMPOSED_IMAGE_SIZE, 4, 0) + 12) * (RDMA_SQ_SIZE / 2);
+    ib_compressed_buffer_size = std::max(size_16bit, size_32bit);
+
+    ib_compressed_buffer = (char *) mmap_huge(ib_compressed_buffer_size, "Compression buffer");
+    if (ib_compressed_buffer == NULL) return 1;
+    populate_parallel(ib_compressed_buffer, ib_compressed_buffer_size);
+
+    ib_compressed_buffer_mr = ibv_reg_mr(ib_settings.pd, ib_compressed_buffer, ib_compressed_buffer_size, 0);
+    if (ib_compressed_buffer_mr == NULL) {
+        std::cerr << "Failed to register IB memory region for compressed images." << std::endl;
+        return 1;
+    }
+    std::cout << "Compression buffer allocated" << std::endl;
+    return 0;
+}
+
 void deallocate_memory() {
-    munmap(frame_buffer, frame_buffer_size);
+    munmap_huge(frame_buffer);
     munmap(status_buffer, status_buffer_size);
-    munmap(gain_pedestal_data, gain_pedestal_data_size);
-    munmap(jf_packet_headers, jf_packet_headers_size);
-    munmap(ib_buffer, ib_buffer_size);
-
-    free(strong_pixel_count);
+    munmap_huge(gain_pedestal_data);
+    munmap_huge(jf_packet_headers);
+    munmap_huge(ib_buffer);
+    munmap_huge(ib_compressed_buffer);
 }
 
 int load_bin_file(std::string fname, char *dest, size_t size) {
@@ -166,29 +269,6 @@ int load_bin_file(std::string fname, char *dest, size_t size) {
     }
 }
 
-void load_gain(std::string fname, int module, double energy_in_keV) {
-    double *tmp_gain = (double *) calloc (3 * MODULE_COLS * MODULE_LINES, sizeof(double));
-    load_bin_file(fname, (char *) tmp_gain, 3 * MODULE_COLS * MODULE_LINES * sizeof(double));
-
-    size_t offset = module * MODULE_COLS * MODULE_LINES;
-
-    // 14-bit fractional part
-    for (int i = 0; i < MODULE_COLS * MODULE_LINES; i ++)
-        gain_pedestal_data[offset+i] =  (uint16_t) ((512.0 / (tmp_gain[i] * energy_in_keV)) * 16384 + 0.5);
-
-    // 13-bit fractional part
-    offset += NPIXEL;
-    for (int i = 0; i < MODULE_COLS * MODULE_LINES; i ++)
-        gain_pedestal_data[offset+i] =  (uint16_t) (-1.0 / ( tmp_gain[i + MODULE_COLS * MODULE_LINES] * energy_in_keV) * 8192 + 0.5);
-
-    // 13-bit fractional part
-    offset += NPIXEL;
-    for (int i = 0; i < MODULE_COLS * MODULE_LINES; i ++)
-        gain_pedestal_data[offset+i] =  (uint16_t) (-1.0 / ( tmp_gain[i + 2 * MODULE_COLS * MODULE_LINES] * energy_in_keV) * 8192 + 0.5);
-
-    free(tmp_gain);
-}
-
 // Loads pedestal and pixel mask
 void load_pedestal(std::string fname) {
     load_bin_file(fname, (char *)(gain_pedestal_data + 3 * NPIXEL), 4 * NPIXEL * sizeof(uint16_t));
@@ -206,18 +286,20 @@ void save_pedestal(std::string fname) {
     }
 }
 
+// Bad pixels from pixel mask, spot finding mask adds pixels beyond resolution limit
+static uint64_t pedestal_bad_pixel_mask[BAD_PIXEL_MASK_WORDS];
+
+void update_spot_finding_mask() {
+    for (size_t i = 0; i < BAD_PIXEL_MASK_WORDS; i++)
+        bad_pixel_mask[i] = pedestal_bad_pixel_mask[i] | resolution_mask[i];
+    // CPU spot finding uses host copy directly
+    if (!receiver_settings.cpu_spot_finding) upload_bad_pixel_mask();
+}
+
+// Bad pixels are stored in composed image coordinates, as used by spot finding
 void update_bad_pixel_list() {
-    bad_pixels.clear();
-    for (int i = 0; i < NPIXEL; i++) {
-        if (gain_pedestal_data[6*NPIXEL+i] != 0) {
-            size_t module = i / (MODULE_LINES * MODULE_COLS);
-            size_t line = (i / MODULE_LINES) % MODULE_COLS;
-            size_t column = i % (MODULE_COLS * MODULE_LINES);
-            uint16_t line_out = (513L - line - (line / 256) * 2L + 514L * (3 - (module / 2))) * 2L + module % 2;
-            uint16_t column_out = column + (column / 256) * 2L;
-            bad_pixels.insert(std::pair<int16_t, int16_t>(column_out, line_out));
-        }
-    }
+    bad_pixel_count = geometry_mask_bitmap(receiver_geometry, gain_pedestal_data + 6*NPIXEL, pedestal_bad_pixel_mask);
+    update_spot_finding_mask();
 }
 
 
@@ -261,6 +343,9 @@ int TCP_accept_connection() {
     // Accept TCP/IP connection
     socklen_t addrlen = sizeof(client_address);
     accepted_socket = accept(sockfd, (struct sockaddr *)&client_address, &addrlen);
+    // Small messages are not delayed, spot stream batches are coalesced with TCP_CORK
+    int flag = 1;
+    setsockopt(accepted_socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
     return TCP_exchange_magic_number();
 }
 
@@ -272,6 +357,7 @@ void TCP_exchange_IB_parameters(ib_comm_settings_t *remote) {
     ib_comm_settings_t local;
     local.qp_num = ib_settings.qp->qp_num;
     local.dlid = ib_settings.port_attr.lid;
+    local.gid = ib_settings.gid;
     local.rq_psn = RDMA_SQ_PSN;
 
     // Send parameters
@@ -281,6 +367,19 @@ void TCP_exchange_IB_parameters(ib_comm_settings_t *remote) {
     read(accepted_socket, remote, sizeof(ib_comm_settings_t));
 }
 
+int TCP_send(int sockfd, const char *buffer, size_t size) {
+    size_t remaining_size = size;
+    while (remaining_size > 0) {
+        ssize_t sent = send(sockfd, buffer + (size - remaining_size), remaining_size, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            std::cerr << "Error writing to TCP/IP socket" << std::endl;
+            return 1;
+        }
+        else remaining_size -= sent;
+    }
+    return 0;
+}
+
 int TCP_receive(int sockfd, char *buffer, size_t size) {
     size_t remaining_size = size;
     while (remaining_size > 0) {
@@ -298,17 +397,31 @@ int main(int argc, char **argv) {
     int ret;
 
     std::cout << "JF Receiver " << std::endl;
+    startup_step_start = startup_time_us();
 
     // Parse input parameters
     if (parse_input(argc, argv) == 1) exit(EXIT_FAILURE);
 
     // Allocate memory
     if (allocate_memory() == 1) exit(EXIT_FAILURE);
+    if (setup_trace(receiver_settings.compression_threads) == 1) exit(EXIT_FAILURE);
     std::cout << "Memory allocated" << std::endl;
+    startup_step_done("Allocate memory");
+
+    populate_memory();
+    startup_step_done("Populate memory");
+
+    // Build geometry description and select transform implementation
+    setup_geometry(receiver_geometry, NMODULES, 2, true);
+    setup_transform(receiver_geometry, receiver_settings.scalar_transform);
 
     // Load pedestal file
     load_pedestal(receiver_settings.pedestal_file_name);
 
+    // Map gain files
+    load_gain_maps();
+    startup_step_done("Geometry, pedestal and gain");
+
     // Load test data
 #ifdef RECEIVE_FROM_FILE
     std::ifstream ifile1("output_data" + std::to_string(receiver_settings.card_number) + ".dat", std::ios::binary | std::ios::in);
@@ -327,6 +440,7 @@ int main(int argc, char **argv) {
     // Establish RDMA link
     if (setup_ibverbs(ib_settings, receiver_settings.ib_dev_name.c_str(), RDMA_SQ_SIZE, 0) == 1) exit(EXIT_FAILURE);
     std::cout << "IB link ready" << std::endl;
+    startup_step_done("IB setup");
 
     // Register memory regions
     ib_settings.buffer_mr = ibv_reg_mr(ib_settings.pd, ib_buffer, ib_buffer_size, 0);
@@ -335,8 +449,34 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    // Allocate space on GPU
-    if (setup_gpu(receiver_settings.gpu_device) == 1) exit(EXIT_FAILURE);
+    frame_buffer_mr = ibv_reg_mr(ib_settings.pd, frame_buffer, frame_buffer_size, 0);
+    if (frame_buffer_mr == NULL) {
+        std::cerr << "Failed to register frame buffer as IB memory region." << std::endl;
+        return 1;
+    }
+    startup_step_done("ibv_reg_mr");
+
+    // Allocate space on GPU, without GPU strong pixels are found on CPU
+    if (!receiver_settings.cpu_spot_finding && !gpu_available(receiver_settings.gpu_device)) {
+        std::cout << "GPU " << receiver_settings.gpu_device << " not present, spot finding on CPU" << std::endl;
+        receiver_settings.cpu_spot_finding = true;
+    }
+    if (receiver_settings.cpu_spot_finding) {
+        if (setup_cpu_spot_finding(receiver_settings.cpu_spot_threads, receiver_settings.scalar_transform) == 1)
+            exit(EXIT_FAILURE);
+        startup_step_done("CPU spot finding setup");
+    } else {
+        // Kernel body is the same for host and GPU, so it is checked on CPU first
+        if (receiver_settings.sat_spot_kernel && !test_sat_spot_kernel()) {
+            std::cerr << "Using colspot kernel" << std::endl;
+            receiver_settings.sat_spot_kernel = false;
+        }
+        if (setup_gpu(receiver_settings.gpu_device) == 1) exit(EXIT_FAILURE);
+        startup_step_done("GPU setup (cudaHostRegister)");
+    }
+
+    // Bad pixels from the pedestal file are used already for the first data collection
+    update_bad_pixel_list();
 
     // Establish TCP/IP server
     if (TCP_server(receiver_settings.tcp_port) == 1) exit(EXIT_FAILURE);
@@ -344,7 +484,10 @@ int main(int argc, char **argv) {
 #ifndef RECEIVE_FROM_FILE
     // Connect to FPGA board
     if (setup_snap(receiver_settings.card_number) == 1) exit(EXIT_FAILURE);
+    startup_step_done("FPGA attach");
 #endif
+    print_startup_timeline();
+
     while (1) {
         // Accept TCP/IP communication
         while (TCP_accept_connection() != 0);
@@ -361,7 +504,7 @@ int main(int argc, char **argv) {
         TCP_exchange_IB_parameters(&remote);
 
         // Switch to ready to send state for IB
-        if (switch_to_rtr(ib_settings, 0, remote.dlid, remote.qp_num) == 1) exit(EXIT_FAILURE);
+        if (switch_to_rtr(ib_settings, 0, remote.dlid, remote.qp_num, remote.gid) == 1) exit(EXIT_FAILURE);
         std::cout << "IB Ready to receive" << std::endl;
         if (switch_to_rts(ib_settings, RDMA_SQ_PSN) == 1) exit(EXIT_FAILURE);
         std::cout << "IB Ready to send" << std::endl;
@@ -370,22 +513,40 @@ int main(int argc, char **argv) {
         std::cout << "Images to write: " << experiment_settings.nimages_to_write << std::endl;
         std::cout << "Summation: " << experiment_settings.summation << std::endl;
         std::cout << "Spot finding enabled: " << experiment_settings.enable_spot_finding << std::endl;
+        // Kernels are compiled only for limited range of box sizes
+        if ((experiment_settings.spot_finding_nbx < 1) || (experiment_settings.spot_finding_nbx > SPOT_BOX_MAX_HALF_WIDTH) ||
+            (experiment_settings.spot_finding_nby < 1) || (experiment_settings.spot_finding_nby > SPOT_BOX_MAX_HALF_WIDTH)) {
+            std::cerr << "Spot finding box half-width must be in range 1 to " << SPOT_BOX_MAX_HALF_WIDTH
+                      << ", using " << SPOT_BOX_DEFAULT_HALF_WIDTH << std::endl;
+            experiment_settings.spot_finding_nbx = SPOT_BOX_DEFAULT_HALF_WIDTH;
+            experiment_settings.spot_finding_nby = SPOT_BOX_DEFAULT_HALF_WIDTH;
+        }
+        if (experiment_settings.enable_spot_finding) {
+            std::cout << "Spot finding box: NBX " << experiment_settings.spot_finding_nbx
+                      << " NBY " << experiment_settings.spot_finding_nby << std::endl;
+            // Resolution map follows beam center, distance and energy of the data collection
+            if (update_resolution_map()) update_spot_finding_mask();
+        }
+        std::cout << "Receiver compression: " << experiment_settings.receiver_compression << std::endl;
+        std::cout << "Latency trace: " << experiment_settings.latency_trace << std::endl;
+
+        if (experiment_settings.receiver_compression && (setup_compressed_buffer() == 1)) exit(EXIT_FAILURE);
 
-        memset(ib_buffer_occupancy, 0, RDMA_SQ_SIZE * sizeof(uint16_t));
+        reset_ib_slots();
 
         for (int i = 0; i < NMODULES; i++)
             online_statistics->head[i] = 0;
 
-        // TODO: Load gain before, only multiply by energy here
         // TODO: Multi-pixels divided by two/four in gain calculation
-        // Load gain files (double, per module)
-        for (int i = 0; i < NMODULES; i++)
-            load_gain(receiver_settings.gain_file_name[i], i, experiment_settings.energy_in_keV);
+        // Fixed-point gain factors for the energy (gain files are loaded at startup)
+        if (set_gain_energy(experiment_settings.energy_in_keV) == 1) exit(EXIT_FAILURE);
 
         // Barrier #1
         TCP_exchange_magic_number();
 
         pthread_t poll_cq_thread;
+        pthread_t frame_watcher_thread;
+        pthread_t trace_thread;
         pthread_t snap_thread;
         pthread_t gpu_thread[NCUDA_STREAMS];
         pthread_t send_thread[receiver_settings.compression_threads];
@@ -393,19 +554,43 @@ int main(int argc, char **argv) {
         ThreadArg send_thread_arg[receiver_settings.compression_threads];
 
 
+        // Count dTLB misses of all threads of the run
+        int dtlb_counter = open_dtlb_miss_counter();
+
         // Reset counter for GPU synchronization
         if (experiment_settings.enable_spot_finding) {
+            reset_spot_stitching();
+            strong_pixel_overflow_images = 0;
+            strong_pixel_overflow_pixels = 0;
             for (int i = 0; i < NCUDA_STREAMS*CUDA_TO_IB_BUFFER; i++) {
-                writer_threads_done[i] = 0;
+                chunk_images_written[i] = 0;
                 cuda_stream_ready[i]   = i;
             }
+            for (int i = 0; i < NCUDA_STREAMS; i++)
+                strong_pixel_histogram[i].clear();
+            start_spot_stream();
+            if (!receiver_settings.cpu_spot_finding)
+                start_spot_assembly(receiver_settings.spot_assembly_threads);
             for (int i = 0; i < NCUDA_STREAMS; i++) {
                 gpu_thread_arg[i].ThreadID = i;
-                ret = pthread_create(gpu_thread+i, NULL, run_gpu_thread, gpu_thread_arg+i);
+                ret = pthread_create(gpu_thread+i, NULL,
+                                     receiver_settings.cpu_spot_finding ? run_cpu_spot_thread : run_gpu_thread,
+                                     gpu_thread_arg+i);
                 PTHREAD_ERROR(ret,pthread_create);
             }
         }
 
+        reset_trace(experiment_settings.latency_trace);
+        if (trace_enabled) {
+            ret = pthread_create(&trace_thread, NULL, run_trace_thread, NULL);
+            PTHREAD_ERROR(ret,pthread_create);
+        }
+
+        reset_frame_watcher();
+        ret = pthread_create(&frame_watcher_thread, NULL, run_frame_watcher_thread, NULL);
+        PTHREAD_ERROR(ret,pthread_create);
+
+        setup_image_scheduler(experiment_settings.nimages_to_write, receiver_settings.compression_threads);
         for (int i = 0; i < receiver_settings.compression_threads ; i++) {
             send_thread_arg[i].ThreadID = i;
             ret = pthread_create(send_thread+i, NULL, run_send_thread, send_thread_arg+i);
@@ -437,6 +622,8 @@ int main(int argc, char **argv) {
                 ret = pthread_join(gpu_thread[i], NULL);
                 PTHREAD_ERROR(ret, pthread_join);
             }
+            if (!receiver_settings.cpu_spot_finding) finish_spot_assembly();
+            finish_spot_stream();
         }
 
         // Check for thread completion
@@ -448,12 +635,26 @@ int main(int argc, char **argv) {
             ret = pthread_join(send_thread[i], NULL);
             PTHREAD_ERROR(ret,pthread_join);
         }
+        close_image_scheduler();
+
+        // Stop frame watcher
+        frame_watcher_stop = true;
+        ret = pthread_join(frame_watcher_thread, NULL);
+        PTHREAD_ERROR(ret,pthread_join);
+
+        // Stop trace thread, when all events are recorded
+        if (trace_enabled) {
+            trace_thread_stop = true;
+            ret = pthread_join(trace_thread, NULL);
+            PTHREAD_ERROR(ret,pthread_join);
+        }
 
         // Check for SNAP thread completion
 #ifndef RECEIVE_FROM_FILE
         ret = pthread_join(snap_thread, NULL);
         PTHREAD_ERROR(ret, pthread_join);
 #endif
+        int64_t dtlb_misses = close_dtlb_miss_counter(dtlb_counter);
 
         // Print some quick statistics
         std::cout << "Good packets " << online_statistics->good_packets << " Frames to collect: " << experiment_settings.nframes_to_collect << std::endl;
@@ -464,16 +665,48 @@ int main(int argc, char **argv) {
         else
             std::cout << "Frames collected " << ((double)(online_statistics->good_packets / NMODULES / 128)) / (double) experiment_settings.nframes_to_collect * 100.0 << "%" << std::endl;
 
+        std::cout << "IB slot waits: " << ib_slot_statistics.waits << " images (" << ib_slot_statistics.futex_waits << " sleeping), "
+                  << ib_slot_statistics.wait_time_us / 1000 << " ms out of " << ib_slot_statistics.send_time_us / 1000 << " ms send thread time" << std::endl;
+        if (experiment_settings.conversion_mode != MODE_CONV)
+            std::cout << "Zero-copy frames: " << ib_slot_statistics.zero_copy << " of " << experiment_settings.nimages_to_write
+                      << " (possible overruns: " << ib_slot_statistics.overrun << ")" << std::endl;
+        std::cout << "Sent over IB: " << ib_slot_statistics.sent_bytes / (1024*1024) << " MiB" << std::endl;
+        print_frame_wait_histogram();
+        if (dtlb_misses >= 0)
+            std::cout << "dTLB misses: " << dtlb_misses << " (" << dtlb_misses / std::max<uint64_t>(experiment_settings.nimages_to_write, 1) << " per image)" << std::endl;
+        if (trace_enabled) print_latency_statistics(latency_statistics);
+
         std::cout << "First frame collected/written - frame number: " << jf_packet_headers[0].jf_frame_number << " Timestamp " << jf_packet_headers[0].jf_timestamp << std::endl;
         std::cout << "Second frame collected/written - frame number: " << jf_packet_headers[1].jf_frame_number << " Timestamp " << jf_packet_headers[1].jf_timestamp << std::endl;
         // Send header data and collection statistics
         send(accepted_socket, online_statistics, sizeof(online_statistics_t), 0);
+        // Send latency of pipeline stages (empty, if trace is disabled)
+        send(accepted_socket, &latency_statistics, sizeof(latency_statistics_t), 0);
         // Send gain, pedestal and pixel mask
         send(accepted_socket, gain_pedestal_data, 7*NPIXEL*sizeof(uint16_t), 0);
 
+        // Send hot pixel histogram (number of entries, then entries)
+        std::vector<strong_pixel_count_t> strong_pixel_counts;
+        merge_strong_pixel_histograms(strong_pixel_counts);
+        size_t strong_pixel_counts_size = strong_pixel_counts.size();
+        send(accepted_socket, &strong_pixel_counts_size, sizeof(size_t), 0);
+        if (strong_pixel_counts_size > 0)
+            send(accepted_socket, strong_pixel_counts.data(), strong_pixel_counts_size * sizeof(strong_pixel_count_t), 0);
+        std::cout << "Pixels found strong at least once: " << strong_pixel_counts_size << std::endl;
+
+        // Send zero-copy images, which could be overwritten before send completed (number of entries, then entries)
+        std::sort(ib_slot_overrun_images.begin(), ib_slot_overrun_images.end());
+        size_t overrun_images_size = ib_slot_overrun_images.size();
+        send(accepted_socket, &overrun_images_size, sizeof(size_t), 0);
+        if (overrun_images_size > 0)
+            send(accepted_socket, ib_slot_overrun_images.data(), overrun_images_size * sizeof(uint32_t), 0);
+        if (strong_pixel_overflow_images > 0)
+            std::cout << "Images with strong pixel overflow: " << strong_pixel_overflow_images
+                      << " (" << strong_pixel_overflow_pixels << " pixels not saved)" << std::endl;
+
         // Update bad pixel pixel list for spot finding;
         update_bad_pixel_list();
-        std::cout << "Bad pixel count " << bad_pixels.size() << std::endl;
+        std::cout << "Bad pixel count " << bad_pixel_count << std::endl;
 
         // Reset QP
         switch_to_reset(ib_settings);
@@ -508,7 +741,6 @@ int main(int argc, char **argv) {
 
         // Reset status buffer
         memset(status_buffer, 0x0, status_buffer_size);
-        memset(strong_pixel_count, 0x0, strong_pixel_count_size);
     }
 
 #ifndef RECEIVE_FROM_FILE
@@ -516,7 +748,8 @@ int main(int argc, char **argv) {
     close_snap();
 #endif
     // Close GPU
-    close_gpu();
+    if (receiver_settings.cpu_spot_finding) close_cpu_spot_finding();
+    else close_gpu();
 
     // Save pedestal
     save_pedestal(receiver_settings.pedestal_file_name);
@@ -526,6 +759,8 @@ int main(int argc, char **argv) {
 
     // Deregister memory region
     ibv_dereg_mr(ib_settings.buffer_mr);
+    ibv_dereg_mr(frame_buffer_mr);
+    if (ib_compressed_buffer_mr != NULL) ibv_dereg_mr(ib_compressed_buffer_mr);
 
     // Close RDMA
     close_ibverbs(ib_settings);
@@ -535,6 +770,8 @@ int main(int argc, char **argv) {
 
     // Deallocate memory
     deallocate_memory();
+    close_trace();
+    close_gain_maps();
 
     // Quit peacefully
     std::cout << "JFReceiver Done" << std::endl;
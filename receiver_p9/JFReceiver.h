@@ -18,8 +18,10 @@
 #define _JFRECEIVER_H
 
 #include <vector>
-#include <set>
-#include <map>
+#include <unordered_map>
+#include <atomic>
+#include <deque>
+#include <time.h>
 
 #include "../include/JFApp.h"
 #define FRAME_LIMIT 1000000L
@@ -35,15 +37,19 @@
 
 #define RDMA_SQ_PSN 532
 #define RDMA_SQ_SIZE (NCUDA_STREAMS*CUDA_TO_IB_BUFFER*NIMAGES_PER_STREAM) // 3840, size of send queue, must be multiplier of frames per CUDA stream
+#define SEND_BATCH_MAX 64 // Maximum number of WRs chained in one post
+
+// Raw frames are sent directly from frame buffer, if FPGA is at least this number of frames
+// from overwriting the frame - otherwise frame is copied to IB buffer
+#define FRAME_BUF_HEADROOM (FRAME_BUF_SIZE / 4)
 
 // Maximum number of strong pixel in 2 veritcal modules
-// if there are more pixels, these will be overwritten
-// in ring buffer fashion
+// if there are more pixels, these are only counted as overflow
 #define MAX_STRONG 16384L
-
-// Size of bounding box for pixel
-#define NBX 3
-#define NBY 3
+// Compacted GPU output holds on average this many strong pixels per fragment of a chunk
+// (MAX_STRONG for every fragment would need ~0.8 GB on GPU and twice that pinned on host)
+// pixels above are also counted as overflow
+#define COMPACT_STRONG_PER_FRAGMENT 2048L
 
 // TODO - this should be in common header
 #define COLS (2*1030L)
@@ -62,6 +68,12 @@ struct receiver_settings_t {
 	std::string pedestal_file_name;
 	std::string ib_dev_name;
         int gpu_device;
+	bool     scalar_transform;  // use scalar reference implementation of geometry transform
+	size_t   send_batch;        // frames posted as one chain of IB WRs, only last one is signaled
+	bool     cpu_spot_finding;  // find strong pixels on CPU, selected if there is no GPU
+	int      cpu_spot_threads;  // size of thread pool for CPU spot finding
+	bool     sat_spot_kernel;   // GPU strong pixel finder with summed-area tables (colspot_sat.h)
+	int      spot_assembly_threads; // workers labeling spots found on GPU (at most NCUDA_STREAMS)
 };
 extern receiver_settings_t receiver_settings;
 
@@ -69,19 +81,42 @@ extern receiver_settings_t receiver_settings;
 struct strong_pixel {
     int16_t col;           // column
     int16_t line;          // line (relative to chunk (2x vertical modules) read by GPU)
-    float photons;      // intensity of the pixel divide by (2*NBX+1) * (2*NBY+1) to get background subtracted photon count
+    float photons;      // intensity of the pixel divide by (2*nbx+1) * (2*nby+1) to get background subtracted photon count
+};
+
+// Strong pixels of fragment i are output[index[i].offset] ... output[index[i].offset + index[i].saved - 1]
+// GPU output is compacted (offset is prefix sum of saved pixels), CPU output has fixed MAX_STRONG window per fragment
+struct strong_pixel_index_t {
+    uint32_t offset;
+    uint32_t found;     // including pixels above MAX_STRONG or above compacted output size, which were not saved
+    uint32_t saved;
+};
+
+// Strong pixel after background subtraction, as used to construct spots (line is relative to the card)
+struct spot_pixel_t {
+    int16_t col;
+    int16_t line;
+    float photons;
+};
+
+// Run of strong pixels in one line of a fragment (2 horizontally connected modules of one frame)
+// Runs are nodes of union-find, which labels connected spots
+struct spot_run_t {
+    uint32_t first_pixel; // index of the first pixel in the pixel list
+    int16_t line;
+    int16_t col_start;
+    int16_t col_end;      // inclusive
 };
 
-typedef std::pair<int16_t, int16_t> coordxy_t; // This is simply (x, y)
-typedef std::map<coordxy_t, float> strong_pixel_map_t;
-// This is mapping (x,y) --> intensity
-// it allows to find if there is spot in (x,y) in log time
-typedef std::vector<strong_pixel_map_t> strong_pixel_maps_t;
-// There is one map per 1/2 frame
+// Strong pixel counts (col + line * COLS -> count), merged at the end of data collection
+// Each spot assembly worker (GPU) or CPU spot finding thread has own histogram
+typedef std::unordered_map<uint32_t, uint32_t> strong_pixel_histogram_t;
+extern strong_pixel_histogram_t strong_pixel_histogram[NCUDA_STREAMS];
+void merge_strong_pixel_histograms(std::vector<strong_pixel_count_t> &output);
 
-extern uint64_t *strong_pixel_count;
-extern const size_t strong_pixel_count_size;
-extern pthread_mutex_t strong_pixel_count_mutex;
+// Strong pixels not saved, because fragment had more than MAX_STRONG (summed over all threads, reset for each data collection)
+extern std::atomic<uint64_t> strong_pixel_overflow_images;
+extern std::atomic<uint64_t> strong_pixel_overflow_pixels;
 
 // Buffers for communication with the FPGA
 extern int16_t *frame_buffer;
@@ -104,10 +139,26 @@ extern ib_settings_t ib_settings;
 extern const size_t ib_buffer_size;
 extern char *ib_buffer;
 
+// Frame buffer registered for zero-copy sending of raw frames
+extern ibv_mr *frame_buffer_mr;
+
+// Buffer for images compressed by receiver - allocated and registered only when compression is requested
+// GPU still reads uncompressed images from IB buffer
+extern char *ib_compressed_buffer;
+extern size_t ib_compressed_buffer_size;
+extern ibv_mr *ib_compressed_buffer_mr;
+size_t ib_compressed_slot_size();
+int setup_compressed_buffer();
+
 // TCP/IP socket
 extern int sockfd;
 extern int accepted_socket; // There is only one accepted socket at the time
-extern pthread_mutex_t accepted_socket_mutex; // For sending spot finding results, mutex is necessary to ensure data consistency on accepted_socket
+int TCP_send(int sockfd, const char *buffer, size_t size);
+
+// Spot stream (SpotStream.cpp) - during data collection only the sender thread writes to accepted_socket
+void start_spot_stream();
+void queue_spots(size_t chunk, size_t image0, size_t images, size_t overflow_images, std::vector<spot_t> &spots);
+void finish_spot_stream();
 
 // Thread information
 struct ThreadArg {
@@ -121,32 +172,240 @@ extern pthread_mutex_t trigger_frame_mutex;
 extern pthread_cond_t  trigger_frame_cond;
 
 // IB buffer usage
-extern int16_t ib_buffer_occupancy[RDMA_SQ_SIZE];
-extern pthread_mutex_t ib_buffer_occupancy_mutex;
-extern pthread_cond_t ib_buffer_occupancy_cond;
+// Slot k can be filled by image number equal to ib_slot_sequence[k]
+// CQ poll thread advances the sequence by number of slots once send is completed
+// Send threads spin on their slot and then sleep on futex (ib_slot_waiters > 0 tells poller to wake them up)
+extern std::atomic<uint32_t> ib_slot_sequence[RDMA_SQ_SIZE];
+extern std::atomic<uint32_t> ib_slot_waiters[RDMA_SQ_SIZE];
+extern bool ib_slot_zero_copy[RDMA_SQ_SIZE]; // slot content was sent from frame buffer
+extern uint32_t ib_slot_batch_prev[RDMA_SQ_SIZE]; // previous image in the same send batch
+
+// Time spent by send threads waiting for free IB slots (i.e. for IB backpressure)
+struct ib_slot_statistics_t {
+    std::atomic<uint64_t> waits;          // images, which had to wait for slot
+    std::atomic<uint64_t> futex_waits;    // waits, which needed to sleep in kernel
+    std::atomic<uint64_t> wait_time_us;   // total time waiting for slots
+    std::atomic<uint64_t> send_time_us;   // total run time of send threads
+    std::atomic<uint64_t> posted;         // WRs posted to send queue
+    std::atomic<uint64_t> zero_copy;      // raw frames sent directly from frame buffer
+    std::atomic<uint64_t> overrun;        // zero-copy frames, which could be overwritten by FPGA before send completed
+    std::atomic<uint64_t> sent_bytes;     // bytes sent over IB
+};
+extern ib_slot_statistics_t ib_slot_statistics;
+// Zero-copy images, which could be overwritten by FPGA before send completed - only CQ poll thread adds to the list
+// List is sent to writer after collection, so these images are flagged in the master file
+extern std::vector<uint32_t> ib_slot_overrun_images;
+
+size_t ib_slot_count();
+void reset_ib_slots();
+
+// Frame arrival watcher
+// Single thread follows heads of all modules and publishes the lowest one, send threads sleep on futex till their frame arrives
+#define FRAME_WAIT_HISTOGRAM_BINS 32 // log2 of wait time in us
+extern std::atomic<uint32_t> frame_arrival_seq;
+extern std::atomic<uint32_t> frame_arrival_waiters;
+extern std::atomic<bool> frame_watcher_stop;
+extern std::atomic<uint64_t> frame_wait_histogram[FRAME_WAIT_HISTOGRAM_BINS];
+
+void reset_frame_watcher();
+void print_frame_wait_histogram();
+
+// Gain maps (GainCache.cpp)
+#define GAIN_CACHE_SIZE 4  // number of energies, for which fixed-point gain factors are kept
+#define GAIN_THREADS   16  // threads calculating fixed-point gain factors
+int load_gain_maps();
+void close_gain_maps();
+int set_gain_energy(double energy_in_keV);
+
+// Latency tracing (Trace.cpp)
+// Each thread records events into own single-producer ring buffer, trace thread matches events of the same image
+// and adds time between them to histogram of the pipeline stage
+enum trace_event_t {
+    TRACE_FRAME_ARRIVED,  // all frames of image arrived (frame watcher)
+    TRACE_SEND_START,     // send thread starts processing image
+    TRACE_IMAGE_READY,    // image prepared in IB buffer or to be sent from frame buffer
+    TRACE_POSTED,         // RDMA send posted
+    TRACE_COMPLETED,      // send completion retrieved (poll CQ thread)
+    TRACE_GPU_TAKEN,      // chunk with image taken by GPU thread
+    TRACE_EVENTS
+};
+
+#define TRACE_RING_SIZE 16384L  // records, must be power of 2
+
+// Ring buffers: poll CQ thread, frame watcher, GPU threads and send threads
+#define TRACE_RING_POLL_CQ       0
+#define TRACE_RING_FRAME_WATCHER 1
+#define TRACE_RING_GPU(x)        (2 + (x))
+#define TRACE_RING_SEND(x)       (2 + NCUDA_STREAMS + (x))
+
+struct trace_record_t {
+    uint64_t time_ns;
+    uint32_t image;
+    uint16_t event;
+    uint16_t nimages;    // event applies to images image ... image + nimages - 1
+};
+
+struct trace_ring_t {
+    std::atomic<uint64_t> head;  // written by producer thread
+    char pad0[120];
+    std::atomic<uint64_t> tail;  // written by trace thread
+    char pad1[120];
+    uint64_t tail_cache;         // last tail seen by producer
+    uint64_t dropped;
+    trace_record_t records[TRACE_RING_SIZE];
+};
+
+extern bool trace_enabled;
+extern trace_ring_t *trace_rings;
+extern latency_statistics_t latency_statistics;
+
+inline uint64_t trace_time_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Only owner thread writes to the ring, if the ring is full event is dropped
+inline void trace_event(size_t ring_id, uint16_t event, uint32_t image, uint16_t nimages = 1, uint64_t time_ns = 0) {
+    if (!trace_enabled) return;
+    trace_ring_t &ring = trace_rings[ring_id];
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    if (head - ring.tail_cache >= TRACE_RING_SIZE) {
+        ring.tail_cache = ring.tail.load(std::memory_order_acquire);
+        if (head - ring.tail_cache >= TRACE_RING_SIZE) {
+            ring.dropped++;
+            return;
+        }
+    }
+    trace_record_t &record = ring.records[head & (TRACE_RING_SIZE - 1)];
+    record.time_ns = (time_ns == 0) ? trace_time_ns() : time_ns;
+    record.image   = image;
+    record.event   = event;
+    record.nimages = nimages;
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+int setup_trace(int send_threads);
+void reset_trace(bool enable);
+void close_trace();
+void *run_trace_thread(void *in_threadarg);
+extern std::atomic<bool> trace_thread_stop;
+
+// Work-stealing scheduler of images for send threads
+// Images are split into blocks, which are distributed round-robin to per-thread queues
+// Thread takes blocks from its own queue, when it is empty (or far ahead of the oldest block), it steals from other threads
+#define SCHEDULER_BLOCK_IMAGES 8
+struct image_block_t {
+    size_t first;
+    size_t last; // not included
+};
+
+struct image_queue_t {
+    pthread_mutex_t mutex;
+    std::deque<image_block_t> blocks;
+};
+
+void setup_image_scheduler(size_t nimages, int nthreads);
+void close_image_scheduler();
+bool get_image_block(int thread_id, image_block_t &block, uint64_t &steals);
 
 int setup_snap(uint32_t card_number);
 void close_snap();
 
 void *run_snap_thread(void *in_threadarg);
 void *run_poll_cq_thread(void *in_threadarg);
+void *run_frame_watcher_thread(void *in_threadarg);
 void *run_send_thread(void *in_threadarg);
 void *run_gpu_thread(void *in_threadarg);
 
 int parse_input(int argc, char **argv);
 
+// Geometry transform of module lines (transform.cpp)
+// Pointers are set by setup_transform() to the fastest implementation available on the CPU
+extern detector_geometry_t receiver_geometry;
+extern void (*transform_lines16)(const detector_geometry_t &geometry, int16_t *output, const int16_t *input,
+                                 size_t module, size_t line0, size_t nlines);
+extern void (*transform_lines32)(const detector_geometry_t &geometry, int32_t *output, const int32_t *input,
+                                 size_t module, size_t line0, size_t nlines);
+void setup_transform(const detector_geometry_t &geometry, bool force_scalar);
+
+// Frame summation is done in blocks of module lines, so accumulator fits in L1 cache
+#define SUMMATION_BLOCK_LINES 4L
+void sum_frames_accumulate(int32_t *sum, int16_t *mask, const int16_t *source, size_t npixel);
+void sum_frames_finalize(int32_t *sum, const int16_t *mask, size_t npixel);
+
+bool gpu_available(int device);
 int setup_gpu(int device); 
 int close_gpu();
 
+// Strong pixel finder on CPU (find_spots_cpu.cpp), same output layout as GPU kernel
+// Vector implementation is selected and checked against scalar reference by setup_cpu_spot_finding()
+int setup_cpu_spot_finding(int nthreads, bool force_scalar);
+int close_cpu_spot_finding();
+void find_spots_cpu(const char *in, strong_pixel *out, strong_pixel_index_t *index, size_t nfragments, int pixel_depth,
+                    float strong, int nbx, int nby);
+void *run_cpu_spot_thread(void *in_threadarg);
+bool test_sat_spot_kernel();
+
 extern pthread_mutex_t cuda_stream_ready_mutex[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
 extern pthread_cond_t  cuda_stream_ready_cond[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
 extern int cuda_stream_ready[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
 
-extern pthread_mutex_t writer_threads_done_mutex[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
-extern pthread_cond_t writer_threads_done_cond[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
-extern int writer_threads_done[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
-
-extern std::set<std::pair<int16_t, int16_t> > bad_pixels;
-void analyze_spots(strong_pixel *host_out, std::vector<spot_t> &spots, bool connect_frames, size_t images, size_t image0);
+// Images of the chunk already written to IB buffer, GPU thread is woken up when chunk is complete
+extern pthread_mutex_t chunk_written_mutex[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
+extern pthread_cond_t chunk_written_cond[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
+extern std::atomic<size_t> chunk_images_written[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
+
+// Bad pixels in spot finder coordinates (col + line * COLS, for both halves of the card), one bit per pixel
+// Pixels beyond spot finding resolution limit are included as well, so these are skipped before thresholding
+// Copy is kept in GPU memory, so bad pixels are not reported as strong
+#define BAD_PIXEL_MASK_WORDS ((COLS * 2 * LINES + 63) / 64)
+extern uint64_t bad_pixel_mask[BAD_PIXEL_MASK_WORDS];
+extern size_t bad_pixel_count;
+
+inline bool is_bad_pixel(int16_t col, int16_t line) {
+    size_t pixel = col + line * COLS;
+    return (bad_pixel_mask[pixel / 64] >> (pixel % 64)) & 1;
+}
+int upload_bad_pixel_mask();
+
+// Per-pixel 1/d^2 of the card, used for spot resolution (analyze_spots.cpp)
+extern uint64_t resolution_mask[BAD_PIXEL_MASK_WORDS]; // pixels beyond resolution limit
+bool update_resolution_map();
+
+size_t analyze_spots(const strong_pixel *host_out, const strong_pixel_index_t *index, std::vector<spot_t> &spots,
+                     strong_pixel_histogram_t &histogram, bool connect_frames, size_t images, size_t image0, size_t chunk);
+
+// With connect_frames, spots touching first or last frame of a chunk are joined across chunks
+// Spot sums are not yet divided by photons, frames are relative to image0
+struct boundary_pixel_t {
+    uint32_t pixel; // col + line * COLS
+    uint32_t spot;
+};
+struct spot_boundary_t {
+    size_t image0;
+    std::vector<spot_t> spots;
+    std::vector<boundary_pixel_t> first_frame_pixels; // sorted by pixel
+    std::vector<boundary_pixel_t> last_frame_pixels;  // sorted by pixel
+};
+void reset_spot_stitching();
+void stitch_spots(size_t chunk, spot_boundary_t &boundary, std::vector<spot_t> &spots);
+
+// Spot assembly workers (SpotAssemblyThread.cpp) run analyze_spots and send spots for chunks done by GPU threads
+#define SPOT_ASSEMBLY_BUFFERS 2 // host output buffers per CUDA stream
+#define SPOT_ASSEMBLY_QUEUE_SIZE (NCUDA_STREAMS * SPOT_ASSEMBLY_BUFFERS)
+struct spot_assembly_job_t {
+    const strong_pixel *pixels;
+    const strong_pixel_index_t *index;
+    size_t images;
+    size_t image0;
+    size_t chunk;
+    size_t stream;
+    size_t buffer;
+};
+void start_spot_assembly(int nthreads);
+void acquire_spot_assembly_buffer(size_t stream, size_t buffer);
+void submit_spot_assembly(const spot_assembly_job_t &job);
+void finish_spot_assembly();
 
 #endif
@@ -17,224 +17,526 @@
 #include <unistd.h>
 #include <malloc.h>
 #include <iostream>
+#include <algorithm>
+#include <iomanip>
 #include <arpa/inet.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "../bitshuffle/bitshuffle.h"
 
 #include "JFReceiver.h"
 
+// Taken from bshuf
+extern "C" {
+void bshuf_write_uint64_BE(void* buf, uint64_t num);
+void bshuf_write_uint32_BE(void* buf, uint32_t num);
+}
+
+// Number of spins before send thread goes to sleep waiting for IB slot
+#define IB_SLOT_SPIN 1000
+
+inline int futex_wait(std::atomic<uint32_t> *addr, uint32_t value) {
+    return syscall(SYS_futex, (uint32_t *) addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+inline int futex_wake_all(std::atomic<uint32_t> *addr) {
+    return syscall(SYS_futex, (uint32_t *) addr, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+}
+
+inline uint64_t time_us() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// Heads are updated by FPGA, so must be read from memory every time
 uint32_t lastModuleFrameNumber() {
-    uint32_t retVal = online_statistics->head[0];
+    volatile uint32_t *head = online_statistics->head;
+    uint32_t retVal = head[0];
     for (int i = 1; i < NMODULES; i++) {
-        if (online_statistics->head[i] < retVal) retVal = online_statistics->head[i];
+        if (head[i] < retVal) retVal = head[i];
     }
     return retVal;
 }
 
-
-// Take half of the number, but only if not bad pixel/overload
-inline int16_t half16(int16_t in) {
-    int16_t tmp = in;
-    if ((in > INT16_MIN + 10) && (in > INT16_MAX - 10)) tmp /= 2;
-    return tmp;
+// FPGA overwrites frame buffer slot, when the leading module wraps around
+// so zero-copy needs the highest head, read fresh (frame_arrival_seq is the lowest one and can be stale)
+uint32_t leadingModuleFrameNumber() {
+    volatile uint32_t *head = online_statistics->head;
+    uint32_t retVal = head[0];
+    for (int i = 1; i < NMODULES; i++) {
+        if (head[i] > retVal) retVal = head[i];
+    }
+    return retVal;
 }
 
-// Take quarter of the number, but only if not bad pixel/overload
-inline int16_t quarter16(int16_t in) {
-    int16_t tmp = in;
-    if ((in > INT16_MIN + 10) && (in < INT16_MAX - 10)) tmp /= 4;
-    return tmp;
+// Poll interval of frame watcher, when no send thread is waiting
+#define FRAME_WATCHER_IDLE_US 20
+
+void reset_frame_watcher() {
+    frame_arrival_seq = lastModuleFrameNumber();
+    frame_arrival_waiters = 0;
+    frame_watcher_stop = false;
+    for (int i = 0; i < FRAME_WAIT_HISTOGRAM_BINS; i++)
+        frame_wait_histogram[i] = 0;
 }
 
-// Copy line and extend multipixels
-void copy_line(int16_t *destination, int16_t* source) {
-    for (int i = 0; i < 255; i++) destination[i] = source[i];
-    for (int i = 1; i < 255; i++) destination[i+258] = source[i+256];
-    for (int i = 1; i < 255; i++) destination[i+516] = source[i+512];
-    for (int i = 1; i < 256; i++) destination[i+774] = source[i+768];
-    for (int i = 0; i < 3; i++) {
-        int16_t tmp1 = half16(source[255 + i*256]);
-        destination[255+i*258] = tmp1;
-        destination[256+i*258] = tmp1;
-        int16_t tmp2 = half16(source[256 + i*256]);
-        destination[257+i*258] = tmp2;
-        destination[258+i*258] = tmp2;
+// Image is complete, when head reaches frame needed by send thread (see run_send_thread)
+void trace_frame_arrival(uint32_t head, uint64_t &images_arrived) {
+    if (!trace_enabled) return;
+    uint64_t images = (head >= 1) ? (head - 1) / experiment_settings.summation : 0;
+    if (images > experiment_settings.nimages_to_write) images = experiment_settings.nimages_to_write;
+    uint64_t now = trace_time_ns();
+    while (images_arrived < images) {
+        uint16_t n = std::min<uint64_t>(images - images_arrived, UINT16_MAX);
+        trace_event(TRACE_RING_FRAME_WATCHER, TRACE_FRAME_ARRIVED, images_arrived, n, now);
+        images_arrived += n;
     }
 }
 
-// Copy line with multi-pixels (255 and 256)
-void copy_line_mid(int16_t *destination, int16_t* source, ssize_t offset) {
-    for (int i = 0; i < 255; i++) {
-         int16_t tmp = half16(source[i]);
-         destination[i] = tmp;
-         destination[i+offset] = tmp;
-    }
-    for (int i = 1; i < 255; i++) {
-         int16_t tmp = half16(source[i+256]);
-         destination[i+258] = tmp;
-         destination[i+258+offset] = tmp;
+void *run_frame_watcher_thread(void *in_threadarg) {
+    uint64_t images_arrived = 0;
+    trace_frame_arrival(frame_arrival_seq.load(), images_arrived);
+
+    while (!frame_watcher_stop.load()) {
+        uint32_t head = lastModuleFrameNumber();
+        if (head != frame_arrival_seq.load(std::memory_order_relaxed)) {
+            frame_arrival_seq.store(head, std::memory_order_release);
+            // Store above must be visible before checking for waiters
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (frame_arrival_waiters.load() > 0)
+                futex_wake_all(&frame_arrival_seq);
+            trace_frame_arrival(head, images_arrived);
+        }
+        // Spin if there are threads waiting for frames
+        if (frame_arrival_waiters.load() == 0) usleep(FRAME_WATCHER_IDLE_US);
     }
+    pthread_exit(0);
+}
+
+// Wait till head of all modules is at least frame_number
+// Returns head
+uint32_t wait_for_frame(uint32_t frame_number) {
+    uint32_t head = frame_arrival_seq.load(std::memory_order_acquire);
+    if (head >= frame_number) return head;
+
+    frame_arrival_waiters++;
+    // Sequence is checked again after registering as waiter, so wake-up cannot be lost
+    while ((head = frame_arrival_seq.load(std::memory_order_acquire)) < frame_number)
+        futex_wait(&frame_arrival_seq, head);
+    frame_arrival_waiters--;
+    return head;
+}
 
-    for (int i = 1; i < 255; i++) {
-         int16_t tmp = half16(source[i+512]);
-         destination[i+516] = tmp;
-         destination[i+516+offset] = tmp;
+inline int histogram_bin(uint64_t value) {
+    int bin = 0;
+    while ((value > 0) && (bin < FRAME_WAIT_HISTOGRAM_BINS - 1)) {
+        value >>= 1;
+        bin++;
     }
+    return bin;
+}
 
-    for (int i = 1; i < 256; i++) {
-         int16_t tmp = half16(source[i+768]);
-         destination[i+774] = tmp;
-         destination[i+774+offset] = tmp;
+void print_frame_wait_histogram() {
+    std::cout << "Frame wait time histogram:" << std::endl;
+    for (int i = 0; i < FRAME_WAIT_HISTOGRAM_BINS; i++) {
+        if (frame_wait_histogram[i] == 0) continue;
+        if (i == 0) std::cout << "       0 us: ";
+        else std::cout << " < " << std::setw(7) << (1L << i) << " us: ";
+        std::cout << frame_wait_histogram[i] << std::endl;
     }
+}
 
-    for (int i = 0; i < 3; i++) {
-        int16_t tmp1 = quarter16(source[255 + i*256]);
-        destination[255+i*258] = tmp1;
-        destination[256+i*258] = tmp1;
-        destination[255+i*258+offset] = tmp1;
-        destination[256+i*258+offset] = tmp1;
-        int16_t tmp2 = quarter16(source[256 + i*256]);
-        destination[257+i*258] = tmp2;
-        destination[258+i*258] = tmp2;
-        destination[257+i*258+offset] = tmp2;
-        destination[258+i*258+offset] = tmp2;
+// If pixel_depth == 4, then only half of buffer size available
+size_t ib_slot_count() {
+    if (experiment_settings.pixel_depth == 2) return RDMA_SQ_SIZE;
+    else return RDMA_SQ_SIZE / 2;
+}
+
+void reset_ib_slots() {
+    for (int i = 0; i < RDMA_SQ_SIZE; i++) {
+        ib_slot_sequence[i] = i;
+        ib_slot_waiters[i] = 0;
+        ib_slot_zero_copy[i] = false;
     }
+    ib_slot_statistics.waits = 0;
+    ib_slot_statistics.futex_waits = 0;
+    ib_slot_statistics.wait_time_us = 0;
+    ib_slot_statistics.send_time_us = 0;
+    ib_slot_statistics.posted = 0;
+    ib_slot_statistics.zero_copy = 0;
+    ib_slot_statistics.overrun = 0;
+    ib_slot_overrun_images.clear();
 }
 
+// Release slot used by image, so it can be reused by image + number of slots
+void release_ib_slot(uint32_t image) {
+    size_t slot = image % ib_slot_count();
+
+    // Frame sent directly from frame buffer must not be overwritten by FPGA before send is completed
+    // If it could be, image is flagged for the writer, as corrupted data were already sent
+    if (ib_slot_zero_copy[slot] &&
+        ((uint64_t) leadingModuleFrameNumber() >= (uint64_t) image * experiment_settings.summation + FRAME_BUF_SIZE)) {
+        ib_slot_statistics.overrun++;
+        ib_slot_overrun_images.push_back(image);
+    }
 
-inline int32_t half32(int32_t in) {
-    int32_t tmp = in;
-    if ((in > INT32_MIN) && (in < INT32_MAX)) tmp /= 2;
-    return tmp;
+    ib_slot_sequence[slot].store(image + ib_slot_count(), std::memory_order_release);
+    // Store above must be visible before checking for waiters
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ib_slot_waiters[slot].load() > 0)
+        futex_wake_all(ib_slot_sequence + slot);
 }
 
-inline int32_t quarter32(int32_t in) {
-    int32_t tmp = in;
-    if ((in > INT32_MIN) && (in < INT32_MAX)) tmp /= 4;
-    return tmp;
+bool ib_slot_ready(uint32_t image) {
+    return ib_slot_sequence[image % ib_slot_count()].load(std::memory_order_acquire) == image;
 }
 
-void copy_line32(int32_t *destination, int32_t* source) {
-    for (int i = 0; i < 255; i++) destination[i] = source[i];
-    for (int i = 1; i < 255; i++) destination[i+258] = source[i+256];
-    for (int i = 1; i < 255; i++) destination[i+516] = source[i+512];
-    for (int i = 1; i < 256; i++) destination[i+774] = source[i+768];
-    for (int i = 0; i < 3; i++) {
-        int32_t tmp1 = half32(source[255 + i*256]);
-        destination[255+i*258] = tmp1;
-        destination[256+i*258] = tmp1;
-        int32_t tmp2 = half32(source[256 + i*256]);
-        destination[257+i*258] = tmp2;
-        destination[258+i*258] = tmp2;
+// Wait till slot is released by previous image using it
+// Returns time spent waiting in us
+uint64_t wait_for_ib_slot(uint32_t image) {
+    size_t slot = image % ib_slot_count();
+    uint32_t seq = ib_slot_sequence[slot].load(std::memory_order_acquire);
+    if (seq == image) return 0;
+
+    uint64_t start = time_us();
+    for (int i = 0; (i < IB_SLOT_SPIN) && (seq != image); i++)
+        seq = ib_slot_sequence[slot].load(std::memory_order_acquire);
+
+    if (seq != image) {
+        ib_slot_statistics.futex_waits++;
+        ib_slot_waiters[slot]++;
+        // Sequence is checked again after registering as waiter, so wake-up cannot be lost
+        while ((seq = ib_slot_sequence[slot].load(std::memory_order_acquire)) != image)
+            futex_wait(ib_slot_sequence + slot, seq);
+        ib_slot_waiters[slot]--;
     }
+    return time_us() - start;
 }
 
-void copy_line_mid32(int32_t *destination, int32_t* source, size_t offset) {
-    for (int i = 0; i < 255; i++) {
-         int32_t tmp = half32(source[i]);
-         destination[i] = tmp;
-         destination[i+offset] = tmp;
-    }
-    for (int i = 1; i < 255; i++) {
-         int32_t tmp = half32(source[i+256]);
-         destination[i+258] = tmp;
-         destination[i+258+offset] = tmp;
+// Completions retrieved with one ibv_poll_cq call
+#define CQ_POLL_BATCH 16
+// Limits for number of empty polls before going to sleep on completion channel
+#define CQ_POLL_SPIN_MIN 64
+#define CQ_POLL_SPIN_MAX 65536
+
+// Poll CQ for up to CQ_POLL_BATCH completions, if CQ is empty spin for a while and then sleep on completion channel
+// Spin length is adapted: doubled if completion arrived while spinning, halved if it was necessary to sleep
+int poll_cq_batch(ibv_wc *ib_wc, size_t &spin, size_t &sleeps) {
+    int num_comp = ibv_poll_cq(ib_settings.cq, CQ_POLL_BATCH, ib_wc);
+    size_t i = 0;
+    while ((num_comp == 0) && (i < spin)) {
+        num_comp = ibv_poll_cq(ib_settings.cq, CQ_POLL_BATCH, ib_wc);
+        i++;
     }
 
-    for (int i = 1; i < 255; i++) {
-         int32_t tmp = half32(source[i+512]);
-         destination[i+516] = tmp;
-         destination[i+516+offset] = tmp;
+    if (num_comp != 0) {
+        if ((i > 0) && (spin < CQ_POLL_SPIN_MAX)) spin *= 2;
+        return num_comp;
     }
 
-    for (int i = 1; i < 256; i++) {
-         int32_t tmp = half32(source[i+768]);
-         destination[i+774] = tmp;
-         destination[i+774+offset] = tmp;
-    }
+    if (spin > CQ_POLL_SPIN_MIN) spin /= 2;
 
-    for (int i = 0; i < 3; i++) {
-        int32_t tmp1 = quarter32(source[255 + i*256]);
-        destination[255+i*258] = tmp1;
-        destination[256+i*258] = tmp1;
-        destination[255+i*258+offset] = tmp1;
-        destination[256+i*258+offset] = tmp1;
-        int32_t tmp2 = quarter32(source[256 + i*256]);
-        destination[257+i*258] = tmp2;
-        destination[258+i*258] = tmp2;
-        destination[257+i*258+offset] = tmp2;
-        destination[258+i*258+offset] = tmp2;
+    while (num_comp == 0) {
+        if (ibv_req_notify_cq(ib_settings.cq, 0)) {
+            std::cerr << "Failed requesting IB Verbs completion notification" << std::endl;
+            return -1;
+        }
+        // Completion could arrive before notification was requested
+        num_comp = ibv_poll_cq(ib_settings.cq, CQ_POLL_BATCH, ib_wc);
+        if (num_comp != 0) return num_comp;
+
+        ibv_cq *ev_cq;
+        void *ev_ctx;
+        if (ibv_get_cq_event(ib_settings.comp_channel, &ev_cq, &ev_ctx)) {
+            std::cerr << "Failed waiting for IB Verbs completion event" << std::endl;
+            return -1;
+        }
+        ibv_ack_cq_events(ev_cq, 1);
+        sleeps++;
+        num_comp = ibv_poll_cq(ib_settings.cq, CQ_POLL_BATCH, ib_wc);
     }
+    return num_comp;
 }
 
 void *run_poll_cq_thread(void *in_threadarg) {
-	for (size_t finished_wc = 0; finished_wc < experiment_settings.nimages_to_write; finished_wc++) {
+	ibv_wc ib_wc[CQ_POLL_BATCH];
+	size_t spin = CQ_POLL_SPIN_MIN;
+	size_t sleeps = 0;
+	size_t polls = 0;
+	int max_depth = 0;
+	uint64_t start_time = 0;
+	size_t completions = 0;
+	uint64_t sq_occupancy_sum = 0;
+	uint64_t sq_occupancy_max = 0;
+
+	// With send batches, only last WR of the batch is signaled
+	// so one completion can retire multiple images
+	size_t finished_wc = 0;
+	while (finished_wc < experiment_settings.nimages_to_write) {
 		// Poll CQ to reuse ID
-		ibv_wc ib_wc;
-		int num_comp  = ibv_poll_cq(ib_settings.cq, 1, &ib_wc);; // number of completions present in the CQ
-		while (num_comp == 0) {
-			usleep(100);
-			num_comp = ibv_poll_cq(ib_settings.cq, 1, &ib_wc);
-		}
+		int num_comp = poll_cq_batch(ib_wc, spin, sleeps); // number of completions retrieved from the CQ
 
 		if (num_comp < 0) {
 			std::cerr << "Failed polling IB Verbs completion queue" << std::endl;
 			pthread_exit(0);
 		}
 
-		if (ib_wc.status != IBV_WC_SUCCESS) {
-			std::cerr << "Failed status " << ibv_wc_status_str(ib_wc.status) << " of IB Verbs send request #" << (int)ib_wc.wr_id << std::endl;
-			pthread_exit(0);
+		if (start_time == 0) start_time = time_us();
+		polls++;
+		uint64_t now = trace_enabled ? trace_time_ns() : 0;
+		if (num_comp > max_depth) max_depth = num_comp;
+
+		// WRs posted, but not yet retired
+		uint64_t sq_occupancy = ib_slot_statistics.posted.load() - finished_wc;
+		sq_occupancy_sum += sq_occupancy;
+		if (sq_occupancy > sq_occupancy_max) sq_occupancy_max = sq_occupancy;
+
+		for (int i = 0; i < num_comp; i++) {
+			uint32_t image = ib_wc[i].wr_id & UINT32_MAX;
+			uint32_t nimages = ib_wc[i].wr_id >> 32;
+			if (ib_wc[i].status != IBV_WC_SUCCESS) {
+				std::cerr << "Failed status " << ibv_wc_status_str(ib_wc[i].status) << " of IB Verbs send request for image #" << image << std::endl;
+				pthread_exit(0);
+			}
+			// Release slots of all images in the batch
+			// Previous image must be read before slot is released, as afterwards it can be reused
+			for (uint32_t j = 0; j < nimages; j++) {
+				uint32_t prev_image = ib_slot_batch_prev[image % ib_slot_count()];
+				trace_event(TRACE_RING_POLL_CQ, TRACE_COMPLETED, image, 1, now);
+				release_ib_slot(image);
+				image = prev_image;
+			}
+			finished_wc += nimages;
 		}
-
-		pthread_mutex_lock(&ib_buffer_occupancy_mutex);
-		ib_buffer_occupancy[ib_wc.wr_id] = 0;
-		pthread_cond_signal(&ib_buffer_occupancy_cond);
-		pthread_mutex_unlock(&ib_buffer_occupancy_mutex);
+		completions += num_comp;
 	}
-        std::cout << "CQ Poll: Done" << std::endl;
+
+	double elapsed = (time_us() - start_time) / 1e6;
+	std::cout << "CQ Poll: Done " << finished_wc / elapsed << " frames/s, " << completions / elapsed << " completions/s, CQ depth avg "
+	          << (double) completions / polls << " max " << max_depth << " (batch " << CQ_POLL_BATCH << "), "
+	          << sleeps << " sleeps" << std::endl;
+	std::cout << "CQ Poll: Send queue occupancy avg " << (double) sq_occupancy_sum / polls << " max " << sq_occupancy_max
+	          << " of " << ib_slot_count() << std::endl;
 	pthread_exit(0);
 }
 
-void mark_chunk_done(size_t chunk) {
+// Image was written to IB buffer, if it was the last one of the chunk - wake up GPU thread
+void mark_image_written(size_t image, size_t images_per_stream) {
+     size_t chunk = image / images_per_stream;
      size_t ib_slice = chunk % (NCUDA_STREAMS*CUDA_TO_IB_BUFFER);
-     pthread_mutex_lock(writer_threads_done_mutex+ib_slice);
 
-     // Increment counter of writers done
-     writer_threads_done[ib_slice] ++;
-     // If all writers done - wake up GPU thread
-     if (writer_threads_done[ib_slice] == receiver_settings.compression_threads)
-          pthread_cond_signal(writer_threads_done_cond+ib_slice);
+     size_t images = experiment_settings.nimages_to_write - chunk * images_per_stream;
+     if (images > images_per_stream) images = images_per_stream;
 
-     pthread_mutex_unlock(writer_threads_done_mutex+ib_slice);
+     if (chunk_images_written[ib_slice].fetch_add(1) + 1 == images) {
+          pthread_mutex_lock(chunk_written_mutex+ib_slice);
+          pthread_cond_signal(chunk_written_cond+ib_slice);
+          pthread_mutex_unlock(chunk_written_mutex+ib_slice);
+     }
 }
 
 void wait_for_write_to_chunk(size_t chunk) {
      size_t ib_slice = chunk % (NCUDA_STREAMS*CUDA_TO_IB_BUFFER);
 
      // Make sure that CUDA stream is ready to go
+     // GPU thread sets value to chunk + NCUDA_STREAMS*CUDA_TO_IB_BUFFER once it copied the chunk from IB buffer
      pthread_mutex_lock(cuda_stream_ready_mutex+ib_slice);
-     while (cuda_stream_ready[ib_slice] != chunk)
+     while (cuda_stream_ready[ib_slice] < chunk)
          pthread_cond_wait(cuda_stream_ready_cond+ib_slice,
                            cuda_stream_ready_mutex+ib_slice);
      pthread_mutex_unlock(cuda_stream_ready_mutex+ib_slice);
 }
 
+image_queue_t *image_queues = NULL;
+int image_queue_count = 0;
+size_t image_steal_distance = 0;
+
+void setup_image_scheduler(size_t nimages, int nthreads) {
+    image_queues = new image_queue_t[nthreads];
+    image_queue_count = nthreads;
+    for (int i = 0; i < nthreads; i++)
+        pthread_mutex_init(&image_queues[i].mutex, NULL);
+
+    size_t block = 0;
+    for (size_t image = 0; image < nimages; image += SCHEDULER_BLOCK_IMAGES) {
+        image_block_t b;
+        b.first = image;
+        b.last  = std::min(image + SCHEDULER_BLOCK_IMAGES, nimages);
+        image_queues[block % nthreads].blocks.push_back(b);
+        block++;
+    }
+
+    // Thread, which is more than one chunk ahead of the oldest block, helps with the old block instead
+    // Otherwise it could wait for GPU to finish chunk, which cannot be completed without this block
+    image_steal_distance = NIMAGES_PER_STREAM * 2 / experiment_settings.pixel_depth;
+}
+
+void close_image_scheduler() {
+    for (int i = 0; i < image_queue_count; i++)
+        pthread_mutex_destroy(&image_queues[i].mutex);
+    delete[] image_queues;
+    image_queues = NULL;
+    image_queue_count = 0;
+}
+
+// Take the oldest block from queue of victim thread
+bool steal_image_block(int victim, image_block_t &block) {
+    bool ret = false;
+    pthread_mutex_lock(&image_queues[victim].mutex);
+    if (!image_queues[victim].blocks.empty()) {
+        block = image_queues[victim].blocks.front();
+        image_queues[victim].blocks.pop_front();
+        ret = true;
+    }
+    pthread_mutex_unlock(&image_queues[victim].mutex);
+    return ret;
+}
+
+// Returns false, if there are no more images to send
+bool get_image_block(int thread_id, image_block_t &block, uint64_t &steals) {
+    image_queue_t &own = image_queues[thread_id];
+
+    pthread_mutex_lock(&own.mutex);
+    bool own_empty = own.blocks.empty();
+    size_t own_first = own_empty ? SIZE_MAX : own.blocks.front().first;
+    pthread_mutex_unlock(&own.mutex);
+
+    // Find thread with the oldest block, queues are checked one by one, so it is only a hint
+    int victim = -1;
+    size_t victim_first = own_first;
+    for (int i = 1; i < image_queue_count; i++) {
+        int t = (thread_id + i) % image_queue_count;
+        pthread_mutex_lock(&image_queues[t].mutex);
+        if (!image_queues[t].blocks.empty() && (image_queues[t].blocks.front().first < victim_first)) {
+            victim = t;
+            victim_first = image_queues[t].blocks.front().first;
+        }
+        pthread_mutex_unlock(&image_queues[t].mutex);
+    }
+
+    if ((victim >= 0) && (own_empty || (victim_first + image_steal_distance <= own_first))) {
+        if (steal_image_block(victim, block)) {
+            steals++;
+            return true;
+        }
+    }
+
+    if (steal_image_block(thread_id, block)) return true;
+
+    // Own queue is empty and the oldest block was taken in the meantime - try all other threads
+    for (int i = 1; i < image_queue_count; i++) {
+        if (steal_image_block((thread_id + i) % image_queue_count, block)) {
+            steals++;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Frames prepared by one send thread, posted to IB as a single chain of WRs
+struct send_batch_t {
+    ibv_sge sg[SEND_BATCH_MAX];
+    ibv_send_wr wr[SEND_BATCH_MAX];
+    size_t n;
+    size_t trace_ring;
+};
+
+// Data (length bytes) are sent from addr, which must be within memory region mr
+void add_to_send_batch(send_batch_t &batch, size_t image, char *addr, size_t length, ibv_mr *mr, bool compressed) {
+    ibv_sge &ib_sg = batch.sg[batch.n];
+    ibv_send_wr &ib_wr = batch.wr[batch.n];
+
+    memset(&ib_sg, 0, sizeof(ib_sg));
+    ib_sg.addr	 = (uintptr_t) addr;
+    ib_sg.length = length;
+    ib_sg.lkey	 = mr->lkey;
+
+    // Poll thread finds other images of the batch by following the chain from the last one
+    if (batch.n > 0) ib_slot_batch_prev[image % ib_slot_count()] = batch.wr[batch.n - 1].wr_id;
+
+    memset(&ib_wr, 0, sizeof(ib_wr));
+    ib_wr.wr_id      = image;
+    ib_wr.sg_list    = &ib_sg;
+    ib_wr.num_sge    = 1;
+    ib_wr.opcode     = IBV_WR_SEND_WITH_IMM;
+    ib_wr.imm_data   = htonl(image | (compressed ? RDMA_IMM_COMPRESSED : 0)); // Network order
+    batch.n++;
+}
+
+// Compress image with bitshuffle/LZ4, output includes 12 byte header, as expected by HDF5 filter
+// Returns size of compressed image or zero, if compression failed or didn't reduce size
+size_t compress_image(char *output, const char *input, size_t input_size) {
+    bshuf_write_uint64_BE(output, input_size);
+    bshuf_write_uint32_BE(output + 8, 0); // default block size
+    int64_t ret = bshuf_compress_lz4(input, output + 12, input_size / experiment_settings.pixel_depth,
+                                     experiment_settings.pixel_depth, 0);
+    if (ret < 0) return 0;
+    size_t compressed_size = (size_t) ret + 12;
+    if (compressed_size >= input_size) return 0;
+    return compressed_size;
+}
+
+// Post all frames in the batch with one ibv_post_send call
+// Only the last WR is signaled, its wr_id has image number in lower 32-bits and number of images in the batch in upper 32-bits
+void post_send_batch(send_batch_t &batch) {
+    if (batch.n == 0) return;
+
+    for (size_t i = 0; i < batch.n - 1; i++)
+        batch.wr[i].next = batch.wr + i + 1;
+    ibv_send_wr &last = batch.wr[batch.n - 1];
+    last.next = NULL;
+    last.send_flags = IBV_SEND_SIGNALED;
+    last.wr_id |= ((uint64_t) batch.n) << 32;
+
+    ib_slot_statistics.posted += batch.n;
+    for (size_t i = 0; i < batch.n; i++)
+        ib_slot_statistics.sent_bytes += batch.sg[i].length;
+
+    ibv_send_wr *ib_wr = batch.wr;
+    ibv_send_wr *ib_bad_wr;
+    int ret;
+    // Slots limit number of outstanding WRs to send queue size, so ENOMEM is not expected
+    while ((ret = ibv_post_send(ib_settings.qp, ib_wr, &ib_bad_wr))) {
+        if (ret != ENOMEM)
+            std::cerr << "Sending with IB Verbs failed (ret: " << ret << " image: " << (ib_bad_wr->wr_id & UINT32_MAX) << " len: " << ib_bad_wr->sg_list->length << ")" << std::endl;
+        // WRs before ib_bad_wr were posted
+        ib_wr = ib_bad_wr;
+        usleep(10);
+    }
+
+    if (trace_enabled) {
+        uint64_t now = trace_time_ns();
+        for (size_t i = 0; i < batch.n; i++)
+            trace_event(batch.trace_ring, TRACE_POSTED, batch.wr[i].wr_id & UINT32_MAX, 1, now);
+    }
+    batch.n = 0;
+}
+
 void *run_send_thread(void *in_threadarg) {
     ThreadArg *arg = (ThreadArg *) in_threadarg;
 
-    uint32_t current_frame_number = lastModuleFrameNumber();
+    uint32_t current_frame_number = frame_arrival_seq.load();
+    uint64_t frame_wait_histogram_local[FRAME_WAIT_HISTOGRAM_BINS] = {0};
 
     size_t images_per_stream = NIMAGES_PER_STREAM * 2 / experiment_settings.pixel_depth;
 
-    // Account for leftover
-    size_t total_chunks = experiment_settings.nimages_to_write / images_per_stream;
-    if (experiment_settings.nimages_to_write - total_chunks * images_per_stream > 0)
-           total_chunks++;
+    // Chunk 0 doesn't need to wait for GPU
+    size_t current_chunk = 0;
+
+    uint64_t start_time = time_us();
+    uint64_t slot_waits = 0;
+    uint64_t slot_wait_time = 0;
+    uint64_t zero_copy_frames = 0;
+    uint64_t steals = 0;
 
-    size_t current_chunk = 0; // assume that receiver_settings.compression_threads << NIMAGES_PER_STREAM
+    send_batch_t *batch = (send_batch_t *) calloc(1, sizeof(send_batch_t));
+    batch->trace_ring = TRACE_RING_SEND(arg->ThreadID);
 
-    for (size_t image = arg->ThreadID;
-    		image < experiment_settings.nimages_to_write;
-    		image += receiver_settings.compression_threads) {
+    image_block_t block;
+    while (get_image_block(arg->ThreadID, block, steals)) {
+      for (size_t image = block.first; image < block.last; image++) {
         if (experiment_settings.enable_spot_finding) {
             // Synchronization of GPU part with GPU threads
             size_t new_chunk = image / images_per_stream;
@@ -242,7 +544,7 @@ void *run_send_thread(void *in_threadarg) {
             // If we operate in the same chunk as before, there is no need to synchronize
             if (current_chunk != new_chunk) {
 
-                mark_chunk_done(current_chunk);
+                post_send_batch(*batch);
                 wait_for_write_to_chunk(new_chunk);
 
                 // Update chunk
@@ -251,31 +553,34 @@ void *run_send_thread(void *in_threadarg) {
         }
 
     	// Find free buffer to write
-    	int32_t buffer_id;
-
-        // If pixel_depth == 4, then only half of buffer size available
-        if  (experiment_settings.pixel_depth == 2) buffer_id = image % (RDMA_SQ_SIZE);
-        else  buffer_id = image % (RDMA_SQ_SIZE / 2);
+    	int32_t buffer_id = image % ib_slot_count();
 
         // Make sure buffer is free
-    	pthread_mutex_lock(&ib_buffer_occupancy_mutex);
-
-        while (ib_buffer_occupancy[buffer_id] != 0)
-            pthread_cond_wait(&ib_buffer_occupancy_cond, &ib_buffer_occupancy_mutex);
-
-    	pthread_mutex_unlock(&ib_buffer_occupancy_mutex);
+        // Frames held in the batch are sent first, as waiting for them would deadlock
+        if (!ib_slot_ready(image)) post_send_batch(*batch);
+        uint64_t wait_time = wait_for_ib_slot(image);
+        if (wait_time > 0) {
+            slot_waits++;
+            slot_wait_time += wait_time;
+        }
 
         size_t collected_frame = image*experiment_settings.summation;
 
-        if (current_frame_number < (collected_frame+experiment_settings.summation-1) + 2) {
-    	// Ensure that all frames were already collected, if not wait to try again
-    	    while (current_frame_number < (collected_frame+experiment_settings.summation-1) + 2) {
-                float delay_in_frames = (collected_frame+experiment_settings.summation-1) + 2 - current_frame_number;
-                if (delay_in_frames < 2) usleep(20);
-                else  usleep ((delay_in_frames-1)*experiment_settings.frame_time_detector*1000.0);
-                current_frame_number = lastModuleFrameNumber();
+        // Ensure that all frames were already collected, if not wait for frame watcher
+        uint32_t needed_frame_number = (collected_frame+experiment_settings.summation-1) + 2;
+        uint64_t frame_wait_time = 0;
+        if (current_frame_number < needed_frame_number) {
+            current_frame_number = frame_arrival_seq.load(std::memory_order_acquire);
+            if (current_frame_number < needed_frame_number) {
+                // Don't keep prepared frames while waiting
+                post_send_batch(*batch);
+                uint64_t wait_start = time_us();
+                current_frame_number = wait_for_frame(needed_frame_number);
+                frame_wait_time = time_us() - wait_start;
             }
         }
+        frame_wait_histogram_local[histogram_bin(frame_wait_time)]++;
+        trace_event(batch->trace_ring, TRACE_SEND_START, image);
 
         if (image % 100 == 0) {
            std::cout << "Frame :" << image << " Backlog = " << current_frame_number - (collected_frame+experiment_settings.summation-1) << " " << online_statistics->head[0] << " " << online_statistics->head[1] << " " << online_statistics->head[2] << " " << online_statistics->head[3] << " " << online_statistics->good_packets << std::endl;
@@ -291,95 +596,85 @@ void *run_send_thread(void *in_threadarg) {
             // Inter module gaps are not added and should be corrected in processing software
             for (int module = 0; module < NMODULES; module ++) {
                 size_t pixel_in  = ((collected_frame % FRAME_BUF_SIZE) * NMODULES + module) * MODULE_LINES * MODULE_COLS;
-                size_t line_out = (module / 2) * 514; // Two modules will get the same line
-                line_out = 514 * NMODULES / 2 - line_out - 1; // Flip upside down
-                size_t pixel_out = (line_out * 2  + (module%2)) * 1030; // 2 modules in one row
-
-                for (uint64_t i = 0; i < MODULE_LINES; i ++) {
-                    if ((i == 255) || (i == 256)) {
-                       pixel_out -= 2 * 1030;
-                       copy_line_mid(output_buffer+pixel_out, frame_buffer + pixel_in, 2*1030);
-                       pixel_out -= 2 * 1030;
-                    } else {
-                       copy_line(output_buffer+pixel_out, frame_buffer + pixel_in);
-                       pixel_out -= 2 * 1030;
-                    }
-                    pixel_in += MODULE_COLS;
-               }
+                transform_lines16(receiver_geometry, output_buffer, frame_buffer + pixel_in, module, 0, MODULE_LINES);
             }
           } else {
             // For summation of >= 2 32-bit integers are used
             int32_t *output_buffer = (int32_t *) (ib_buffer + buffer_id * COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth);
             for (int module = 0; module < NMODULES; module ++) {
-                size_t line_out = (module / 2) * 514;
-                line_out = 514 * NMODULES / 2 - line_out - 1; // Flip upside down
-                size_t pixel_out = (line_out * 2 + (module % 2)) * 1030; // 2 modules in one row
-
-                for (uint64_t line = 0; line < MODULE_LINES; line ++) {
-                    int32_t summed_buffer[MODULE_COLS];
-		    for (int col = 0; col < MODULE_COLS; col++)
-                        summed_buffer[col] = 0;
+                // Lines are processed in blocks, each frame contributes contiguous block of memory
+                for (uint64_t line0 = 0; line0 < MODULE_LINES; line0 += SUMMATION_BLOCK_LINES) {
+                    int32_t summed_buffer[SUMMATION_BLOCK_LINES * MODULE_COLS];
+                    int16_t summed_mask[SUMMATION_BLOCK_LINES * MODULE_COLS];
+                    memset(summed_buffer, 0, SUMMATION_BLOCK_LINES * MODULE_COLS * sizeof(int32_t));
+                    memset(summed_mask, 0, SUMMATION_BLOCK_LINES * MODULE_COLS * sizeof(int16_t));
 
                     for (int j = 0; j < experiment_settings.summation; j++) {
-                        size_t pixel0_in = ((((collected_frame + j) % FRAME_BUF_SIZE) * NMODULES +  module) * MODULE_LINES + line ) * MODULE_COLS;
-                        for (int col = 0; col < MODULE_COLS; col++) {
-                            int16_t tmp = frame_buffer[pixel0_in + col];
-                            if (tmp < INT16_MIN + 10) summed_buffer[col] = INT32_MIN;  
-                            if ((tmp > INT16_MAX - 10) && (summed_buffer[col] != INT32_MIN)) summed_buffer[col] = INT32_MAX;
-                            if ((summed_buffer[col] != INT32_MIN) && (summed_buffer[col] != INT32_MAX)) summed_buffer[col] += tmp;  
-                        }
-                    }
-                    if ((line == 255) || (line == 256)) {
-                       pixel_out -= 2 * 1030;
-                       copy_line_mid32(output_buffer+pixel_out, summed_buffer, 2*1030);
-                       pixel_out -= 2 * 1030;
-                    } else {
-                       copy_line32(output_buffer+pixel_out, summed_buffer);
-                       pixel_out -= 2 * 1030;
+                        size_t pixel0_in = ((((collected_frame + j) % FRAME_BUF_SIZE) * NMODULES +  module) * MODULE_LINES + line0 ) * MODULE_COLS;
+                        sum_frames_accumulate(summed_buffer, summed_mask, frame_buffer + pixel0_in, SUMMATION_BLOCK_LINES * MODULE_COLS);
                     }
+                    sum_frames_finalize(summed_buffer, summed_mask, SUMMATION_BLOCK_LINES * MODULE_COLS);
+
+                    transform_lines32(receiver_geometry, output_buffer, summed_buffer, module, line0, SUMMATION_BLOCK_LINES);
                 }
             }
           }
-        } else
-            // For raw data, just copy contest of the buffer
-            memcpy(ib_buffer + COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth * buffer_id,
-                   frame_buffer + (collected_frame % FRAME_BUF_SIZE) * NPIXEL, NPIXEL * sizeof(uint16_t));
+        }
 
-    	// Send the frame via RDMA
-    	ibv_sge ib_sg;
-    	ibv_send_wr ib_wr;
-    	ibv_send_wr *ib_bad_wr;
-
-    	memset(&ib_sg, 0, sizeof(ib_sg));
-    	ib_sg.addr	 = (uintptr_t)(ib_buffer + COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth * buffer_id);
-        if (experiment_settings.conversion_mode == MODE_CONV)
-                ib_sg.length = COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth;
-        else ib_sg.length = NPIXEL * sizeof(uint16_t);
-
-        ib_sg.lkey	 = ib_settings.buffer_mr->lkey;
-
-    	memset(&ib_wr, 0, sizeof(ib_wr));
-    	ib_wr.wr_id      = buffer_id;
-    	ib_wr.sg_list    = &ib_sg;
-    	ib_wr.num_sge    = 1;
-    	ib_wr.opcode     = IBV_WR_SEND_WITH_IMM;
-    	ib_wr.send_flags = IBV_SEND_SIGNALED;
-        ib_wr.imm_data   = htonl(image); // Network order
-        int ret;
-    	while ((ret = ibv_post_send(ib_settings.qp, &ib_wr, &ib_bad_wr))) {
-                if (ret != ENOMEM)
-    		   std::cerr << "Sending with IB Verbs failed (ret: " << ret << " buffer: " << buffer_id << " len: " << ib_sg.length << ")" << std::endl;
-                // ENONEM error doesn't seem to be problematic
-                usleep(10);
-    	}
-    }
+        char *send_addr = ib_buffer + COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth * buffer_id;
+        size_t send_size = COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth;
+        ibv_mr *send_mr = ib_settings.buffer_mr;
+        bool compressed = false;
+        ib_slot_zero_copy[buffer_id] = false;
 
-    mark_chunk_done(current_chunk);
+        if (experiment_settings.conversion_mode == MODE_CONV) {
+            if (experiment_settings.receiver_compression) {
+                // Compressed to separate buffer, as GPU reads uncompressed image from IB buffer
+                // If compression doesn't help, image is sent uncompressed
+                char *compressed_addr = ib_compressed_buffer + ib_compressed_slot_size() * buffer_id;
+                size_t compressed_size = compress_image(compressed_addr, send_addr, send_size);
+                if (compressed_size > 0) {
+                    send_addr = compressed_addr;
+                    send_size = compressed_size;
+                    send_mr = ib_compressed_buffer_mr;
+                    compressed = true;
+                }
+            }
+        } else {
+            send_size = NPIXEL * sizeof(uint16_t);
+            char *frame = (char *) (frame_buffer + (collected_frame % FRAME_BUF_SIZE) * NPIXEL);
+            if ((size_t) leadingModuleFrameNumber() + FRAME_BUF_HEADROOM < collected_frame + FRAME_BUF_SIZE) {
+                // For raw data, send directly from frame buffer, FPGA is far enough not to overwrite the frame
+                send_addr = frame;
+                send_mr = frame_buffer_mr;
+                ib_slot_zero_copy[buffer_id] = true;
+                zero_copy_frames++;
+            } else
+                // Otherwise copy content of the buffer
+                memcpy(send_addr, frame, NPIXEL * sizeof(uint16_t));
+        }
 
-    // Case when last chunk has handful of elements and is not covered by this thread
-    if (current_chunk != total_chunks - 1)
-        mark_chunk_done(total_chunks - 1);
+        trace_event(batch->trace_ring, TRACE_IMAGE_READY, image);
+        if (experiment_settings.enable_spot_finding)
+            mark_image_written(image, images_per_stream);
 
-    std::cout << arg->ThreadID << ": Sending done" << std::endl;
+    	// Send the frame via RDMA
+        add_to_send_batch(*batch, image, send_addr, send_size, send_mr, compressed);
+        if (batch->n >= receiver_settings.send_batch) post_send_batch(*batch);
+      }
+    }
+    post_send_batch(*batch);
+    free(batch);
+
+    uint64_t send_time = time_us() - start_time;
+    ib_slot_statistics.waits += slot_waits;
+    ib_slot_statistics.wait_time_us += slot_wait_time;
+    ib_slot_statistics.send_time_us += send_time;
+    ib_slot_statistics.zero_copy += zero_copy_frames;
+    for (int i = 0; i < FRAME_WAIT_HISTOGRAM_BINS; i++)
+        frame_wait_histogram[i] += frame_wait_histogram_local[i];
+
+    std::cout << arg->ThreadID << ": Sending done (waited for IB slot " << slot_waits << " times, "
+              << slot_wait_time / 1000 << " ms of " << send_time / 1000 << " ms, stolen blocks " << steals << ")" << std::endl;
     pthread_exit(0);
 }
@@ -0,0 +1,149 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Spot assembly - GPU threads only find strong pixels and hand the output of a chunk over to a pool of workers,
+// which label spots (analyze_spots) and queue them for the spot stream. So GPU thread can start the next chunk immediately.
+// Each CUDA stream has SPOT_ASSEMBLY_BUFFERS host output buffers, a buffer is reused only after its chunk is analyzed.
+
+#include <deque>
+#include <iostream>
+
+#include "JFReceiver.h"
+
+static pthread_mutex_t spot_assembly_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spot_assembly_job_cond = PTHREAD_COND_INITIALIZER;   // job submitted or stop
+static pthread_cond_t spot_assembly_space_cond = PTHREAD_COND_INITIALIZER; // job taken or buffer released
+static std::deque<spot_assembly_job_t> spot_assembly_queue;
+static bool spot_assembly_buffer_busy[NCUDA_STREAMS][SPOT_ASSEMBLY_BUFFERS];
+static bool spot_assembly_stop = false;
+static std::vector<pthread_t> spot_assembly_workers;
+static std::vector<ThreadArg> spot_assembly_worker_arg;
+
+// Metrics (protected by the mutex)
+static size_t spot_assembly_chunks;
+static size_t spot_assembly_max_depth;
+static size_t spot_assembly_depth_sum;
+static double spot_assembly_gpu_wait;    // GPU threads waiting for buffer or queue space [s]
+static double spot_assembly_worker_idle; // workers waiting for job [s]
+
+static double time_s() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *run_spot_assembly_thread(void *in_threadarg) {
+    ThreadArg *arg = (ThreadArg *) in_threadarg;
+
+    pthread_mutex_lock(&spot_assembly_mutex);
+    while (true) {
+        double start = time_s();
+        while (spot_assembly_queue.empty() && !spot_assembly_stop)
+            pthread_cond_wait(&spot_assembly_job_cond, &spot_assembly_mutex);
+        spot_assembly_worker_idle += time_s() - start;
+        if (spot_assembly_queue.empty()) break;
+
+        spot_assembly_job_t job = spot_assembly_queue.front();
+        spot_assembly_queue.pop_front();
+        pthread_cond_broadcast(&spot_assembly_space_cond);
+        pthread_mutex_unlock(&spot_assembly_mutex);
+
+        // Histogram is private to the worker
+        std::vector<spot_t> spots;
+        size_t overflow_images = analyze_spots(job.pixels, job.index, spots, strong_pixel_histogram[arg->ThreadID],
+                                               experiment_settings.connect_spots_between_frames,
+                                               job.images, job.image0, job.chunk);
+
+        pthread_mutex_lock(&spot_assembly_mutex);
+        spot_assembly_buffer_busy[job.stream][job.buffer] = false;
+        pthread_cond_broadcast(&spot_assembly_space_cond);
+        pthread_mutex_unlock(&spot_assembly_mutex);
+
+        queue_spots(job.chunk, job.image0, job.images, overflow_images, spots);
+
+        pthread_mutex_lock(&spot_assembly_mutex);
+    }
+    pthread_mutex_unlock(&spot_assembly_mutex);
+    pthread_exit(0);
+}
+
+// Workers are started for each data collection, nthreads is at most NCUDA_STREAMS (one histogram per worker)
+void start_spot_assembly(int nthreads) {
+    spot_assembly_stop = false;
+    spot_assembly_chunks = 0;
+    spot_assembly_max_depth = 0;
+    spot_assembly_depth_sum = 0;
+    spot_assembly_gpu_wait = 0;
+    spot_assembly_worker_idle = 0;
+    for (int i = 0; i < NCUDA_STREAMS; i++) {
+        for (int j = 0; j < SPOT_ASSEMBLY_BUFFERS; j++)
+            spot_assembly_buffer_busy[i][j] = false;
+    }
+
+    spot_assembly_workers.resize(nthreads);
+    spot_assembly_worker_arg.resize(nthreads);
+    for (int i = 0; i < nthreads; i++) {
+        spot_assembly_worker_arg[i].ThreadID = i;
+        int ret = pthread_create(&spot_assembly_workers[i], NULL, run_spot_assembly_thread, &spot_assembly_worker_arg[i]);
+        PTHREAD_ERROR(ret,pthread_create);
+    }
+}
+
+// Must be called before GPU thread writes into the buffer
+void acquire_spot_assembly_buffer(size_t stream, size_t buffer) {
+    pthread_mutex_lock(&spot_assembly_mutex);
+    double start = time_s();
+    while (spot_assembly_buffer_busy[stream][buffer])
+        pthread_cond_wait(&spot_assembly_space_cond, &spot_assembly_mutex);
+    spot_assembly_gpu_wait += time_s() - start;
+    spot_assembly_buffer_busy[stream][buffer] = true;
+    pthread_mutex_unlock(&spot_assembly_mutex);
+}
+
+// Queue is bounded, GPU thread waits if it is full
+void submit_spot_assembly(const spot_assembly_job_t &job) {
+    pthread_mutex_lock(&spot_assembly_mutex);
+    double start = time_s();
+    while (spot_assembly_queue.size() >= SPOT_ASSEMBLY_QUEUE_SIZE)
+        pthread_cond_wait(&spot_assembly_space_cond, &spot_assembly_mutex);
+    spot_assembly_gpu_wait += time_s() - start;
+
+    spot_assembly_queue.push_back(job);
+    spot_assembly_chunks++;
+    spot_assembly_depth_sum += spot_assembly_queue.size();
+    if (spot_assembly_queue.size() > spot_assembly_max_depth) spot_assembly_max_depth = spot_assembly_queue.size();
+    pthread_cond_signal(&spot_assembly_job_cond);
+    pthread_mutex_unlock(&spot_assembly_mutex);
+}
+
+// Called after GPU threads finished, workers finish all queued chunks before exiting
+void finish_spot_assembly() {
+    pthread_mutex_lock(&spot_assembly_mutex);
+    spot_assembly_stop = true;
+    pthread_cond_broadcast(&spot_assembly_job_cond);
+    pthread_mutex_unlock(&spot_assembly_mutex);
+
+    for (size_t i = 0; i < spot_assembly_workers.size(); i++) {
+        int ret = pthread_join(spot_assembly_workers[i], NULL);
+        PTHREAD_ERROR(ret,pthread_join);
+    }
+    spot_assembly_workers.clear();
+
+    std::cout << "Spot assembly: " << spot_assembly_chunks << " chunks, queue depth max " << spot_assembly_max_depth
+              << " avg " << ((spot_assembly_chunks > 0) ? (double) spot_assembly_depth_sum / spot_assembly_chunks : 0.0)
+              << ", GPU threads waited " << spot_assembly_gpu_wait << " s, workers idle "
+              << spot_assembly_worker_idle << " s" << std::endl;
+}
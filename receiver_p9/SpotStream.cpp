@@ -0,0 +1,126 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Spot stream - threads analyzing spots queue results of a chunk, single sender thread owns accepted_socket
+// during data collection and writes framed messages (spot_message_header_t in JFApp.h).
+// All messages waiting in the queue are written as one batch with TCP_CORK, so headers and short spot lists
+// are coalesced into full segments, uncorking flushes the batch (socket has TCP_NODELAY).
+// Queue is bounded, so if writer doesn't keep up, spot assembly and in turn GPU threads wait.
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <deque>
+#include <iostream>
+#include <utility>
+
+#include "JFReceiver.h"
+
+#define SPOT_STREAM_QUEUE_SIZE (2 * NCUDA_STREAMS)
+
+struct spot_message_t {
+    spot_message_header_t header;
+    std::vector<spot_t> spots;
+};
+
+static pthread_mutex_t spot_stream_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spot_stream_data_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t spot_stream_space_cond = PTHREAD_COND_INITIALIZER;
+static std::deque<spot_message_t> spot_stream_queue;
+static bool spot_stream_stop = false;
+static pthread_t spot_stream_thread;
+
+static void set_tcp_cork(int value) {
+    setsockopt(accepted_socket, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+}
+
+static void *run_spot_stream_thread(void *in_threadarg) {
+    std::deque<spot_message_t> batch;
+    size_t messages = 0;
+    size_t batches = 0;
+    bool error = false;
+
+    pthread_mutex_lock(&spot_stream_mutex);
+    while (true) {
+        while (spot_stream_queue.empty() && !spot_stream_stop)
+            pthread_cond_wait(&spot_stream_data_cond, &spot_stream_mutex);
+        if (spot_stream_queue.empty()) break;
+        batch.swap(spot_stream_queue);
+        pthread_cond_broadcast(&spot_stream_space_cond);
+        pthread_mutex_unlock(&spot_stream_mutex);
+
+        // After error stream is not consistent anymore, but queue is still emptied, so producers don't block
+        if (!error) {
+            set_tcp_cork(1);
+            for (size_t i = 0; (i < batch.size()) && !error; i++) {
+                if ((TCP_send(accepted_socket, (char *) &batch[i].header, sizeof(spot_message_header_t)) != 0) ||
+                    (TCP_send(accepted_socket, (char *) batch[i].spots.data(), batch[i].header.length) != 0))
+                    error = true;
+                else messages++;
+            }
+            set_tcp_cork(0);
+            batches++;
+            if (error) std::cerr << "Spot stream: sending failed, remaining spots are dropped" << std::endl;
+        }
+        batch.clear();
+
+        pthread_mutex_lock(&spot_stream_mutex);
+    }
+    pthread_mutex_unlock(&spot_stream_mutex);
+    std::cout << "Spot stream: " << messages << " messages in " << batches << " batches" << std::endl;
+    pthread_exit(0);
+}
+
+void start_spot_stream() {
+    spot_stream_stop = false;
+    int ret = pthread_create(&spot_stream_thread, NULL, run_spot_stream_thread, NULL);
+    PTHREAD_ERROR(ret,pthread_create);
+}
+
+// Spots are moved into the queue
+void queue_spots(size_t chunk, size_t image0, size_t images, size_t overflow_images, std::vector<spot_t> &spots) {
+    spot_message_t message;
+    message.header.magic = SPOT_MESSAGE_MAGIC;
+    message.header.version = SPOT_STREAM_VERSION;
+    message.header.flags = (overflow_images > 0) ? SPOT_MESSAGE_OVERFLOW : 0;
+    message.header.length = spots.size() * sizeof(spot_t);
+    message.header.chunk = chunk;
+    message.header.image0 = image0;
+    message.header.nimages = images;
+    message.header.nspots = spots.size();
+    message.header.overflow_images = overflow_images;
+    message.spots.swap(spots);
+
+    pthread_mutex_lock(&spot_stream_mutex);
+    while (spot_stream_queue.size() >= SPOT_STREAM_QUEUE_SIZE)
+        pthread_cond_wait(&spot_stream_space_cond, &spot_stream_mutex);
+    spot_stream_queue.push_back(std::move(message));
+    pthread_cond_signal(&spot_stream_data_cond);
+    pthread_mutex_unlock(&spot_stream_mutex);
+}
+
+// Called after all chunks are queued, returns when all messages are sent
+void finish_spot_stream() {
+    pthread_mutex_lock(&spot_stream_mutex);
+    spot_stream_stop = true;
+    pthread_cond_signal(&spot_stream_data_cond);
+    pthread_mutex_unlock(&spot_stream_mutex);
+
+    int ret = pthread_join(spot_stream_thread, NULL);
+    PTHREAD_ERROR(ret,pthread_join);
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Per-image latency of receiver pipeline stages
+// Hot path only writes 16 byte record to ring buffer owned by the thread (see trace_event() in JFReceiver.h)
+// Matching of events and histograms are done by trace thread
+
+#include <unistd.h>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+#include "JFReceiver.h"
+
+// Poll interval of trace thread, when ring buffers are empty
+#define TRACE_THREAD_IDLE_US 100
+// Number of recent images, for which event times are kept to be matched
+#define TRACE_WINDOW 65536L
+
+struct trace_stage_t {
+    uint16_t from;
+    uint16_t to;
+};
+
+static const trace_stage_t trace_stages[LATENCY_STAGES] = {
+        {TRACE_FRAME_ARRIVED, TRACE_SEND_START},  // LATENCY_ARRIVAL_TO_SEND
+        {TRACE_SEND_START,    TRACE_IMAGE_READY}, // LATENCY_TRANSFORM
+        {TRACE_IMAGE_READY,   TRACE_POSTED},      // LATENCY_BATCH
+        {TRACE_POSTED,        TRACE_COMPLETED},   // LATENCY_IB_COMPLETION
+        {TRACE_IMAGE_READY,   TRACE_GPU_TAKEN},   // LATENCY_GPU_HANDOFF
+        {TRACE_FRAME_ARRIVED, TRACE_COMPLETED}    // LATENCY_TOTAL
+};
+
+static size_t trace_ring_count = 0;
+static uint32_t *trace_window_image = NULL; // [TRACE_EVENTS][TRACE_WINDOW]
+static uint64_t *trace_window_time = NULL;
+
+int setup_trace(int send_threads) {
+    trace_ring_count = TRACE_RING_SEND(send_threads);
+    trace_rings = new(std::nothrow) trace_ring_t[trace_ring_count];
+    trace_window_image = (uint32_t *) malloc(TRACE_EVENTS * TRACE_WINDOW * sizeof(uint32_t));
+    trace_window_time = (uint64_t *) malloc(TRACE_EVENTS * TRACE_WINDOW * sizeof(uint64_t));
+    if ((trace_rings == NULL) || (trace_window_image == NULL) || (trace_window_time == NULL)) {
+        std::cerr << "Memory allocation error for latency trace" << std::endl;
+        return 1;
+    }
+    reset_trace(false);
+    return 0;
+}
+
+void reset_trace(bool enable) {
+    for (size_t i = 0; i < trace_ring_count; i++) {
+        trace_rings[i].head = 0;
+        trace_rings[i].tail = 0;
+        trace_rings[i].tail_cache = 0;
+        trace_rings[i].dropped = 0;
+    }
+    // UINT32_MAX marks empty entry
+    memset(trace_window_image, 0xFF, TRACE_EVENTS * TRACE_WINDOW * sizeof(uint32_t));
+    memset(&latency_statistics, 0, sizeof(latency_statistics_t));
+    trace_thread_stop = false;
+    trace_enabled = enable;
+}
+
+void close_trace() {
+    delete[] trace_rings;
+    trace_rings = NULL;
+    free(trace_window_image);
+    free(trace_window_time);
+}
+
+// Store time of event and if the other event of a stage was already seen, add the difference to histogram
+// Rings are read in arbitrary order, so end of a stage can be seen before its start
+void trace_match(uint16_t event, uint32_t image, uint64_t time_ns) {
+    size_t slot = image % TRACE_WINDOW;
+    trace_window_image[event * TRACE_WINDOW + slot] = image;
+    trace_window_time[event * TRACE_WINDOW + slot] = time_ns;
+
+    for (int i = 0; i < LATENCY_STAGES; i++) {
+        uint16_t other;
+        if (trace_stages[i].to == event) other = trace_stages[i].from;
+        else if (trace_stages[i].from == event) other = trace_stages[i].to;
+        else continue;
+
+        if (trace_window_image[other * TRACE_WINDOW + slot] != image) continue;
+
+        uint64_t from_time = trace_window_time[trace_stages[i].from * TRACE_WINDOW + slot];
+        uint64_t to_time   = trace_window_time[trace_stages[i].to * TRACE_WINDOW + slot];
+        latency_histogram_add(latency_statistics.stage[i], (to_time > from_time) ? to_time - from_time : 0);
+    }
+}
+
+// Returns number of records processed
+size_t trace_drain() {
+    size_t processed = 0;
+    for (size_t i = 0; i < trace_ring_count; i++) {
+        trace_ring_t &ring = trace_rings[i];
+        uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+        uint64_t head = ring.head.load(std::memory_order_acquire);
+        for (; tail < head; tail++) {
+            const trace_record_t &record = ring.records[tail & (TRACE_RING_SIZE - 1)];
+            for (uint32_t j = 0; j < record.nimages; j++)
+                trace_match(record.event, record.image + j, record.time_ns);
+            processed++;
+        }
+        ring.tail.store(tail, std::memory_order_release);
+    }
+    return processed;
+}
+
+void *run_trace_thread(void *in_threadarg) {
+    while (!trace_thread_stop.load()) {
+        if (trace_drain() == 0) usleep(TRACE_THREAD_IDLE_US);
+    }
+    // Producers are done, so last drain gets all the events
+    trace_drain();
+    for (size_t i = 0; i < trace_ring_count; i++)
+        latency_statistics.dropped_events += trace_rings[i].dropped;
+    pthread_exit(0);
+}
@@ -15,12 +15,12 @@
  */
 
 #include <cmath>
-#include <map>
+#include <algorithm>
+#include <iostream>
 #include "JFReceiver.h"
 #include "../include/xray.h"
 
 // CPU part of spot finding
-// (recursion will not fit well to GPU)
 // Constructing spot from strong pixels
 
 // Adds two spot measurements
@@ -41,125 +41,510 @@ void merge_spots(spot_t &spot1, const spot_t spot2) {
     if (spot2.last_frame > spot1.last_frame) spot1.last_frame = spot2.last_frame;
 }
 
-// Creates a continuous spot
-// strong pixels are loaded into dictionary (one dictionary per frame)
-// and routine checks if neighboring pixels are also in dictionary (likely in log(N) time)
+// Spot with a single pixel, coordinates are weighted by number of photons
 // i is number of fragment (2 modules in horizontal direction)
 // so assuming this is 2Mpixel, i/2 is frame number and i%2 defines position in vertical direction
-spot_t add_pixel(strong_pixel_maps_t &strong_pixel_maps, size_t i, strong_pixel_map_t::iterator &it, bool connect_frames) {
+spot_t pixel_to_spot(const spot_pixel_t &pixel, size_t i) {
     spot_t ret_value;
+    ret_value.x = pixel.col * pixel.photons;
+    ret_value.y = pixel.line * pixel.photons;
+    ret_value.z = (i / 2) * pixel.photons;
+    ret_value.photons = pixel.photons;
 
-    float photons = it->second;
-    int16_t col = it->first.first;
-    int16_t line = it->first.second;
+    ret_value.first_frame = i/2;
+    ret_value.last_frame = i/2;
+    ret_value.max_col = pixel.col;
+    ret_value.min_col = pixel.col;
+    ret_value.max_line = pixel.line;
+    ret_value.min_line = pixel.line;
+    return ret_value;
+}
 
-    strong_pixel_maps[i].erase(it); // Remove strong pixel from the dictionary, so it is not processed again
+// Union-find on runs, root is always the run with the lowest index
+static uint32_t find_run_root(std::vector<uint32_t> &parent, uint32_t run) {
+    while (parent[run] != run) {
+        parent[run] = parent[parent[run]]; // path halving
+        run = parent[run];
+    }
+    return run;
+}
 
-    ret_value.x = col * photons; // position is weighted by number of photon counts
-    ret_value.y = line * photons;
-    // Y has to be corrected for vertical position of the fragment
-    ret_value.z = (i / 2) * photons;
-    ret_value.photons = photons;
+static void join_runs(std::vector<uint32_t> &parent, uint32_t run1, uint32_t run2) {
+    uint32_t root1 = find_run_root(parent, run1);
+    uint32_t root2 = find_run_root(parent, run2);
+    if (root1 < root2) parent[root2] = root1;
+    else if (root2 < root1) parent[root1] = root2;
+}
 
-    ret_value.first_frame = i/2;
-    ret_value.last_frame = i/2;
-    ret_value.max_col = col;
-    ret_value.min_col = col;
-    ret_value.max_line = line;
-    ret_value.min_line = line;
+// Runs of consecutive pixels in one line for pixels [pixel0, pixel1)
+// Pixels of one fragment are sorted by line, then column (kernel output is in this order)
+static void encode_runs(const std::vector<spot_pixel_t> &pixels, size_t pixel0, size_t pixel1, std::vector<spot_run_t> &runs) {
+    for (size_t p = pixel0; p < pixel1; p++) {
+        if (!runs.empty() && (runs.back().first_pixel >= pixel0)
+            && (runs.back().line == pixels[p].line) && (runs.back().col_end + 1 == pixels[p].col))
+            runs.back().col_end = pixels[p].col;
+        else {
+            spot_run_t run;
+            run.first_pixel = p;
+            run.line = pixels[p].line;
+            run.col_start = pixels[p].col;
+            run.col_end = pixels[p].col;
+            runs.push_back(run);
+        }
+    }
+}
 
-    strong_pixel_map_t::iterator it2;
+// 8-connectivity within fragment: run touches runs of previous line, which overlap it extended by one column on each side
+static void join_runs_in_fragment(const std::vector<spot_run_t> &runs, size_t run0, size_t run1, std::vector<uint32_t> &parent) {
+    size_t prev_begin = run0, prev_end = run0; // runs of the line before current line
+    size_t line_begin = run0;                  // first run of current line
+    size_t j = run0;
+    for (size_t r = run0; r < run1; r++) {
+        if (runs[r].line != runs[line_begin].line) {
+            prev_begin = line_begin;
+            prev_end = r;
+            line_begin = r;
+            j = prev_begin;
+        }
+        if ((prev_begin == prev_end) || (runs[prev_begin].line + 1 != runs[r].line)) continue;
 
-    if ((it2 = strong_pixel_maps[i].find(coordxy_t(col-1, line  ))) != strong_pixel_maps[i].end())
-        merge_spots(ret_value, add_pixel(strong_pixel_maps, i, it2, connect_frames));
+        while ((j < prev_end) && (runs[j].col_end < runs[r].col_start - 1)) j++;
+        for (size_t k = j; (k < prev_end) && (runs[k].col_start <= runs[r].col_end + 1); k++)
+            join_runs(parent, r, k);
+    }
+}
 
-    if ((it2 = strong_pixel_maps[i].find(coordxy_t(col-1, line+1))) != strong_pixel_maps[i].end())
-        merge_spots(ret_value, add_pixel(strong_pixel_maps, i, it2, connect_frames));
+// Frame connectivity: pixel is connected to the same pixel of the same half in the next frame
+// Runs of both fragments are ordered by line and column, so overlapping runs are found in one pass
+static void join_runs_between_fragments(const std::vector<spot_run_t> &runs, size_t a, size_t a_end,
+                                        size_t b, size_t b_end, std::vector<uint32_t> &parent) {
+    while ((a < a_end) && (b < b_end)) {
+        if ((runs[a].line < runs[b].line) || ((runs[a].line == runs[b].line) && (runs[a].col_end < runs[b].col_start)))
+            a++;
+        else if ((runs[b].line < runs[a].line) || ((runs[b].line == runs[a].line) && (runs[b].col_end < runs[a].col_start)))
+            b++;
+        else {
+            join_runs(parent, a, b);
+            if (runs[a].col_end < runs[b].col_end) a++;
+            else b++;
+        }
+    }
+}
 
-    if ((it2 = strong_pixel_maps[i].find(coordxy_t(col-1, line-1))) != strong_pixel_maps[i].end())
-        merge_spots(ret_value, add_pixel(strong_pixel_maps, i, it2, connect_frames));
+// Spot being constructed, first pixel (lowest fragment, then lowest column and line) defines order of spots
+struct spot_component_t {
+    spot_t spot;
+    size_t first_fragment;
+    int16_t first_col;
+    int16_t first_line;
+};
+
+static bool component_before(const spot_component_t &a, const spot_component_t &b) {
+    if (a.first_fragment != b.first_fragment) return a.first_fragment < b.first_fragment;
+    if (a.first_col != b.first_col) return a.first_col < b.first_col;
+    return a.first_line < b.first_line;
+}
 
-    if ((it2 = strong_pixel_maps[i].find(coordxy_t(col+1, line  ))) != strong_pixel_maps[i].end())
-        merge_spots(ret_value, add_pixel(strong_pixel_maps, i, it2, connect_frames));
+// Card covers only part of the detector, this is line of the detector image, where card starts
+static int64_t card_line_offset() {
+    return (NCARDS - receiver_settings.gpu_device - 1) * 2 * LINES;
+}
 
-    if ((it2 = strong_pixel_maps[i].find(coordxy_t(col+1, line-1))) != strong_pixel_maps[i].end())
-        merge_spots(ret_value, add_pixel(strong_pixel_maps, i, it2, connect_frames));
+// 1/d^2 of each pixel of the card (col + line * COLS, spot finder coordinates)
+// Map (and mask of pixels beyond resolution limit) depends only on geometry, energy and the limit,
+// so it is rebuilt only when these change
+struct resolution_map_key_t {
+    double beam_x, beam_y, detector_distance, energy_in_keV, resolution_limit;
+    int64_t line_offset;
+    bool operator==(const resolution_map_key_t &other) const {
+        return (beam_x == other.beam_x) && (beam_y == other.beam_y) && (detector_distance == other.detector_distance)
+               && (energy_in_keV == other.energy_in_keV) && (resolution_limit == other.resolution_limit)
+               && (line_offset == other.line_offset);
+    }
+};
+
+static std::vector<float> resolution_map;
+static float max_one_over_d2; // spots and pixels with higher 1/d^2 are beyond resolution limit
+static resolution_map_key_t resolution_map_key;
+uint64_t resolution_mask[BAD_PIXEL_MASK_WORDS];
+
+// Called before data collection, returns true if the map (and so resolution_mask) changed
+bool update_resolution_map() {
+    resolution_map_key_t key;
+    key.beam_x = experiment_settings.beam_x;
+    key.beam_y = experiment_settings.beam_y;
+    key.detector_distance = experiment_settings.detector_distance;
+    key.energy_in_keV = experiment_settings.energy_in_keV;
+    key.resolution_limit = experiment_settings.spot_finding_resolution_limit;
+    key.line_offset = card_line_offset();
+    if (!resolution_map.empty() && (key == resolution_map_key)) return false;
+
+    float wavelength = WVL_1A_IN_KEV / experiment_settings.energy_in_keV;
+    // Limit of zero or below means no cut
+    if (experiment_settings.spot_finding_resolution_limit > 0)
+        max_one_over_d2 = 1 / (experiment_settings.spot_finding_resolution_limit * experiment_settings.spot_finding_resolution_limit);
+    else
+        max_one_over_d2 = INFINITY;
+
+    resolution_map.resize(2 * LINES * COLS);
+    size_t masked = 0;
+    for (size_t i = 0; i < BAD_PIXEL_MASK_WORDS; i++)
+        resolution_mask[i] = 0;
+    for (int64_t line = 0; line < 2 * LINES; line++) {
+        for (int64_t col = 0; col < COLS; col++) {
+            size_t pixel = col + line * COLS;
+            resolution_map[pixel] = get_one_over_d2(col, line + key.line_offset,
+                                                    experiment_settings.beam_x, experiment_settings.beam_y,
+                                                    experiment_settings.detector_distance, wavelength);
+            if (resolution_map[pixel] > max_one_over_d2) {
+                resolution_mask[pixel / 64] |= ((uint64_t) 1) << (pixel % 64);
+                masked++;
+            }
+        }
+    }
+    resolution_map_key = key;
+    std::cout << "Resolution map updated, pixels beyond resolution limit: " << masked << std::endl;
+    return true;
+}
 
-    if ((it2 = strong_pixel_maps[i].find(coordxy_t(col+1, line+1))) != strong_pixel_maps[i].end())
-        merge_spots(ret_value, add_pixel(strong_pixel_maps, i, it2, connect_frames));
+// Bilinear interpolation of the map at spot centroid (card coordinates)
+// Both nodes are taken from the same module, as there is a gap between modules (extrapolated at module edge)
+static float resolution_map_value(float x, float y) {
+    float fx = std::min(std::max(x, 0.0f), (float) (COLS - 1));
+    float fy = std::min(std::max(y, 0.0f), (float) (2 * LINES - 1));
+    int64_t col = fx;
+    int64_t line = fy;
+    if (col % (COLS / 2) == COLS / 2 - 1) col--;
+    if (line % LINES == LINES - 1) line--;
+    fx -= col;
+    fy -= line;
+    const float *p = resolution_map.data() + col + line * COLS;
+    return (1 - fy) * ((1 - fx) * p[0] + fx * p[1]) + fy * ((1 - fx) * p[COLS] + fx * p[COLS + 1]);
+}
 
-    if ((it2 = strong_pixel_maps[i].find(coordxy_t(col  , line-1))) != strong_pixel_maps[i].end())
-        merge_spots(ret_value, add_pixel(strong_pixel_maps, i, it2, connect_frames));
+// Sum histograms of all GPU threads, output is in detector coordinates (as spots) and sorted by pixel
+void merge_strong_pixel_histograms(std::vector<strong_pixel_count_t> &output) {
+    strong_pixel_histogram_t merged;
+    for (int i = 0; i < NCUDA_STREAMS; i++) {
+        for (strong_pixel_histogram_t::const_iterator it = strong_pixel_histogram[i].begin(); it != strong_pixel_histogram[i].end(); it++)
+            merged[it->first] += it->second;
+        strong_pixel_histogram[i].clear();
+    }
 
-    if ((it2 = strong_pixel_maps[i].find(coordxy_t(col  , line+1))) != strong_pixel_maps[i].end())
-        merge_spots(ret_value, add_pixel(strong_pixel_maps, i, it2, connect_frames));
+    output.clear();
+    output.reserve(merged.size());
+    for (strong_pixel_histogram_t::const_iterator it = merged.begin(); it != merged.end(); it++) {
+        strong_pixel_count_t entry;
+        entry.pixel = it->first + card_line_offset() * COLS;
+        entry.count = it->second;
+        output.push_back(entry);
+    }
+    std::sort(output.begin(), output.end(),
+              [](const strong_pixel_count_t &a, const strong_pixel_count_t &b) { return a.pixel < b.pixel; });
+}
 
-    if (connect_frames && (i + 2 < strong_pixel_maps.size())) {
-        if ((it2 = strong_pixel_maps[i+2].find(coordxy_t(col  , line))) != strong_pixel_maps[i+2].end())
-            merge_spots(ret_value, add_pixel(strong_pixel_maps, i+2, it2, connect_frames));
+// Apply cut-offs to complete spot and put it on the list
+// frames of the spot are relative to image0
+static void finish_spot(spot_t spot, size_t image0, std::vector<spot_t> &spots) {
+    // Spot has at least minimum number of pixels
+    if (((spot.last_frame - spot.first_frame + 1) * (spot.max_col - spot.min_col + 1) * (spot.max_line - spot.min_line + 1)) > experiment_settings.min_pixels_per_spot) {
+        // Apply pixel count cut-off and cut-off of number of frames, which spot can span
+        // (spots present in most frames, are likely to be either bad pixels or in spindle axis)
+        spot.x = spot.x / spot.photons;
+        spot.y = spot.y / spot.photons;
+        // Account for frame number
+        spot.z = spot.z / spot.photons + image0;
+
+        // Check spot resolution (map is in card coordinates)
+        float one_over_d2 = resolution_map_value(spot.x, spot.y);
+        if (one_over_d2 < max_one_over_d2) {
+            spot.d = 1 / sqrtf(one_over_d2);
+            // Account for the fact, that each process handles only part of the detector
+            spot.y += card_line_offset();
+            // Spot is put on the list
+            spots.push_back(spot);
+        }
     }
+}
 
-    if (connect_frames && (i > 1)) {
-        if ((it2 = strong_pixel_maps[i-2].find(coordxy_t(col  , line))) != strong_pixel_maps[i-2].end())
-            merge_spots(ret_value, add_pixel(strong_pixel_maps, i-2, it2, connect_frames));
+// Pixels of boundary spots in fragments of one frame, runs are in pixel order
+static void add_boundary_pixels(const std::vector<spot_run_t> &runs, size_t run0, size_t run1,
+                                const std::vector<uint32_t> &run_component, const std::vector<uint32_t> &boundary_id,
+                                std::vector<boundary_pixel_t> &output) {
+    for (size_t r = run0; r < run1; r++) {
+        uint32_t spot = boundary_id[run_component[r]];
+        if (spot == UINT32_MAX) continue;
+        for (int16_t col = runs[r].col_start; col <= runs[r].col_end; col++) {
+            boundary_pixel_t pixel;
+            pixel.pixel = col + runs[r].line * COLS;
+            pixel.spot = spot;
+            output.push_back(pixel);
+        }
     }
+}
 
-    return ret_value;
+// Spots are joined across chunks in chunk order, chunks can be finished by GPU threads in any order
+// Chunk waits in spot_stitching_pending till all previous chunks are processed
+// Spots open at the last frame of processed chunks are kept with their pixels in the last frame
+static pthread_mutex_t spot_stitching_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<spot_boundary_t> spot_stitching_pending;
+static std::vector<bool> spot_stitching_ready;
+static size_t spot_stitching_next_chunk = 0;
+static std::vector<spot_t> open_spots;
+static std::vector<size_t> open_spots_image0;
+static std::vector<boundary_pixel_t> open_spots_pixels;
+
+void reset_spot_stitching() {
+    size_t images_per_stream = NIMAGES_PER_STREAM * 2 / experiment_settings.pixel_depth;
+    size_t total_chunks = (experiment_settings.nimages_to_write + images_per_stream - 1) / images_per_stream;
+
+    pthread_mutex_lock(&spot_stitching_mutex);
+    spot_stitching_pending.clear();
+    spot_stitching_pending.resize(total_chunks);
+    spot_stitching_ready.assign(total_chunks, false);
+    spot_stitching_next_chunk = 0;
+    open_spots.clear();
+    open_spots_image0.clear();
+    open_spots_pixels.clear();
+    pthread_mutex_unlock(&spot_stitching_mutex);
 }
 
-void analyze_spots(strong_pixel *host_out, std::vector<spot_t> &spots, bool connect_frames, size_t images, size_t image0) {
-    // key is location of strong pixel - value is number of photons
-    // there is one map per fragment analyzed by GPU (2 horizontally connected modules)
-    strong_pixel_maps_t strong_pixel_maps = strong_pixel_maps_t(images*2);
-
-    pthread_mutex_lock(&strong_pixel_count_mutex);
-
-    // Transfer strong pixels into dictionary
-    for (size_t i = 0; i < images*2; i++) {
-        size_t addr = i * MAX_STRONG;
-        int k = 0;
-        // There is maximum MAX_STRONG pixels
-        // GPU kernel sets col to -1 for next element after last strong pixel
-        // Photons equal zero could mean that kernel was not at all executed
-        while ((k < MAX_STRONG) && (host_out[addr + k].col >= 0) && (host_out[addr + k].line >= 0) && (host_out[addr+k].photons > 0)) {
-            coordxy_t key = coordxy_t(host_out[addr + k].col, host_out[addr + k].line + (i%2) * LINES);
-            strong_pixel_count[key.first + key.second * COLS] += 1;
-            if (bad_pixels.find(key) == bad_pixels.end())
-                strong_pixel_maps[i][key] = host_out[addr + k].photons / ((2*NBX+1)*(2*NBY+1));
-            k++;
+// Frames of spot measured from image0 are moved to be measured from ref_image0 (ref_image0 <= image0)
+static void shift_spot(spot_t &spot, size_t image0, size_t ref_image0) {
+    uint32_t shift = image0 - ref_image0;
+    spot.z += shift * spot.photons;
+    spot.first_frame += shift;
+    spot.last_frame += shift;
+}
+
+// Join boundary spots of the chunk with spots open at the end of previous chunk
+// Must be called with spot_stitching_mutex locked
+static void stitch_chunk(const spot_boundary_t &boundary, bool last_chunk, std::vector<spot_t> &spots) {
+    size_t nopen = open_spots.size();
+    size_t nnodes = nopen + boundary.spots.size();
+
+    // Nodes are open spots followed by spots of the chunk, root is the lowest node, so the earliest spot
+    std::vector<uint32_t> parent(nnodes);
+    for (size_t n = 0; n < nnodes; n++) parent[n] = n;
+
+    // Pixel lists are sorted, the same pixel in the next frame connects spots
+    size_t a = 0, b = 0;
+    while ((a < open_spots_pixels.size()) && (b < boundary.first_frame_pixels.size())) {
+        if (open_spots_pixels[a].pixel < boundary.first_frame_pixels[b].pixel) a++;
+        else if (open_spots_pixels[a].pixel > boundary.first_frame_pixels[b].pixel) b++;
+        else {
+            join_runs(parent, open_spots_pixels[a].spot, nopen + boundary.first_frame_pixels[b].spot);
+            a++;
+            b++;
+        }
+    }
+
+    // Spot continues, if any of its parts is in the last frame of this chunk
+    std::vector<bool> node_continues(nnodes, false);
+    if (!last_chunk) {
+        for (size_t i = 0; i < boundary.last_frame_pixels.size(); i++)
+            node_continues[nopen + boundary.last_frame_pixels[i].spot] = true;
+    }
+
+    std::vector<spot_t> group_spot;
+    std::vector<size_t> group_image0;
+    std::vector<bool> group_continues;
+    std::vector<uint32_t> node_group(nnodes);
+    for (size_t n = 0; n < nnodes; n++) {
+        uint32_t root = find_run_root(parent, n);
+        spot_t spot = (n < nopen) ? open_spots[n] : boundary.spots[n - nopen];
+        size_t image0 = (n < nopen) ? open_spots_image0[n] : boundary.image0;
+        if (root == n) {
+            node_group[n] = group_spot.size();
+            group_spot.push_back(spot);
+            group_image0.push_back(image0);
+            group_continues.push_back(node_continues[n]);
+        } else {
+            uint32_t group = node_group[root];
+            node_group[n] = group;
+            shift_spot(spot, image0, group_image0[group]);
+            merge_spots(group_spot[group], spot);
+            if (node_continues[n]) group_continues[group] = true;
+        }
+    }
+
+    std::vector<uint32_t> new_open_id(group_spot.size(), UINT32_MAX);
+    std::vector<spot_t> new_open_spots;
+    std::vector<size_t> new_open_spots_image0;
+    for (size_t g = 0; g < group_spot.size(); g++) {
+        if (group_continues[g]) {
+            new_open_id[g] = new_open_spots.size();
+            new_open_spots.push_back(group_spot[g]);
+            new_open_spots_image0.push_back(group_image0[g]);
+        } else
+            finish_spot(group_spot[g], group_image0[g], spots);
+    }
+
+    open_spots_pixels.clear();
+    for (size_t i = 0; i < boundary.last_frame_pixels.size(); i++) {
+        uint32_t id = new_open_id[node_group[nopen + boundary.last_frame_pixels[i].spot]];
+        if (id == UINT32_MAX) continue;
+        boundary_pixel_t pixel;
+        pixel.pixel = boundary.last_frame_pixels[i].pixel;
+        pixel.spot = id;
+        open_spots_pixels.push_back(pixel);
+    }
+    open_spots.swap(new_open_spots);
+    open_spots_image0.swap(new_open_spots_image0);
+}
+
+// Queue boundary spots of the chunk and process all chunks, which are ready in chunk order
+// Spots finished by this are added to spots
+void stitch_spots(size_t chunk, spot_boundary_t &boundary, std::vector<spot_t> &spots) {
+    pthread_mutex_lock(&spot_stitching_mutex);
+    if (chunk >= spot_stitching_ready.size()) {
+        pthread_mutex_unlock(&spot_stitching_mutex);
+        for (size_t i = 0; i < boundary.spots.size(); i++)
+            finish_spot(boundary.spots[i], boundary.image0, spots);
+        return;
+    }
+    spot_stitching_pending[chunk].spots.swap(boundary.spots);
+    spot_stitching_pending[chunk].first_frame_pixels.swap(boundary.first_frame_pixels);
+    spot_stitching_pending[chunk].last_frame_pixels.swap(boundary.last_frame_pixels);
+    spot_stitching_pending[chunk].image0 = boundary.image0;
+    spot_stitching_ready[chunk] = true;
+
+    while ((spot_stitching_next_chunk < spot_stitching_ready.size()) && spot_stitching_ready[spot_stitching_next_chunk]) {
+        spot_boundary_t &next = spot_stitching_pending[spot_stitching_next_chunk];
+        stitch_chunk(next, spot_stitching_next_chunk + 1 == spot_stitching_ready.size(), spots);
+        next = spot_boundary_t(); // release memory
+        spot_stitching_next_chunk++;
+    }
+    pthread_mutex_unlock(&spot_stitching_mutex);
+}
+
+// Histogram of strong pixels is private to the calling GPU thread, so no locking is needed
+// Spots are labeled with union-find on runs of strong pixels, which is linear in number of strong pixels
+// Returns number of images with strong pixel overflow
+size_t analyze_spots(const strong_pixel *host_out, const strong_pixel_index_t *index, std::vector<spot_t> &spots,
+                   strong_pixel_histogram_t &histogram, bool connect_frames, size_t images, size_t image0, size_t chunk) {
+    size_t nfragments = images * 2;
+
+    // there is one range of pixels and runs per fragment analyzed by GPU (2 horizontally connected modules)
+    std::vector<spot_pixel_t> pixels;
+    std::vector<spot_run_t> runs;
+    std::vector<size_t> fragment_pixel0(nfragments + 1);
+    std::vector<size_t> fragment_run0(nfragments + 1);
+
+    int box_pixels = (2 * experiment_settings.spot_finding_nbx + 1) * (2 * experiment_settings.spot_finding_nby + 1);
+
+    // Images, where strong pixels were lost, are reported - spots of these images are incomplete
+    size_t overflow_images = 0;
+    size_t overflow_pixels = 0;
+    size_t first_overflow_image = 0;
+    for (size_t i = 0; i < images; i++) {
+        size_t lost = 0;
+        for (size_t j = 2 * i; j < 2 * i + 2; j++) {
+            lost += index[j].found - index[j].saved;
+        }
+        if (lost > 0) {
+            if (overflow_images == 0) first_overflow_image = image0 + i;
+            overflow_images++;
+            overflow_pixels += lost;
         }
     }
-    pthread_mutex_lock(&strong_pixel_count_mutex);
-
-    for (int i = 0; i < images*2; i++) {
-        strong_pixel_map_t::iterator iterator = strong_pixel_maps[i].begin();
-        while (iterator != strong_pixel_maps[i].end()) {
-            spot_t spot = add_pixel(strong_pixel_maps, i, iterator, connect_frames);
-
-            // Spot has at least minimum number of pixels
-            if (((spot.last_frame - spot.first_frame + 1) * (spot.max_col - spot.min_col + 1) * (spot.max_line - spot.min_line + 1)) > experiment_settings.min_pixels_per_spot) {
-                // Apply pixel count cut-off and cut-off of number of frames, which spot can span
-                // (spots present in most frames, are likely to be either bad pixels or in spindle axis)
-                spot.x = spot.x / spot.photons;
-                // Account for the fact, that each process handles only part of the detector
-                spot.y = spot.y / spot.photons + (NCARDS - receiver_settings.gpu_device - 1) * 2 * LINES;
-                // Account for frame number
-                spot.z = spot.z / spot.photons + image0;
-
-                // Find lab coordinates of the pixel
-                float lab[3];
-                detector_to_lab(spot.x, spot.y, lab, experiment_settings.beam_x, experiment_settings.beam_y, experiment_settings.detector_distance);
-
-                // Get resolution
-                spot.d = get_resolution(lab, WVL_1A_IN_KEV / (experiment_settings.energy_in_keV));
-
-                // Check spot resolution
-                if (spot.d > experiment_settings.spot_finding_resolution_limit) {
-                    // Spot is put on the list
-                    spots.push_back(spot);
+    if (overflow_images > 0) {
+        strong_pixel_overflow_images += overflow_images;
+        strong_pixel_overflow_pixels += overflow_pixels;
+        std::cerr << "Strong pixel overflow in " << overflow_images << " images (first image " << first_overflow_image
+                  << "), " << overflow_pixels << " pixels not saved" << std::endl;
+    }
+
+    // Transfer strong pixels into list, kernels save pixels in line order
+    for (size_t i = 0; i < nfragments; i++) {
+        const strong_pixel *fragment_out = host_out + index[i].offset;
+        size_t nstrong = index[i].saved;
+        fragment_pixel0[i] = pixels.size();
+        fragment_run0[i] = runs.size();
+        for (size_t k = 0; k < nstrong; k++) {
+            spot_pixel_t pixel;
+            pixel.col = fragment_out[k].col;
+            pixel.line = fragment_out[k].line + (i%2) * LINES;
+            histogram[pixel.col + pixel.line * COLS]++;
+            if (!is_bad_pixel(pixel.col, pixel.line)) {
+                pixel.photons = fragment_out[k].photons / box_pixels;
+                pixels.push_back(pixel);
+            }
+        }
+        encode_runs(pixels, fragment_pixel0[i], pixels.size(), runs);
+    }
+    fragment_pixel0[nfragments] = pixels.size();
+    fragment_run0[nfragments] = runs.size();
+
+    std::vector<uint32_t> parent(runs.size());
+    for (size_t r = 0; r < runs.size(); r++) parent[r] = r;
+
+    for (size_t i = 0; i < nfragments; i++) {
+        join_runs_in_fragment(runs, fragment_run0[i], fragment_run0[i+1], parent);
+        if (connect_frames && (i + 2 < nfragments))
+            join_runs_between_fragments(runs, fragment_run0[i], fragment_run0[i+1],
+                                        fragment_run0[i+2], fragment_run0[i+3], parent);
+    }
+
+    // Sum pixels of each spot
+    std::vector<uint32_t> run_component(runs.size());
+    std::vector<spot_component_t> components;
+    for (size_t i = 0; i < nfragments; i++) {
+        for (size_t r = fragment_run0[i]; r < fragment_run0[i+1]; r++) {
+            uint32_t root = find_run_root(parent, r);
+            // root has the lowest index, so it is always visited before other runs of the spot
+            if (root == r) {
+                spot_component_t component;
+                component.spot = pixel_to_spot(pixels[runs[r].first_pixel], i);
+                component.first_fragment = i;
+                component.first_col = runs[r].col_start;
+                component.first_line = runs[r].line;
+                run_component[r] = components.size();
+                components.push_back(component);
+            } else run_component[r] = run_component[root];
+
+            spot_component_t &component = components[run_component[r]];
+            size_t npixels = runs[r].col_end - runs[r].col_start + 1;
+            for (size_t p = runs[r].first_pixel; p < runs[r].first_pixel + npixels; p++) {
+                if (p != runs[root].first_pixel) merge_spots(component.spot, pixel_to_spot(pixels[p], i));
+                if ((i == component.first_fragment) && (pixels[p].col < component.first_col)) {
+                    component.first_col = pixels[p].col;
+                    component.first_line = pixels[p].line;
                 }
             }
-            iterator = strong_pixel_maps[i].begin(); // Get first yet unprocessed spot in this frame
         }
     }
+
+    // Same order of spots, as when frames were scanned pixel by pixel
+    std::vector<uint32_t> order(components.size());
+    for (size_t c = 0; c < components.size(); c++) order[c] = c;
+    std::sort(order.begin(), order.end(), [&components](uint32_t a, uint32_t b) {
+        return component_before(components[a], components[b]);
+    });
+
+    if (!connect_frames) {
+        for (size_t c = 0; c < order.size(); c++)
+            finish_spot(components[order[c]].spot, image0, spots);
+        return overflow_images;
+    }
+
+    // Spots touching first or last frame of the chunk can continue in the neighbouring chunk
+    spot_boundary_t boundary;
+    boundary.image0 = image0;
+    std::vector<uint32_t> boundary_id(components.size(), UINT32_MAX);
+    for (size_t c = 0; c < order.size(); c++) {
+        const spot_t &spot = components[order[c]].spot;
+        if ((spot.first_frame == 0) || (spot.last_frame == images - 1)) {
+            boundary_id[order[c]] = boundary.spots.size();
+            boundary.spots.push_back(spot);
+        } else
+            finish_spot(spot, image0, spots);
+    }
+    add_boundary_pixels(runs, fragment_run0[0], fragment_run0[2], run_component, boundary_id,
+                        boundary.first_frame_pixels);
+    add_boundary_pixels(runs, fragment_run0[nfragments - 2], fragment_run0[nfragments], run_component, boundary_id,
+                        boundary.last_frame_pixels);
+
+    stitch_spots(chunk, boundary, spots);
+    return overflow_images;
 }
@@ -0,0 +1,224 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Summed-area-table (integral image) version of colspot strong pixel finder
+// Fragment is divided into tiles, each tile with halo is loaded into shared memory,
+// where integral images of sum and sum^2 are calculated. Box statistics of each pixel are then 4 lookups,
+// so every pixel is evaluated by a separate thread. Strong pixels are marked in a bitmap
+// (bit line * COLS + col of the fragment) and the second step writes them in the same order and format
+// as find_spots_colspot does (find_spots.cu).
+//
+// Code is written as phases, which take thread number and number of threads, so it compiles also as host C++
+// On GPU phases are separated by __syncthreads(), on CPU they are called for the whole tile one after another.
+
+#ifndef _COLSPOT_SAT_H
+#define _COLSPOT_SAT_H
+
+#include "JFReceiver.h"
+
+#ifdef __CUDACC__
+#define COLSPOT_HOST_DEVICE __host__ __device__
+#else
+#define COLSPOT_HOST_DEVICE
+#endif
+
+#define SAT_TILE_COLS  64L
+#define SAT_TILE_LINES 16L
+#define SAT_TILES_X    ((COLS + SAT_TILE_COLS - 1) / SAT_TILE_COLS)
+#define SAT_TILES_Y    ((LINES + SAT_TILE_LINES - 1) / SAT_TILE_LINES)
+#define SAT_THREADS    256
+#define SAT_BITMAP_WORDS ((LINES * COLS + 63) / 64) // per fragment
+
+// Bad pixel mask layout is described in JFReceiver.h
+COLSPOT_HOST_DEVICE inline bool colspot_bad_pixel(const uint64_t *bad_pixel_mask, int16_t col, int16_t line) {
+    size_t pixel = col + line * COLS;
+    return (bad_pixel_mask[pixel / 64] >> (pixel % 64)) & 1;
+}
+
+// True if all pixels col0 <= col < col1 of the line are masked, checked word by word
+COLSPOT_HOST_DEVICE inline bool colspot_masked_run(const uint64_t *bad_pixel_mask, int col0, int col1, int line) {
+    size_t pixel = col0 + line * COLS;
+    size_t pixel1 = col1 + line * COLS;
+    while (pixel < pixel1) {
+        size_t bit0 = pixel % 64;
+        size_t bits = (pixel1 - pixel < 64 - bit0) ? (pixel1 - pixel) : (64 - bit0);
+        uint64_t expected = (bits == 64) ? ~0ULL : (((1ULL << bits) - 1) << bit0);
+        if ((bad_pixel_mask[pixel / 64] & expected) != expected) return false;
+        pixel += bits;
+    }
+    return true;
+}
+
+// Integral images of tile with halo, first line and column are zero
+template<int NBX, int NBY> struct sat_tile_t {
+    static const int cols  = SAT_TILE_COLS + 2 * NBX + 1;
+    static const int lines = SAT_TILE_LINES + 2 * NBY + 1;
+    int64_t sum[lines][cols];
+    int64_t sum2[lines][cols];
+};
+
+// True if all pixels evaluated in tile lines of this thread are masked (e.g. outside of resolution range),
+// tile is then skipped without loading (tiles outside of evaluated range are also skipped)
+template<int NBX, int NBY>
+COLSPOT_HOST_DEVICE bool sat_tile_masked(const uint64_t *bad_pixel_mask, int16_t mask_line0, int tile_line0, int tile_col0,
+                                         int thread, int nthreads) {
+    int col0 = (tile_col0 < NBX) ? NBX : tile_col0;
+    int col1 = (tile_col0 + SAT_TILE_COLS > COLS - NBX) ? (COLS - NBX) : (tile_col0 + SAT_TILE_COLS);
+    for (int ty = thread; ty < SAT_TILE_LINES; ty += nthreads) {
+        int line = tile_line0 + ty;
+        if ((line < NBY) || (line >= LINES - NBY) || (col0 >= col1)) continue;
+        if (!colspot_masked_run(bad_pixel_mask, col0, col1, mask_line0 + line)) return false;
+    }
+    return true;
+}
+
+// Load tile with halo, pixels outside of fragment are zero (these are never used for evaluated pixels)
+template<typename T, int NBX, int NBY>
+COLSPOT_HOST_DEVICE void sat_tile_load(sat_tile_t<NBX, NBY> &tile, const T *in, int tile_line0, int tile_col0,
+                                       int thread, int nthreads) {
+    for (int i = thread; i < tile.lines * tile.cols; i += nthreads) {
+        int y = i / tile.cols;
+        int x = i % tile.cols;
+        int64_t value = 0;
+        int line = tile_line0 - NBY + y - 1;
+        int col = tile_col0 - NBX + x - 1;
+        if ((y > 0) && (x > 0) && (line >= 0) && (line < LINES) && (col >= 0) && (col < COLS))
+            value = in[line * COLS + col];
+        tile.sum[y][x] = value;
+        tile.sum2[y][x] = value * value;
+    }
+}
+
+template<int NBX, int NBY>
+COLSPOT_HOST_DEVICE void sat_tile_rows(sat_tile_t<NBX, NBY> &tile, int thread, int nthreads) {
+    for (int y = thread; y < tile.lines; y += nthreads) {
+        for (int x = 1; x < tile.cols; x++) {
+            tile.sum[y][x] += tile.sum[y][x - 1];
+            tile.sum2[y][x] += tile.sum2[y][x - 1];
+        }
+    }
+}
+
+template<int NBX, int NBY>
+COLSPOT_HOST_DEVICE void sat_tile_cols(sat_tile_t<NBX, NBY> &tile, int thread, int nthreads) {
+    for (int x = thread; x < tile.cols; x += nthreads) {
+        for (int y = 1; y < tile.lines; y++) {
+            tile.sum[y][x] += tile.sum[y - 1][x];
+            tile.sum2[y][x] += tile.sum2[y - 1][x];
+        }
+    }
+}
+
+// Box sum of pixel (ty, tx) of the tile
+template<int NBX, int NBY>
+COLSPOT_HOST_DEVICE inline int64_t sat_box(const int64_t (&sat)[sat_tile_t<NBX, NBY>::lines][sat_tile_t<NBX, NBY>::cols],
+                                           int ty, int tx) {
+    return sat[ty + 2 * NBY + 1][tx + 2 * NBX + 1] - sat[ty][tx + 2 * NBX + 1]
+           - sat[ty + 2 * NBY + 1][tx] + sat[ty][tx];
+}
+
+// Same test as in find_spots_colspot, strong pixels are marked in bitmap of the fragment
+template<typename T, int NBX, int NBY>
+COLSPOT_HOST_DEVICE void sat_tile_evaluate(const sat_tile_t<NBX, NBY> &tile, const T *in, uint64_t *bitmap,
+                                           const uint64_t *bad_pixel_mask, float strong, int16_t mask_line0,
+                                           int tile_line0, int tile_col0, int thread, int nthreads) {
+    float threshold = strong * strong * (float)((2*NBX+1) * (2*NBY+1)) / (float) ((2*NBX+1) * (2*NBY+1)-1);
+    for (int i = thread; i < SAT_TILE_LINES * SAT_TILE_COLS; i += nthreads) {
+        int ty = i / SAT_TILE_COLS;
+        int tx = i % SAT_TILE_COLS;
+        int line = tile_line0 + ty;
+        int col = tile_col0 + tx;
+        if ((line < NBY) || (line >= LINES - NBY) || (col < NBX) || (col >= COLS - NBX)) continue;
+        if (colspot_bad_pixel(bad_pixel_mask, col, mask_line0 + line)) continue;
+
+        int64_t sum  = sat_box<NBX, NBY>(tile.sum, ty, tx);
+        int64_t sum2 = sat_box<NBX, NBY>(tile.sum2, ty, tx);
+        int64_t var = (2*NBX+1) * (2*NBY+1) * sum2 - (sum * sum);
+        int64_t in_minus_mean = in[line * COLS + col] * ((2*NBX+1) * (2*NBY+1)) - sum;
+
+        if ((in_minus_mean > (2*NBX+1) * (2*NBY+1)) &&
+            (in[line * COLS + col] > 0) &&
+            (in_minus_mean * in_minus_mean > var * threshold)) {
+            size_t bit = line * COLS + col;
+#ifdef __CUDA_ARCH__
+            atomicOr((unsigned long long *) (bitmap + bit / 64), 1ULL << (bit % 64));
+#else
+            bitmap[bit / 64] |= 1ULL << (bit % 64);
+#endif
+        }
+    }
+}
+
+// Write strong pixels of the fragment in line order into output table (MAX_STRONG entries, as in colspot)
+// Returns number of strong pixels found, bitmap is cleared, so it is ready for the next chunk
+template<typename T, int NBX, int NBY>
+COLSPOT_HOST_DEVICE uint32_t sat_compact(const T *in, uint64_t *bitmap, strong_pixel *out) {
+    uint32_t strong_id = 0;
+    for (size_t word = 0; word < SAT_BITMAP_WORDS; word++) {
+        uint64_t value = bitmap[word];
+        if (value == 0) continue;
+        bitmap[word] = 0;
+        while (value != 0) {
+#ifdef __CUDA_ARCH__
+            int b = __ffsll(value) - 1;
+#else
+            int b = __builtin_ctzll(value);
+#endif
+            value &= value - 1;
+            size_t pixel = word * 64 + b;
+            int16_t line = pixel / COLS;
+            int16_t col = pixel % COLS;
+            if (strong_id >= MAX_STRONG) {
+                strong_id++;
+                continue;
+            }
+
+            int64_t sum = 0;
+            for (int y = -NBY; y <= NBY; y++) {
+                for (int x = -NBX; x <= NBX; x++)
+                    sum += in[(line + y) * COLS + col + x];
+            }
+            out[strong_id].line = line;
+            out[strong_id].col = col;
+            out[strong_id].photons = in[pixel] * ((2*NBX+1) * (2*NBY+1)) - sum;
+            strong_id++;
+        }
+    }
+    return strong_id;
+}
+
+// Host version - the same phases run one after another for each tile
+template<typename T, int NBX, int NBY>
+uint32_t sat_fragment_host(const T *in, strong_pixel *out, uint64_t *bitmap, const uint64_t *bad_pixel_mask,
+                       float strong, int16_t mask_line0) {
+    sat_tile_t<NBX, NBY> *tile = new sat_tile_t<NBX, NBY>;
+    for (int tile_y = 0; tile_y < SAT_TILES_Y; tile_y++) {
+        for (int tile_x = 0; tile_x < SAT_TILES_X; tile_x++) {
+            int tile_line0 = tile_y * SAT_TILE_LINES;
+            int tile_col0 = tile_x * SAT_TILE_COLS;
+            if (sat_tile_masked<NBX, NBY>(bad_pixel_mask, mask_line0, tile_line0, tile_col0, 0, 1)) continue;
+            sat_tile_load<T, NBX, NBY>(*tile, in, tile_line0, tile_col0, 0, 1);
+            sat_tile_rows<NBX, NBY>(*tile, 0, 1);
+            sat_tile_cols<NBX, NBY>(*tile, 0, 1);
+            sat_tile_evaluate<T, NBX, NBY>(*tile, in, bitmap, bad_pixel_mask, strong, mask_line0,
+                                           tile_line0, tile_col0, 0, 1);
+        }
+    }
+    delete tile;
+    return sat_compact<T, NBX, NBY>(in, bitmap, out);
+}
+
+#endif
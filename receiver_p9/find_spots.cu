@@ -21,6 +21,7 @@
 
 #include <iostream>
 #include "JFReceiver.h"
+#include "colspot_sat.h"
 
 // modules are stacked two vertically
 // 67 (modules 6 and 7)
@@ -35,8 +36,11 @@
 cudaStream_t stream[NCUDA_STREAMS];
 
 // GPU kernel to find strong pixels
-template<typename T>
-__global__ void find_spots_colspot(T *in, strong_pixel *out, float strong, int N) {
+// Box half-widths are template parameters, so loops over the box are unrolled and constants folded
+// Bad pixel mask has the same layout as on CPU (see JFReceiver.h)
+template<typename T, int NBX, int NBY>
+__global__ void find_spots_colspot(T *in, strong_pixel *out, strong_pixel_index_t *index, const uint64_t *bad_pixel_mask,
+                                   float strong, int N) {
      if (blockIdx.x * blockDim.x + threadIdx.x < N) {
         // Threshold for signal^2 / var
         // To avoid division (see later) N/(N-1) factor is included already in the threshold
@@ -46,9 +50,12 @@ __global__ void find_spots_colspot(T *in, strong_pixel *out, float strong, int N
         // line0 points to the module/frame
         size_t line0 = (blockIdx.x * blockDim.x + threadIdx.x) * LINES;
 
+        // Even threads process bottom, odd threads top half of the card
+        int16_t mask_line0 = ((blockIdx.x * blockDim.x + threadIdx.x) % 2) * LINES;
+
         // Location of the first strong pixel in the output array 
         size_t strong_id0 = (blockIdx.x * blockDim.x + threadIdx.x) * MAX_STRONG;
-        size_t strong_id = 0;
+        uint32_t strong_id = 0;
 
         // Sum and sum of squares of (2*NBY+1) vertical elements 
         // These are updated after each line is finished
@@ -59,13 +66,13 @@ __global__ void find_spots_colspot(T *in, strong_pixel *out, float strong, int N
         // Precalculate squares for first 2*NBY+1 lines
         for (int col = 0; col < COLS; col++) {
             sum_vert[col]  = in[(line0) * COLS + col];
-            sum2_vert[col] = in[(line0) * COLS + col]*in[(line0) * COLS + col];
+            sum2_vert[col] = (int64_t) in[(line0) * COLS + col]*in[(line0) * COLS + col];
         }
  
         for (size_t line = 1; line < 2*NBY+1; line++) {
             for (int col = 0; col < COLS; col++) {
                 sum_vert[col]  += in[(line0 + line) * COLS + col];
-                sum2_vert[col] += in[(line0 + line) * COLS + col] * in[(line0 + line) * COLS + col];
+                sum2_vert[col] += (int64_t) in[(line0 + line) * COLS + col] * in[(line0 + line) * COLS + col];
             }
         }
 
@@ -89,14 +96,17 @@ __global__ void find_spots_colspot(T *in, strong_pixel *out, float strong, int N
                 int64_t var = (2*NBX+1) * (2*NBY+1) * sum2 - (sum * sum); // This should be divided by ((2*NBX+1) * (2*NBY+1)-1)*((2*NBX+1) * (2*NBY+1))
                 int64_t in_minus_mean = in[(line0 + line)*COLS+col] * ((2*NBX+1) * (2*NBY+1)) - sum; // Should be divided by ((2*NBX+1) * (2*NBY+1));
 
-                if ((in_minus_mean > (2*NBX+1) * (2*NBY+1)) && // pixel value is larger than mean
+                if (!colspot_bad_pixel(bad_pixel_mask, col, mask_line0 + line) && // masked pixels are not evaluated
+                    (in_minus_mean > (2*NBX+1) * (2*NBY+1)) && // pixel value is larger than mean
                     (in[(line0 + line)*COLS+col] > 0) && // pixel is not bad pixel and is above 0
                     (in_minus_mean * in_minus_mean > var * threshold)) {
-                       // Save line, column and photon count in output table
-                       out[strong_id0+strong_id].line = line;
-                       out[strong_id0+strong_id].col = col;
-                       out[strong_id0+strong_id].photons = in_minus_mean;
-                       strong_id = (strong_id + 1 ) % MAX_STRONG;
+                       // Save line, column and photon count in output table, above MAX_STRONG pixels are only counted
+                       if (strong_id < MAX_STRONG) {
+                           out[strong_id0+strong_id].line = line;
+                           out[strong_id0+strong_id].col = col;
+                           out[strong_id0+strong_id].photons = in_minus_mean;
+                       }
+                       strong_id++;
                     }
 
                 // Updated value of sum and sum2
@@ -117,15 +127,118 @@ __global__ void find_spots_colspot(T *in, strong_pixel *out, float strong, int N
                 }
             }
         }
-        // Mark, where useful data and in output table
-        out[strong_id0+strong_id].line = -1;
-        out[strong_id0+strong_id].col = -1;
-        out[strong_id0+strong_id].photons = strong_id;
+        index[blockIdx.x * blockDim.x + threadIdx.x].found = strong_id;
    }
 }
 
+// Offsets of fragments in compacted output - exclusive prefix sum of saved pixels
+// Pixels, which don't fit into compacted output (capacity), are not saved - same as pixels above MAX_STRONG
+// There are at most 2 * NIMAGES_PER_STREAM fragments, so one thread is enough
+// Total number of saved pixels is put as offset of element N
+__global__ void index_strong_pixels(strong_pixel_index_t *index, int N, uint32_t capacity) {
+    uint32_t offset = 0;
+    for (int i = 0; i < N; i++) {
+        index[i].offset = offset;
+        index[i].saved = min(min(index[i].found, (uint32_t) MAX_STRONG), capacity - offset);
+        offset += index[i].saved;
+    }
+    index[N].offset = offset;
+    index[N].found = 0;
+    index[N].saved = 0;
+}
+
+// One block per fragment copies saved pixels from MAX_STRONG window into compacted output
+__global__ void compact_strong_pixels(const strong_pixel *out, const strong_pixel_index_t *index, strong_pixel *compact) {
+    const strong_pixel *fragment_out = out + blockIdx.x * MAX_STRONG;
+    uint32_t n = index[blockIdx.x].saved;
+    for (uint32_t i = threadIdx.x; i < n; i += blockDim.x)
+        compact[index[blockIdx.x].offset + i] = fragment_out[i];
+}
+
+// Launch kernel for given pixel type and box size
+// bitmap is used only by summed-area-table kernel
+typedef void (*colspot_launch_t)(void *in, strong_pixel *out, strong_pixel_index_t *index, uint64_t *bitmap,
+                                 const uint64_t *bad_pixel_mask, float strong, int N, size_t blocks, cudaStream_t stream);
+
+template<typename T, int NBX, int NBY>
+void launch_colspot(void *in, strong_pixel *out, strong_pixel_index_t *index, uint64_t *bitmap,
+                    const uint64_t *bad_pixel_mask, float strong, int N, size_t blocks, cudaStream_t stream) {
+    find_spots_colspot<T, NBX, NBY> <<<blocks, 32, 0, stream>>> ((T *) in, out, index, bad_pixel_mask, strong, N);
+}
+
+// Dispatch table [pixel depth 16/32-bit][NBX-1][NBY-1]
+#define COLSPOT_ROW(T, NBX) {launch_colspot<T, NBX, 1>, launch_colspot<T, NBX, 2>, launch_colspot<T, NBX, 3>, \
+                             launch_colspot<T, NBX, 4>, launch_colspot<T, NBX, 5>}
+#define COLSPOT_TABLE(T) {COLSPOT_ROW(T, 1), COLSPOT_ROW(T, 2), COLSPOT_ROW(T, 3), COLSPOT_ROW(T, 4), COLSPOT_ROW(T, 5)}
+static const colspot_launch_t colspot_launch[2][SPOT_BOX_MAX_HALF_WIDTH][SPOT_BOX_MAX_HALF_WIDTH] =
+        {COLSPOT_TABLE(int16_t), COLSPOT_TABLE(int32_t)};
+
 char *gpu_data;
-strong_pixel *gpu_out;
+strong_pixel *gpu_out;          // MAX_STRONG window per fragment
+strong_pixel *gpu_compact;      // compacted strong pixels
+strong_pixel_index_t *gpu_index;
+strong_pixel *host_compact;     // pinned copies of compacted output (SPOT_ASSEMBLY_BUFFERS per stream)
+strong_pixel_index_t *host_index;
+uint64_t *gpu_bad_pixel_mask;
+uint64_t *gpu_sat_bitmap = NULL;
+
+// Summed-area-table kernel (see colspot_sat.h)
+// One block is one tile of a fragment, so there are SAT_TILES_X * SAT_TILES_Y * N blocks of SAT_THREADS
+// instead of N threads in total for find_spots_colspot
+template<typename T, int NBX, int NBY>
+__global__ void find_spots_sat_tiles(T *in, uint64_t *bitmap, const uint64_t *bad_pixel_mask, float strong) {
+    __shared__ sat_tile_t<NBX, NBY> tile;
+
+    size_t fragment = blockIdx.z;
+    int16_t mask_line0 = (fragment % 2) * LINES;
+    int tile_line0 = blockIdx.y * SAT_TILE_LINES;
+    int tile_col0 = blockIdx.x * SAT_TILE_COLS;
+    T *fragment_in = in + fragment * LINES * COLS;
+
+    // Whole block leaves if all pixels of the tile are masked
+    if (__syncthreads_and(sat_tile_masked<NBX, NBY>(bad_pixel_mask, mask_line0, tile_line0, tile_col0,
+                                                    threadIdx.x, blockDim.x)))
+        return;
+    sat_tile_load<T, NBX, NBY>(tile, fragment_in, tile_line0, tile_col0, threadIdx.x, blockDim.x);
+    __syncthreads();
+    sat_tile_rows<NBX, NBY>(tile, threadIdx.x, blockDim.x);
+    __syncthreads();
+    sat_tile_cols<NBX, NBY>(tile, threadIdx.x, blockDim.x);
+    __syncthreads();
+    sat_tile_evaluate<T, NBX, NBY>(tile, fragment_in, bitmap + fragment * SAT_BITMAP_WORDS, bad_pixel_mask, strong,
+                                   mask_line0, tile_line0, tile_col0, threadIdx.x, blockDim.x);
+}
+
+// One thread per fragment writes strong pixels in line order
+template<typename T, int NBX, int NBY>
+__global__ void find_spots_sat_compact(T *in, uint64_t *bitmap, strong_pixel *out, strong_pixel_index_t *index, int N) {
+    size_t fragment = blockIdx.x * blockDim.x + threadIdx.x;
+    if (fragment < N)
+        index[fragment].found = sat_compact<T, NBX, NBY>(in + fragment * LINES * COLS, bitmap + fragment * SAT_BITMAP_WORDS,
+                                                         out + fragment * MAX_STRONG);
+}
+
+// blocks argument is not used, grid is derived from N
+template<typename T, int NBX, int NBY>
+void launch_sat(void *in, strong_pixel *out, strong_pixel_index_t *index, uint64_t *bitmap,
+                const uint64_t *bad_pixel_mask, float strong, int N, size_t blocks, cudaStream_t stream) {
+    dim3 grid(SAT_TILES_X, SAT_TILES_Y, N);
+    find_spots_sat_tiles<T, NBX, NBY> <<<grid, SAT_THREADS, 0, stream>>> ((T *) in, bitmap, bad_pixel_mask, strong);
+    find_spots_sat_compact<T, NBX, NBY> <<<(N + 31) / 32, 32, 0, stream>>> ((T *) in, bitmap, out, index, N);
+}
+
+#define SAT_ROW(T, NBX) {launch_sat<T, NBX, 1>, launch_sat<T, NBX, 2>, launch_sat<T, NBX, 3>, \
+                         launch_sat<T, NBX, 4>, launch_sat<T, NBX, 5>}
+#define SAT_TABLE(T) {SAT_ROW(T, 1), SAT_ROW(T, 2), SAT_ROW(T, 3), SAT_ROW(T, 4), SAT_ROW(T, 5)}
+static const colspot_launch_t sat_launch[2][SPOT_BOX_MAX_HALF_WIDTH][SPOT_BOX_MAX_HALF_WIDTH] =
+        {SAT_TABLE(int16_t), SAT_TABLE(int32_t)};
+
+// Check if CUDA device is present, otherwise strong pixels are found on CPU
+bool gpu_available(int device) {
+    int count = 0;
+    if (cudaGetDeviceCount(&count) != cudaSuccess) return false;
+    return (device < count);
+}
 
 int setup_gpu(int device) {
     // Set device
@@ -148,13 +261,38 @@ int setup_gpu(int device) {
          return 1;
     }
 
-    // Initialize output memory as GPU/CPU unified memory
-    err = cudaMallocManaged((void **) &gpu_out, NCUDA_STREAMS * NIMAGES_PER_STREAM * 2 * MAX_STRONG * sizeof(strong_pixel)); // frame is divided into 2 vertical slices
-    if (err != cudaSuccess) {
+    // Initialize output memory, frame is divided into 2 vertical slices
+    // Only used part of compacted output is copied to (pinned) host memory
+    size_t out_size = NCUDA_STREAMS * NIMAGES_PER_STREAM * 2 * MAX_STRONG * sizeof(strong_pixel);
+    size_t compact_size = NCUDA_STREAMS * NIMAGES_PER_STREAM * 2 * COMPACT_STRONG_PER_FRAGMENT * sizeof(strong_pixel);
+    size_t index_size = NCUDA_STREAMS * (NIMAGES_PER_STREAM * 2 + 1) * sizeof(strong_pixel_index_t);
+    if ((cudaMalloc((void **) &gpu_out, out_size) != cudaSuccess) ||
+        (cudaMalloc((void **) &gpu_compact, compact_size) != cudaSuccess) ||
+        (cudaMalloc((void **) &gpu_index, index_size) != cudaSuccess) ||
+        (cudaMallocHost((void **) &host_compact, SPOT_ASSEMBLY_BUFFERS * compact_size) != cudaSuccess) ||
+        (cudaMallocHost((void **) &host_index, SPOT_ASSEMBLY_BUFFERS * index_size) != cudaSuccess)) {
          std::cerr << "GPU: Mem alloc. error (output)" << std::endl;
          return 1;
     }
 
+    err = cudaMalloc((void **) &gpu_bad_pixel_mask, BAD_PIXEL_MASK_WORDS * sizeof(uint64_t));
+    if (err != cudaSuccess) {
+         std::cerr << "GPU: Mem alloc. error (bad pixel mask)" << std::endl;
+         return 1;
+    }
+    cudaMemset(gpu_bad_pixel_mask, 0, BAD_PIXEL_MASK_WORDS * sizeof(uint64_t));
+
+    // Bitmap of strong pixels for summed-area-table kernel, it is cleared by the kernel after use
+    if (receiver_settings.sat_spot_kernel) {
+        size_t bitmap_size = NCUDA_STREAMS * NIMAGES_PER_STREAM * 2 * SAT_BITMAP_WORDS * sizeof(uint64_t);
+        err = cudaMalloc((void **) &gpu_sat_bitmap, bitmap_size);
+        if (err != cudaSuccess) {
+             std::cerr << "GPU: Mem alloc. error (strong pixel bitmap) " << bitmap_size / 1024 / 1024 << std::endl;
+             return 1;
+        }
+        cudaMemset(gpu_sat_bitmap, 0, bitmap_size);
+    }
+
     // Create computing streams
     for (int i = 0; i < NCUDA_STREAMS; i++) {
         err = cudaStreamCreate(&stream[i]);
@@ -168,13 +306,29 @@ int setup_gpu(int device) {
     for (int i = 0; i < NCUDA_STREAMS*CUDA_TO_IB_BUFFER; i++) {
             pthread_mutex_init(cuda_stream_ready_mutex+i, NULL);
             pthread_cond_init(cuda_stream_ready_cond+i, NULL);
-            pthread_mutex_init(writer_threads_done_mutex+i, NULL);
-            pthread_cond_init(writer_threads_done_cond+i, NULL);
+            pthread_mutex_init(chunk_written_mutex+i, NULL);
+            pthread_cond_init(chunk_written_cond+i, NULL);
+    }
+    return 0;
+}
+
+// Must not be called, when GPU threads are running
+int upload_bad_pixel_mask() {
+    cudaError_t err = cudaMemcpy(gpu_bad_pixel_mask, bad_pixel_mask, BAD_PIXEL_MASK_WORDS * sizeof(uint64_t), cudaMemcpyHostToDevice);
+    if (err != cudaSuccess) {
+        std::cerr << "GPU: Bad pixel mask copy error (" << cudaGetErrorString(err) << ")" << std::endl;
+        return 1;
     }
     return 0;
 }
 
 int close_gpu() {
+    if (gpu_sat_bitmap != NULL) cudaFree(gpu_sat_bitmap);
+    cudaFree(gpu_bad_pixel_mask);
+    cudaFreeHost(host_index);
+    cudaFreeHost(host_compact);
+    cudaFree(gpu_index);
+    cudaFree(gpu_compact);
     cudaFree(gpu_out);
     cudaFree(gpu_data);
     cudaError_t err = cudaHostUnregister(ib_buffer);
@@ -185,8 +339,8 @@ int close_gpu() {
     for (int i = 0; i < NCUDA_STREAMS*CUDA_TO_IB_BUFFER; i++) {
             pthread_mutex_destroy(cuda_stream_ready_mutex+i);
             pthread_cond_destroy(cuda_stream_ready_cond+i);
-            pthread_mutex_destroy(writer_threads_done_mutex+i);
-            pthread_cond_destroy(writer_threads_done_cond+i);
+            pthread_mutex_destroy(chunk_written_mutex+i);
+            pthread_cond_destroy(chunk_written_cond+i);
     }
 
     return 0;
@@ -209,6 +363,18 @@ void *run_gpu_thread(void *in_threadarg) {
 
     size_t thread_id = arg->ThreadID;
 
+    // Box size is checked by main thread
+    colspot_launch_t colspot = (receiver_settings.sat_spot_kernel ? sat_launch : colspot_launch)
+            [(experiment_settings.pixel_depth == 2) ? 0 : 1]
+            [experiment_settings.spot_finding_nbx - 1][experiment_settings.spot_finding_nby - 1];
+
+    // Output of this stream
+    strong_pixel *out = gpu_out + thread_id * images_per_stream * 2 * MAX_STRONG;
+    size_t compact_capacity = NIMAGES_PER_STREAM * 2 * COMPACT_STRONG_PER_FRAGMENT;
+    strong_pixel *compact = gpu_compact + thread_id * compact_capacity;
+    strong_pixel_index_t *index = gpu_index + thread_id * (NIMAGES_PER_STREAM * 2 + 1);
+    size_t buffer = 0;
+
     cudaEvent_t event_mem_copied;
     cudaEventCreate (&event_mem_copied);
 
@@ -216,21 +382,20 @@ void *run_gpu_thread(void *in_threadarg) {
          chunk < total_chunks;
          chunk += NCUDA_STREAMS) {
 
-         std::vector<spot_t> spots;
-
          size_t ib_slice = chunk % (NCUDA_STREAMS*CUDA_TO_IB_BUFFER);
 
          size_t images = experiment_settings.nimages_to_write - chunk * images_per_stream;
          if (images > images_per_stream) images = images_per_stream;
 
-         pthread_mutex_lock(writer_threads_done_mutex+ib_slice);
-         // Wait till everyone is done
-         while (writer_threads_done[ib_slice] < receiver_settings.compression_threads)
-             pthread_cond_wait(writer_threads_done_cond+ib_slice, 
-                               writer_threads_done_mutex+ib_slice);
+         pthread_mutex_lock(chunk_written_mutex+ib_slice);
+         // Wait till all images of the chunk are written
+         while (chunk_images_written[ib_slice].load() < images)
+             pthread_cond_wait(chunk_written_cond+ib_slice,
+                               chunk_written_mutex+ib_slice);
          // Restore full values and continue
-         writer_threads_done[ib_slice] = 0;
-         pthread_mutex_unlock(writer_threads_done_mutex+ib_slice);
+         chunk_images_written[ib_slice] = 0;
+         pthread_mutex_unlock(chunk_written_mutex+ib_slice);
+         trace_event(TRACE_RING_GPU(thread_id), TRACE_GPU_TAKEN, chunk * images_per_stream, images);
 
          // Here all writting is done, but it is guarranteed not be overwritten
 
@@ -248,16 +413,22 @@ void *run_gpu_thread(void *in_threadarg) {
          cudaEventRecord (event_mem_copied, stream[thread_id]);
 
          // Start GPU kernel
-         if (experiment_settings.pixel_depth == 2)
-             find_spots_colspot<int16_t> <<<images_per_stream * 2 / 32, 32, 0, stream[thread_id]>>>
-                 ((int16_t *) (gpu_data + thread_id * images_per_stream * fragment_size),
-                  gpu_out + thread_id * images_per_stream * 2 * MAX_STRONG,
-                  experiment_settings.strong_pixel, images * 2);
-         else
-             find_spots_colspot<int32_t> <<<images_per_stream * 2 / 32, 32, 0, stream[thread_id]>>>
-                 ((int32_t *) (gpu_data + thread_id * images_per_stream * fragment_size),
-                  gpu_out + thread_id * images_per_stream * 2 * MAX_STRONG,
-                  experiment_settings.strong_pixel, images * 2);
+         colspot(gpu_data + thread_id * images_per_stream * fragment_size, out, index,
+                 gpu_sat_bitmap + thread_id * images_per_stream * 2 * SAT_BITMAP_WORDS,
+                 gpu_bad_pixel_mask, experiment_settings.strong_pixel, images * 2,
+                 images_per_stream * 2 / 32, stream[thread_id]);
+
+         // Compact output
+         index_strong_pixels<<<1, 1, 0, stream[thread_id]>>>(index, images * 2, compact_capacity);
+         compact_strong_pixels<<<images * 2, 256, 0, stream[thread_id]>>>(out, index, compact);
+
+         // Host buffer must be already analyzed by spot assembly, before number of pixels per fragment is copied
+         size_t host_buffer = thread_id * SPOT_ASSEMBLY_BUFFERS + buffer;
+         strong_pixel *host_out = host_compact + host_buffer * compact_capacity;
+         strong_pixel_index_t *host_out_index = host_index + host_buffer * (NIMAGES_PER_STREAM * 2 + 1);
+         acquire_spot_assembly_buffer(thread_id, buffer);
+         cudaMemcpyAsync(host_out_index, index, (images * 2 + 1) * sizeof(strong_pixel_index_t),
+                         cudaMemcpyDeviceToHost, stream[thread_id]);
 
          // After data are copied, one can release buffer
          err = cudaEventSynchronize(event_mem_copied);
@@ -272,23 +443,35 @@ void *run_gpu_thread(void *in_threadarg) {
          pthread_cond_broadcast(cuda_stream_ready_cond+ib_slice);
          pthread_mutex_unlock(cuda_stream_ready_mutex+ib_slice);
 
-         // Ensure kernel has finished
+         // Ensure kernel has finished and index is copied
          err = cudaStreamSynchronize(stream[thread_id]);
          if (err != cudaSuccess) {
              std::cerr << "GPU: execution error" << std::endl;
              pthread_exit(0);
          }
 
-         // Analyze results to find spots
-         // gpu_out is in unified memory and doesn't need to be explicitly copied to CPU
-         analyze_spots(gpu_out + thread_id * images_per_stream * 2 * MAX_STRONG, spots, experiment_settings.connect_spots_between_frames, images, chunk * images_per_stream);
+         // Copy only saved strong pixels
+         size_t nstrong = host_out_index[images * 2].offset;
+         if (nstrong > 0) {
+             err = cudaMemcpyAsync(host_out, compact, nstrong * sizeof(strong_pixel), cudaMemcpyDeviceToHost, stream[thread_id]);
+             if (err == cudaSuccess) err = cudaStreamSynchronize(stream[thread_id]);
+             if (err != cudaSuccess) {
+                 std::cerr << "GPU: strong pixel copy error (" << cudaGetErrorString(err) << ")" << std::endl;
+                 pthread_exit(0);
+             }
+         }
 
-         // Send spots found by spot finder via TCP/IP
-         pthread_mutex_lock(&accepted_socket_mutex);
-         size_t spot_data_size = spots.size();
-         send(accepted_socket, &spot_data_size, sizeof(size_t), 0);
-         send(accepted_socket, spots.data(), spot_data_size * sizeof(spot_t), 0);
-         pthread_mutex_unlock(&accepted_socket_mutex);
+         // Spots are labeled and sent by spot assembly workers, GPU thread continues with the next chunk
+         spot_assembly_job_t job;
+         job.pixels = host_out;
+         job.index = host_out_index;
+         job.images = images;
+         job.image0 = chunk * images_per_stream;
+         job.chunk = chunk;
+         job.stream = thread_id;
+         job.buffer = buffer;
+         submit_spot_assembly(job);
+         buffer = (buffer + 1) % SPOT_ASSEMBLY_BUFFERS;
     }
     cudaEventDestroy (event_mem_copied);
     pthread_exit(0);
@@ -0,0 +1,959 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host implementation of colspot strong pixel finder (find_spots_colspot in find_spots.cu)
+// Used when there is no GPU, output layout is the same as for GPU kernel
+// Implementation is selected at runtime by setup_cpu_spot_finding()
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+
+#include "JFReceiver.h"
+#include "colspot_sat.h"
+
+#if defined(__VSX__)
+#include <altivec.h>
+#elif defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Kernels are templates on box half-widths NBX and NBY (see find_spots.cu)
+#define BOX_PIXELS ((2*NBX+1) * (2*NBY+1))
+
+namespace {
+
+// Threshold for signal^2 / var, calculated the same way as on GPU
+template<int NBX, int NBY> inline float colspot_threshold(float strong) {
+    return strong * strong * (float)(BOX_PIXELS) / (float) (BOX_PIXELS - 1);
+}
+
+// Kernels return number of strong pixels found, pixels above MAX_STRONG are only counted
+inline void save_strong_pixel(strong_pixel *out, uint32_t &strong_id, int16_t col, int16_t line, int64_t photons) {
+    if (strong_id < MAX_STRONG) {
+        out[strong_id].line = line;
+        out[strong_id].col = col;
+        out[strong_id].photons = photons;
+    }
+    strong_id++;
+}
+
+// Scalar kernel - direct translation of GPU kernel, reference for vector implementation
+struct scalar_kernel {
+    static const char *name() { return "scalar"; }
+
+    template<typename T, int NBX, int NBY> static uint32_t fragment(const T *in, strong_pixel *out, float strong, int16_t mask_line0) {
+        float threshold = colspot_threshold<NBX, NBY>(strong);
+        uint32_t strong_id = 0;
+        int64_t sum_vert[COLS];
+        int64_t sum2_vert[COLS];
+
+        for (int col = 0; col < COLS; col++) {
+            sum_vert[col]  = in[col];
+            sum2_vert[col] = (int64_t) in[col] * in[col];
+        }
+        for (size_t line = 1; line < 2*NBY+1; line++) {
+            for (int col = 0; col < COLS; col++) {
+                sum_vert[col]  += in[line * COLS + col];
+                sum2_vert[col] += (int64_t) in[line * COLS + col] * in[line * COLS + col];
+            }
+        }
+
+        for (int16_t line = NBY; line < LINES - NBY; line++) {
+            int64_t sum  = 0;
+            int64_t sum2 = 0;
+            for (int i = 0; i < 2*NBX+1; i++) {
+                sum  += sum_vert[i];
+                sum2 += sum2_vert[i];
+            }
+
+            for (int16_t col = NBX; col < COLS - NBX; col++) {
+                int64_t var = BOX_PIXELS * sum2 - (sum * sum);
+                int64_t in_minus_mean = in[line * COLS + col] * BOX_PIXELS - sum;
+
+                if (!is_bad_pixel(col, mask_line0 + line) &&
+                    (in_minus_mean > BOX_PIXELS) &&
+                    (in[line * COLS + col] > 0) &&
+                    (in_minus_mean * in_minus_mean > var * threshold))
+                    save_strong_pixel(out, strong_id, col, line, in_minus_mean);
+
+                if (col < COLS - NBX - 1) {
+                    sum  += sum_vert[col + NBX + 1] - sum_vert[col - NBX];
+                    sum2 += sum2_vert[col + NBX + 1] - sum2_vert[col - NBX];
+                }
+            }
+
+            if (line < LINES - NBY - 1) {
+                for (int col = 0; col < COLS; col++) {
+                    int64_t tmp_sum  = (int64_t) in[(line + NBY + 1) * COLS + col] + (int64_t) in[(line - NBY) * COLS + col];
+                    int64_t tmp_diff = (int64_t) in[(line + NBY + 1) * COLS + col] - (int64_t) in[(line - NBY) * COLS + col];
+                    sum_vert[col]  += tmp_diff;
+                    sum2_vert[col] += tmp_sum * tmp_diff;
+                }
+            }
+        }
+        return strong_id;
+    }
+};
+
+// Vector kernels evaluate columns NBX to COLS - NBX of a line in blocks of MASK_BLOCK_COLS,
+// blocks with all pixels masked (e.g. outside of resolution range) are skipped, neighbouring blocks are merged into runs
+#define MASK_BLOCK_COLS 64
+#define MAX_MASK_RUNS (COLS / MASK_BLOCK_COLS + 1)
+
+template<int NBX> inline int unmasked_runs(int16_t mask_line, int16_t runs[MAX_MASK_RUNS][2]) {
+    int nruns = 0;
+    for (int col0 = NBX; col0 < COLS - NBX; col0 += MASK_BLOCK_COLS) {
+        int col1 = std::min<int>(col0 + MASK_BLOCK_COLS, COLS - NBX);
+        if (colspot_masked_run(bad_pixel_mask, col0, col1, mask_line)) continue;
+        if ((nruns > 0) && (runs[nruns - 1][1] == col0)) runs[nruns - 1][1] = col1;
+        else {
+            runs[nruns][0] = col0;
+            runs[nruns][1] = col1;
+            nruns++;
+        }
+    }
+    return nruns;
+}
+
+// 64-bit version - instead of running sum along the line, box sums and threshold test are calculated
+// for whole line with loops of fixed trip count. 64-bit multiplication is vectorized only with AVX-512,
+// so it is used only there and only for 32-bit images (see avx512_kernel).
+// Only candidates (few per line) in unmasked runs are then checked against bad pixel mask and saved in order.
+// Integer arithmetic is exact, so results are identical to scalar kernel.
+template<typename T, int NBX, int NBY> inline __attribute__((always_inline))
+uint32_t colspot_fragment_vector(const T *in, strong_pixel *out, float strong, int16_t mask_line0) {
+    float threshold = colspot_threshold<NBX, NBY>(strong);
+    uint32_t strong_id = 0;
+    int64_t sum_vert[COLS];
+    int64_t sum2_vert[COLS];
+    uint8_t candidate[COLS];
+
+    for (int col = 0; col < COLS; col++) {
+        sum_vert[col]  = in[col];
+        sum2_vert[col] = (int64_t) in[col] * in[col];
+    }
+    for (size_t line = 1; line < 2*NBY+1; line++) {
+        const T *in_line = in + line * COLS;
+        for (int col = 0; col < COLS; col++) {
+            sum_vert[col]  += in_line[col];
+            sum2_vert[col] += (int64_t) in_line[col] * in_line[col];
+        }
+    }
+
+    for (int16_t line = NBY; line < LINES - NBY; line++) {
+        const T *in_line = in + line * COLS;
+        int16_t runs[MAX_MASK_RUNS][2];
+        int nruns = unmasked_runs<NBX>(mask_line0 + line, runs);
+
+        for (int r = 0; r < nruns; r++) {
+            for (int col = runs[r][0]; col < runs[r][1]; col++) {
+                int64_t sum  = 0;
+                int64_t sum2 = 0;
+                for (int i = -NBX; i <= NBX; i++) {
+                    sum  += sum_vert[col + i];
+                    sum2 += sum2_vert[col + i];
+                }
+                int64_t var = BOX_PIXELS * sum2 - (sum * sum);
+                int64_t in_minus_mean = in_line[col] * BOX_PIXELS - sum;
+                candidate[col] = (in_minus_mean > BOX_PIXELS) & (in_line[col] > 0)
+                        & (in_minus_mean * in_minus_mean > var * threshold);
+            }
+        }
+
+        for (int r = 0; r < nruns; r++) {
+            for (int16_t col = runs[r][0]; col < runs[r][1]; col++) {
+                if (candidate[col] && !is_bad_pixel(col, mask_line0 + line)) {
+                    int64_t sum = 0;
+                    for (int i = -NBX; i <= NBX; i++)
+                        sum += sum_vert[col + i];
+                    save_strong_pixel(out, strong_id, col, line, in_line[col] * BOX_PIXELS - sum);
+                }
+            }
+        }
+
+        if (line < LINES - NBY - 1) {
+            const T *in_add = in + (line + NBY + 1) * COLS;
+            const T *in_sub = in + (line - NBY) * COLS;
+            for (int col = 0; col < COLS; col++) {
+                int64_t tmp_sum  = (int64_t) in_add[col] + (int64_t) in_sub[col];
+                int64_t tmp_diff = (int64_t) in_add[col] - (int64_t) in_sub[col];
+                sum_vert[col]  += tmp_diff;
+                sum2_vert[col] += tmp_sum * tmp_diff;
+            }
+        }
+    }
+    return strong_id;
+}
+
+// Narrow version for 16-bit images - values are at most 2^15 in magnitude, so box sums, sums of squares,
+// variance and (in - mean)^2 are integers below 2^53 and double arithmetic is exact.
+// Double has vector add/multiply/compare on VSX, SSE2, AVX2 and AVX-512, as opposed to 64-bit integers.
+// Kernel K provides the vector loops: vertical update of column sums and pre-test of a run of columns (see below).
+// Pre-test uses threshold lowered by 2^-20, which is a necessary condition for the float comparison in scalar kernel
+// (float rounding of both sides is below 2^-22 in total), pixels passing are checked with the same expression
+// as in scalar kernel, so results are bit-identical.
+#define NARROW_THRESHOLD_MARGIN (1.0 - 1.0 / (1 << 20))
+
+// Pre-test of a single pixel, used for columns not covered by vector loop
+template<int NBX, int NBY> inline bool narrow_pretest(const double *sum_vert, const double *sum2_vert, const double *value,
+                                                      int col, double pretest_threshold) {
+    double sum  = 0;
+    double sum2 = 0;
+    for (int i = -NBX; i <= NBX; i++) {
+        sum  += sum_vert[col + i];
+        sum2 += sum2_vert[col + i];
+    }
+    double var = BOX_PIXELS * sum2 - sum * sum;
+    double in_minus_mean = value[col] * BOX_PIXELS - sum;
+    return (in_minus_mean > BOX_PIXELS) && (value[col] > 0) && (in_minus_mean * in_minus_mean > var * pretest_threshold);
+}
+
+template<class K, int NBX, int NBY>
+uint32_t colspot_fragment_narrow(const int16_t *in, strong_pixel *out, float strong, int16_t mask_line0) {
+    float threshold = colspot_threshold<NBX, NBY>(strong);
+    double pretest_threshold = threshold * NARROW_THRESHOLD_MARGIN;
+    uint32_t strong_id = 0;
+    std::vector<double> buffer(2 * COLS + (2*NBY+2) * COLS);
+    double *sum_vert = buffer.data();
+    double *sum2_vert = sum_vert + COLS;
+    double *lines = sum2_vert + COLS; // ring of converted lines, line l is at (l % (2*NBY+2))
+    int16_t candidate[COLS];
+
+    for (size_t line = 0; line < 2*NBY+1; line++) {
+        double *value = lines + line * COLS;
+        for (int col = 0; col < COLS; col++) value[col] = in[line * COLS + col];
+    }
+    for (int col = 0; col < COLS; col++) {
+        sum_vert[col]  = 0;
+        sum2_vert[col] = 0;
+    }
+    for (size_t line = 0; line < 2*NBY+1; line++) {
+        const double *value = lines + line * COLS;
+        for (int col = 0; col < COLS; col++) {
+            sum_vert[col]  += value[col];
+            sum2_vert[col] += value[col] * value[col];
+        }
+    }
+
+    for (int16_t line = NBY; line < LINES - NBY; line++) {
+        const int16_t *in_line = in + line * COLS;
+        const double *value = lines + (line % (2*NBY+2)) * COLS;
+
+        int16_t runs[MAX_MASK_RUNS][2];
+        int nruns = unmasked_runs<NBX>(mask_line0 + line, runs);
+        int ncandidates = 0;
+        for (int r = 0; r < nruns; r++)
+            ncandidates += K::template line_pretest<NBX, NBY>(sum_vert, sum2_vert, value, pretest_threshold,
+                                                              runs[r][0], runs[r][1], candidate + ncandidates);
+        for (int i = 0; i < ncandidates; i++) {
+            int16_t col = candidate[i];
+            if (is_bad_pixel(col, mask_line0 + line)) continue;
+            int64_t sum  = 0;
+            int64_t sum2 = 0;
+            for (int j = -NBX; j <= NBX; j++) {
+                sum  += (int64_t) sum_vert[col + j];
+                sum2 += (int64_t) sum2_vert[col + j];
+            }
+            int64_t var = BOX_PIXELS * sum2 - (sum * sum);
+            int64_t in_minus_mean = in_line[col] * BOX_PIXELS - sum;
+            if ((in_minus_mean > BOX_PIXELS) &&
+                (in_line[col] > 0) &&
+                (in_minus_mean * in_minus_mean > var * threshold))
+                save_strong_pixel(out, strong_id, col, line, in_minus_mean);
+        }
+
+        if (line < LINES - NBY - 1) {
+            // Line entering the box replaces the one leaving it in the ring
+            double *add = lines + ((line + NBY + 1) % (2*NBY+2)) * COLS;
+            const double *sub = lines + ((line - NBY) % (2*NBY+2)) * COLS;
+            const int16_t *in_add = in + (line + NBY + 1) * COLS;
+            for (int col = 0; col < COLS; col++) add[col] = in_add[col];
+            K::vertical_update(sum_vert, sum2_vert, add, sub);
+        }
+    }
+    return strong_id;
+}
+
+#if defined(__VSX__)
+// POWER9 - 2 doubles per VSX register
+struct vector_kernel {
+    static const char *name() { return "VSX"; }
+
+    static void vertical_update(double *sum_vert, double *sum2_vert, const double *add, const double *sub) {
+        int col = 0;
+        for (; col + 2 <= COLS; col += 2) {
+            vector double a = vec_xl(0, add + col);
+            vector double b = vec_xl(0, sub + col);
+            vector double diff = vec_sub(a, b);
+            vec_xst(vec_add(vec_xl(0, sum_vert + col), diff), 0, sum_vert + col);
+            vec_xst(vec_add(vec_xl(0, sum2_vert + col), vec_mul(vec_add(a, b), diff)), 0, sum2_vert + col);
+        }
+        for (; col < COLS; col++) {
+            sum_vert[col]  += add[col] - sub[col];
+            sum2_vert[col] += (add[col] + sub[col]) * (add[col] - sub[col]);
+        }
+    }
+
+    template<int NBX, int NBY> static int line_pretest(const double *sum_vert, const double *sum2_vert,
+                                                       const double *value, double pretest_threshold,
+                                                       int col0, int col1, int16_t *candidate) {
+        const vector double box = vec_splats((double) BOX_PIXELS);
+        const vector double zero = vec_splats(0.0);
+        const vector double thr = vec_splats(pretest_threshold);
+        int n = 0;
+        int col = col0;
+        for (; col + 2 <= col1; col += 2) {
+            vector double sum  = vec_xl(0, sum_vert + col - NBX);
+            vector double sum2 = vec_xl(0, sum2_vert + col - NBX);
+            for (int i = -NBX + 1; i <= NBX; i++) {
+                sum  = vec_add(sum, vec_xl(0, sum_vert + col + i));
+                sum2 = vec_add(sum2, vec_xl(0, sum2_vert + col + i));
+            }
+            vector double v = vec_xl(0, value + col);
+            vector double var = vec_sub(vec_mul(box, sum2), vec_mul(sum, sum));
+            vector double in_minus_mean = vec_sub(vec_mul(v, box), sum);
+            vector bool long long pass = vec_and(vec_and(vec_cmpgt(in_minus_mean, box), vec_cmpgt(v, zero)),
+                                                 vec_cmpgt(vec_mul(in_minus_mean, in_minus_mean), vec_mul(var, thr)));
+            if (vec_extract((vector unsigned long long) pass, 0)) candidate[n++] = col;
+            if (vec_extract((vector unsigned long long) pass, 1)) candidate[n++] = col + 1;
+        }
+        for (; col < col1; col++)
+            if (narrow_pretest<NBX, NBY>(sum_vert, sum2_vert, value, col, pretest_threshold)) candidate[n++] = col;
+        return n;
+    }
+
+    // 16-bit images only
+    template<typename T, int NBX, int NBY> static uint32_t fragment(const T *in, strong_pixel *out, float strong, int16_t mask_line0) {
+        return colspot_fragment_narrow<vector_kernel, NBX, NBY>(in, out, strong, mask_line0);
+    }
+};
+#elif defined(__x86_64__)
+// x86 - SSE2 is always present in x86-64, 2 doubles per register
+struct vector_kernel {
+    static const char *name() { return "SSE2"; }
+
+    static void vertical_update(double *sum_vert, double *sum2_vert, const double *add, const double *sub) {
+        int col = 0;
+        for (; col + 2 <= COLS; col += 2) {
+            __m128d a = _mm_loadu_pd(add + col);
+            __m128d b = _mm_loadu_pd(sub + col);
+            __m128d diff = _mm_sub_pd(a, b);
+            _mm_storeu_pd(sum_vert + col, _mm_add_pd(_mm_loadu_pd(sum_vert + col), diff));
+            _mm_storeu_pd(sum2_vert + col, _mm_add_pd(_mm_loadu_pd(sum2_vert + col), _mm_mul_pd(_mm_add_pd(a, b), diff)));
+        }
+        for (; col < COLS; col++) {
+            sum_vert[col]  += add[col] - sub[col];
+            sum2_vert[col] += (add[col] + sub[col]) * (add[col] - sub[col]);
+        }
+    }
+
+    template<int NBX, int NBY> static int line_pretest(const double *sum_vert, const double *sum2_vert,
+                                                       const double *value, double pretest_threshold,
+                                                       int col0, int col1, int16_t *candidate) {
+        const __m128d box = _mm_set1_pd(BOX_PIXELS);
+        const __m128d zero = _mm_setzero_pd();
+        const __m128d thr = _mm_set1_pd(pretest_threshold);
+        int n = 0;
+        int col = col0;
+        for (; col + 2 <= col1; col += 2) {
+            __m128d sum  = _mm_loadu_pd(sum_vert + col - NBX);
+            __m128d sum2 = _mm_loadu_pd(sum2_vert + col - NBX);
+            for (int i = -NBX + 1; i <= NBX; i++) {
+                sum  = _mm_add_pd(sum, _mm_loadu_pd(sum_vert + col + i));
+                sum2 = _mm_add_pd(sum2, _mm_loadu_pd(sum2_vert + col + i));
+            }
+            __m128d v = _mm_loadu_pd(value + col);
+            __m128d var = _mm_sub_pd(_mm_mul_pd(box, sum2), _mm_mul_pd(sum, sum));
+            __m128d in_minus_mean = _mm_sub_pd(_mm_mul_pd(v, box), sum);
+            __m128d pass = _mm_and_pd(_mm_and_pd(_mm_cmpgt_pd(in_minus_mean, box), _mm_cmpgt_pd(v, zero)),
+                                      _mm_cmpgt_pd(_mm_mul_pd(in_minus_mean, in_minus_mean), _mm_mul_pd(var, thr)));
+            int mask = _mm_movemask_pd(pass);
+            if (mask & 1) candidate[n++] = col;
+            if (mask & 2) candidate[n++] = col + 1;
+        }
+        for (; col < col1; col++)
+            if (narrow_pretest<NBX, NBY>(sum_vert, sum2_vert, value, col, pretest_threshold)) candidate[n++] = col;
+        return n;
+    }
+
+    // 16-bit images only
+    template<typename T, int NBX, int NBY> static uint32_t fragment(const T *in, strong_pixel *out, float strong, int16_t mask_line0) {
+        return colspot_fragment_narrow<vector_kernel, NBX, NBY>(in, out, strong, mask_line0);
+    }
+};
+
+// AVX2 - compiled for AVX2 target, but only called if CPU supports it, 4 doubles per register
+struct avx2_kernel {
+    static const char *name() { return "AVX2"; }
+
+    __attribute__((target("avx2")))
+    static void vertical_update(double *sum_vert, double *sum2_vert, const double *add, const double *sub) {
+        int col = 0;
+        for (; col + 4 <= COLS; col += 4) {
+            __m256d a = _mm256_loadu_pd(add + col);
+            __m256d b = _mm256_loadu_pd(sub + col);
+            __m256d diff = _mm256_sub_pd(a, b);
+            _mm256_storeu_pd(sum_vert + col, _mm256_add_pd(_mm256_loadu_pd(sum_vert + col), diff));
+            _mm256_storeu_pd(sum2_vert + col, _mm256_add_pd(_mm256_loadu_pd(sum2_vert + col),
+                                                            _mm256_mul_pd(_mm256_add_pd(a, b), diff)));
+        }
+        for (; col < COLS; col++) {
+            sum_vert[col]  += add[col] - sub[col];
+            sum2_vert[col] += (add[col] + sub[col]) * (add[col] - sub[col]);
+        }
+    }
+
+    template<int NBX, int NBY> __attribute__((target("avx2")))
+    static int line_pretest(const double *sum_vert, const double *sum2_vert,
+                            const double *value, double pretest_threshold,
+                            int col0, int col1, int16_t *candidate) {
+        const __m256d box = _mm256_set1_pd(BOX_PIXELS);
+        const __m256d zero = _mm256_setzero_pd();
+        const __m256d thr = _mm256_set1_pd(pretest_threshold);
+        int n = 0;
+        int col = col0;
+        for (; col + 4 <= col1; col += 4) {
+            __m256d sum  = _mm256_loadu_pd(sum_vert + col - NBX);
+            __m256d sum2 = _mm256_loadu_pd(sum2_vert + col - NBX);
+            for (int i = -NBX + 1; i <= NBX; i++) {
+                sum  = _mm256_add_pd(sum, _mm256_loadu_pd(sum_vert + col + i));
+                sum2 = _mm256_add_pd(sum2, _mm256_loadu_pd(sum2_vert + col + i));
+            }
+            __m256d v = _mm256_loadu_pd(value + col);
+            __m256d var = _mm256_sub_pd(_mm256_mul_pd(box, sum2), _mm256_mul_pd(sum, sum));
+            __m256d in_minus_mean = _mm256_sub_pd(_mm256_mul_pd(v, box), sum);
+            __m256d pass = _mm256_and_pd(_mm256_and_pd(_mm256_cmp_pd(in_minus_mean, box, _CMP_GT_OQ),
+                                                       _mm256_cmp_pd(v, zero, _CMP_GT_OQ)),
+                                         _mm256_cmp_pd(_mm256_mul_pd(in_minus_mean, in_minus_mean),
+                                                       _mm256_mul_pd(var, thr), _CMP_GT_OQ));
+            int mask = _mm256_movemask_pd(pass);
+            while (mask != 0) {
+                candidate[n++] = col + __builtin_ctz(mask);
+                mask &= mask - 1;
+            }
+        }
+        for (; col < col1; col++)
+            if (narrow_pretest<NBX, NBY>(sum_vert, sum2_vert, value, col, pretest_threshold)) candidate[n++] = col;
+        return n;
+    }
+
+    // 16-bit images only
+    template<typename T, int NBX, int NBY> static uint32_t fragment(const T *in, strong_pixel *out, float strong, int16_t mask_line0) {
+        return colspot_fragment_narrow<avx2_kernel, NBX, NBY>(in, out, strong, mask_line0);
+    }
+};
+
+// AVX-512 - 8 doubles per register for 16-bit images,
+// DQ extension has 64-bit multiplication and int64 to float conversion, so 64-bit version is vectorized for 32-bit images
+struct avx512_kernel {
+    static const char *name() { return "AVX-512"; }
+
+    __attribute__((target("avx512f,avx512dq,avx512bw,avx512vl")))
+    static void vertical_update(double *sum_vert, double *sum2_vert, const double *add, const double *sub) {
+        int col = 0;
+        for (; col + 8 <= COLS; col += 8) {
+            __m512d a = _mm512_loadu_pd(add + col);
+            __m512d b = _mm512_loadu_pd(sub + col);
+            __m512d diff = _mm512_sub_pd(a, b);
+            _mm512_storeu_pd(sum_vert + col, _mm512_add_pd(_mm512_loadu_pd(sum_vert + col), diff));
+            _mm512_storeu_pd(sum2_vert + col, _mm512_add_pd(_mm512_loadu_pd(sum2_vert + col),
+                                                            _mm512_mul_pd(_mm512_add_pd(a, b), diff)));
+        }
+        for (; col < COLS; col++) {
+            sum_vert[col]  += add[col] - sub[col];
+            sum2_vert[col] += (add[col] + sub[col]) * (add[col] - sub[col]);
+        }
+    }
+
+    template<int NBX, int NBY> __attribute__((target("avx512f,avx512dq,avx512bw,avx512vl")))
+    static int line_pretest(const double *sum_vert, const double *sum2_vert,
+                            const double *value, double pretest_threshold,
+                            int col0, int col1, int16_t *candidate) {
+        const __m512d box = _mm512_set1_pd(BOX_PIXELS);
+        const __m512d zero = _mm512_setzero_pd();
+        const __m512d thr = _mm512_set1_pd(pretest_threshold);
+        int n = 0;
+        int col = col0;
+        for (; col + 8 <= col1; col += 8) {
+            __m512d sum  = _mm512_loadu_pd(sum_vert + col - NBX);
+            __m512d sum2 = _mm512_loadu_pd(sum2_vert + col - NBX);
+            for (int i = -NBX + 1; i <= NBX; i++) {
+                sum  = _mm512_add_pd(sum, _mm512_loadu_pd(sum_vert + col + i));
+                sum2 = _mm512_add_pd(sum2, _mm512_loadu_pd(sum2_vert + col + i));
+            }
+            __m512d v = _mm512_loadu_pd(value + col);
+            __m512d var = _mm512_sub_pd(_mm512_mul_pd(box, sum2), _mm512_mul_pd(sum, sum));
+            __m512d in_minus_mean = _mm512_sub_pd(_mm512_mul_pd(v, box), sum);
+            unsigned mask = _mm512_cmp_pd_mask(in_minus_mean, box, _CMP_GT_OQ)
+                            & _mm512_cmp_pd_mask(v, zero, _CMP_GT_OQ)
+                            & _mm512_cmp_pd_mask(_mm512_mul_pd(in_minus_mean, in_minus_mean),
+                                                 _mm512_mul_pd(var, thr), _CMP_GT_OQ);
+            while (mask != 0) {
+                candidate[n++] = col + __builtin_ctz(mask);
+                mask &= mask - 1;
+            }
+        }
+        for (; col < col1; col++)
+            if (narrow_pretest<NBX, NBY>(sum_vert, sum2_vert, value, col, pretest_threshold)) candidate[n++] = col;
+        return n;
+    }
+
+    template<int NBX, int NBY> static uint32_t depth_fragment(const int16_t *in, strong_pixel *out, float strong, int16_t mask_line0) {
+        return colspot_fragment_narrow<avx512_kernel, NBX, NBY>(in, out, strong, mask_line0);
+    }
+
+    template<int NBX, int NBY> __attribute__((target("avx512f,avx512dq,avx512bw,avx512vl")))
+    static uint32_t depth_fragment(const int32_t *in, strong_pixel *out, float strong, int16_t mask_line0) {
+        return colspot_fragment_vector<int32_t, NBX, NBY>(in, out, strong, mask_line0);
+    }
+
+    template<typename T, int NBX, int NBY> static uint32_t fragment(const T *in, strong_pixel *out, float strong, int16_t mask_line0) {
+        return depth_fragment<NBX, NBY>(in, out, strong, mask_line0);
+    }
+};
+#endif
+
+// Summed-area-table GPU kernel (colspot_sat.h) compiled as host code
+// It is not used for CPU spot finding, but checked against scalar reference when selected for GPU
+struct sat_kernel {
+    static const char *name() { return "summed-area-table"; }
+    template<typename T, int NBX, int NBY> static uint32_t fragment(const T *in, strong_pixel *out, float strong, int16_t mask_line0) {
+        std::vector<uint64_t> bitmap(SAT_BITMAP_WORDS, 0);
+        return sat_fragment_host<T, NBX, NBY>(in, out, bitmap.data(), bad_pixel_mask, strong, mask_line0);
+    }
+};
+
+}
+
+// Dispatch tables [NBX-1][NBY-1] of the selected implementation, as for GPU kernel
+template<typename T> struct colspot_table_t {
+    typedef uint32_t (*fragment_t)(const T *in, strong_pixel *out, float strong, int16_t mask_line0);
+    fragment_t fragment[SPOT_BOX_MAX_HALF_WIDTH][SPOT_BOX_MAX_HALF_WIDTH];
+};
+
+#define COLSPOT_ROW(K, T, NBX) {K::template fragment<T, NBX, 1>, K::template fragment<T, NBX, 2>, \
+        K::template fragment<T, NBX, 3>, K::template fragment<T, NBX, 4>, K::template fragment<T, NBX, 5>}
+#define COLSPOT_TABLE(K, T) {{COLSPOT_ROW(K, T, 1), COLSPOT_ROW(K, T, 2), COLSPOT_ROW(K, T, 3), \
+        COLSPOT_ROW(K, T, 4), COLSPOT_ROW(K, T, 5)}}
+
+template<class K, typename T> static colspot_table_t<T> colspot_table() {
+    colspot_table_t<T> table = COLSPOT_TABLE(K, T);
+    return table;
+}
+
+static colspot_table_t<int16_t> colspot_fragment16 = colspot_table<scalar_kernel, int16_t>();
+static colspot_table_t<int32_t> colspot_fragment32 = colspot_table<scalar_kernel, int32_t>();
+
+// Fragments are 2 horizontally connected modules, even fragments are bottom, odd top half of the card
+// (fragment number within chunk is the same as thread number in GPU kernel)
+// Box half-widths must be in range 1 to SPOT_BOX_MAX_HALF_WIDTH
+static void find_spots_fragment(const char *in, strong_pixel *out, strong_pixel_index_t *index, size_t fragment,
+                                int pixel_depth, float strong, int nbx, int nby) {
+    int16_t mask_line0 = (fragment % 2) * LINES;
+    index[fragment].offset = fragment * MAX_STRONG;
+    if (pixel_depth == 2)
+        index[fragment].found = colspot_fragment16.fragment[nbx - 1][nby - 1](((const int16_t *) in) + fragment * LINES * COLS,
+                                                                              out + fragment * MAX_STRONG, strong, mask_line0);
+    else
+        index[fragment].found = colspot_fragment32.fragment[nbx - 1][nby - 1](((const int32_t *) in) + fragment * LINES * COLS,
+                                                                              out + fragment * MAX_STRONG, strong, mask_line0);
+    index[fragment].saved = std::min<uint32_t>(index[fragment].found, MAX_STRONG);
+}
+
+// Thread pool - spot finding threads (one per chunk, as for GPU) submit chunk as a job
+// and workers take fragments of the oldest job one by one
+struct cpu_spot_job_t {
+    const char *in;
+    strong_pixel *out;
+    strong_pixel_index_t *index;
+    int pixel_depth;
+    float strong;
+    int nbx;
+    int nby;
+    size_t nfragments;
+    size_t next_fragment;
+    size_t done_fragments;
+    pthread_cond_t done_cond;
+};
+
+static pthread_mutex_t cpu_spot_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cpu_spot_pool_cond = PTHREAD_COND_INITIALIZER;
+static std::deque<cpu_spot_job_t *> cpu_spot_jobs;
+static bool cpu_spot_pool_stop = false;
+static std::vector<pthread_t> cpu_spot_workers;
+
+static strong_pixel *cpu_out = NULL;
+static strong_pixel_index_t *cpu_index = NULL;
+
+static void *run_cpu_spot_worker(void *in_threadarg) {
+    pthread_mutex_lock(&cpu_spot_pool_mutex);
+    while (true) {
+        while (cpu_spot_jobs.empty() && !cpu_spot_pool_stop)
+            pthread_cond_wait(&cpu_spot_pool_cond, &cpu_spot_pool_mutex);
+        if (cpu_spot_jobs.empty()) break;
+
+        cpu_spot_job_t *job = cpu_spot_jobs.front();
+        size_t fragment = job->next_fragment++;
+        if (job->next_fragment == job->nfragments) cpu_spot_jobs.pop_front();
+        pthread_mutex_unlock(&cpu_spot_pool_mutex);
+
+        find_spots_fragment(job->in, job->out, job->index, fragment, job->pixel_depth, job->strong, job->nbx, job->nby);
+
+        pthread_mutex_lock(&cpu_spot_pool_mutex);
+        job->done_fragments++;
+        if (job->done_fragments == job->nfragments) pthread_cond_signal(&job->done_cond);
+    }
+    pthread_mutex_unlock(&cpu_spot_pool_mutex);
+    pthread_exit(0);
+}
+
+// Find strong pixels in nfragments fragments, output has MAX_STRONG entries per fragment
+void find_spots_cpu(const char *in, strong_pixel *out, strong_pixel_index_t *index, size_t nfragments, int pixel_depth,
+                    float strong, int nbx, int nby) {
+    if (nfragments == 0) return;
+
+    cpu_spot_job_t job;
+    job.in = in;
+    job.out = out;
+    job.index = index;
+    job.pixel_depth = pixel_depth;
+    job.strong = strong;
+    job.nbx = nbx;
+    job.nby = nby;
+    job.nfragments = nfragments;
+    job.next_fragment = 0;
+    job.done_fragments = 0;
+    pthread_cond_init(&job.done_cond, NULL);
+
+    pthread_mutex_lock(&cpu_spot_pool_mutex);
+    cpu_spot_jobs.push_back(&job);
+    pthread_cond_broadcast(&cpu_spot_pool_cond);
+    while (job.done_fragments < job.nfragments)
+        pthread_cond_wait(&job.done_cond, &cpu_spot_pool_mutex);
+    pthread_mutex_unlock(&cpu_spot_pool_mutex);
+
+    pthread_cond_destroy(&job.done_cond);
+}
+
+static double time_diff(const timespec &start, const timespec &end) {
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Synthetic fragments: noisy background with spots of different intensity, negative and saturated values
+template<typename T> static void synthetic_fragments(T *in, size_t nfragments) {
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < nfragments * LINES * COLS; i++) {
+        seed = seed * 1103515245 + 12345;
+        int32_t value = (seed >> 16) % 16;
+        if (seed % 97 == 0) value = (seed >> 8) % 2000;
+        else if (seed % 9973 == 0) value = -1;
+        else if (seed % 65537 == 0) value = (sizeof(T) == 2) ? INT16_MAX : 1000000;
+        in[i] = value;
+    }
+}
+
+// Number of pixels found and saved part of the output must be the same
+static bool compare_strong_pixels(const strong_pixel *ref, uint32_t ref_found, const strong_pixel *out, uint32_t out_found) {
+    if (ref_found != out_found) return false;
+    return memcmp(ref, out, std::min<size_t>(ref_found, MAX_STRONG) * sizeof(strong_pixel)) == 0;
+}
+
+// Compare kernel K with scalar reference on synthetic fragments (top and bottom half of the card)
+// Default box and a few others are checked, all sizes are made from the same template
+// Last test has low threshold, so output overflows
+template <class K, typename T> static bool test_cpu_spot_kernel() {
+    const int test_boxes[][2] = {{SPOT_BOX_DEFAULT_HALF_WIDTH, SPOT_BOX_DEFAULT_HALF_WIDTH}, {1, 1},
+                                 {SPOT_BOX_MAX_HALF_WIDTH, 2}, {2, SPOT_BOX_MAX_HALF_WIDTH},
+                                 {SPOT_BOX_DEFAULT_HALF_WIDTH, SPOT_BOX_DEFAULT_HALF_WIDTH}};
+    const float test_strong[] = {3.0, 3.0, 3.0, 3.0, 0.5};
+    colspot_table_t<T> ref_table = colspot_table<scalar_kernel, T>();
+    colspot_table_t<T> test_table = colspot_table<K, T>();
+
+    T *in = (T *) calloc(2 * LINES * COLS, sizeof(T));
+    strong_pixel *ref = (strong_pixel *) calloc(MAX_STRONG, sizeof(strong_pixel));
+    strong_pixel *out = (strong_pixel *) calloc(MAX_STRONG, sizeof(strong_pixel));
+    synthetic_fragments(in, 2);
+
+    bool ok = true;
+    for (size_t b = 0; b < sizeof(test_boxes) / sizeof(test_boxes[0]); b++) {
+        int nbx = test_boxes[b][0] - 1;
+        int nby = test_boxes[b][1] - 1;
+        float strong = test_strong[b];
+        for (size_t i = 0; i < 2; i++) {
+            int16_t mask_line0 = i * LINES;
+            uint32_t ref_found = ref_table.fragment[nbx][nby](in + i * LINES * COLS, ref, strong, mask_line0);
+            uint32_t out_found = test_table.fragment[nbx][nby](in + i * LINES * COLS, out, strong, mask_line0);
+            if (!compare_strong_pixels(ref, ref_found, out, out_found)) ok = false;
+        }
+    }
+
+    free(in);
+    free(ref);
+    free(out);
+    return ok;
+}
+
+// Single thread throughput (fragments/s, default box), best of a few passes
+template <class K, typename T> static double measure_cpu_spot_kernel() {
+    const size_t nfragments = 4;
+    colspot_table_t<T> table = colspot_table<K, T>();
+    T *in = (T *) calloc(nfragments * LINES * COLS, sizeof(T));
+    strong_pixel *out = (strong_pixel *) calloc(MAX_STRONG, sizeof(strong_pixel));
+    synthetic_fragments(in, nfragments);
+
+    double best = 0;
+    for (int r = 0; r < 4; r++) {
+        timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t i = 0; i < nfragments; i++)
+            table.fragment[SPOT_BOX_DEFAULT_HALF_WIDTH - 1][SPOT_BOX_DEFAULT_HALF_WIDTH - 1]
+                    (in + i * LINES * COLS, out, 3.0, (i % 2) * LINES);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        best = std::max(best, nfragments / time_diff(start, end));
+    }
+
+    free(in);
+    free(out);
+    return best;
+}
+
+// Implementation is used for given pixel depth only if it is faster than the one selected so far
+template <class K, typename T> static void select_cpu_spot_kernel(colspot_table_t<T> &table, double &best, const char *&name) {
+    if (!test_cpu_spot_kernel<K, T>()) {
+        std::cerr << "CPU spot finding: " << K::name() << " output differs from scalar reference ("
+                  << 8 * sizeof(T) << "-bit), not used" << std::endl;
+        return;
+    }
+    double fragments_per_s = measure_cpu_spot_kernel<K, T>();
+    std::cout << "CPU spot finding: " << K::name() << " " << fragments_per_s << " fragments/s ("
+              << 8 * sizeof(T) << "-bit) per core" << std::endl;
+    if (fragments_per_s > best) {
+        table = colspot_table<K, T>();
+        best = fragments_per_s;
+        name = K::name();
+    }
+}
+
+// Throughput (fragments/s, default box) for increasing number of threads
+struct cpu_spot_benchmark_arg_t {
+    const int16_t *in;
+    strong_pixel *out;
+    strong_pixel_index_t *index;
+    size_t nfragments;
+    size_t thread;
+    size_t nthreads;
+};
+
+static void *run_cpu_spot_benchmark_thread(void *in_threadarg) {
+    cpu_spot_benchmark_arg_t *arg = (cpu_spot_benchmark_arg_t *) in_threadarg;
+    for (size_t i = arg->thread; i < arg->nfragments; i += arg->nthreads)
+        find_spots_fragment((const char *) arg->in, arg->out, arg->index, i, 2, 3.0,
+                            SPOT_BOX_DEFAULT_HALF_WIDTH, SPOT_BOX_DEFAULT_HALF_WIDTH);
+    pthread_exit(0);
+}
+
+static void benchmark_cpu_spot_finding(size_t max_threads) {
+    const size_t fragments_per_thread = 4;
+    size_t nfragments = fragments_per_thread * max_threads;
+    int16_t *in = (int16_t *) calloc(nfragments * LINES * COLS, sizeof(int16_t));
+    strong_pixel *out = (strong_pixel *) calloc(nfragments * MAX_STRONG, sizeof(strong_pixel));
+    std::vector<strong_pixel_index_t> index(nfragments);
+    synthetic_fragments(in, nfragments);
+
+    std::vector<pthread_t> threads(max_threads);
+    std::vector<cpu_spot_benchmark_arg_t> args(max_threads);
+
+    // 1, 2, 4, ... threads and max_threads
+    size_t nthreads = 1;
+    while (true) {
+        timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t i = 0; i < nthreads; i++) {
+            args[i].in = in;
+            args[i].out = out;
+            args[i].index = index.data();
+            args[i].nfragments = fragments_per_thread * nthreads;
+            args[i].thread = i;
+            args[i].nthreads = nthreads;
+            int ret = pthread_create(&threads[i], NULL, run_cpu_spot_benchmark_thread, &args[i]);
+            PTHREAD_ERROR(ret,pthread_create);
+        }
+        for (size_t i = 0; i < nthreads; i++) {
+            int ret = pthread_join(threads[i], NULL);
+            PTHREAD_ERROR(ret,pthread_join);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        std::cout << "CPU spot finding: " << nthreads << " threads " << fragments_per_thread * nthreads / time_diff(start, end)
+                  << " fragments/s" << std::endl;
+        if (nthreads == max_threads) break;
+        nthreads = std::min(2 * nthreads, max_threads);
+    }
+
+    free(in);
+    free(out);
+}
+
+// Check summed-area-table kernel against scalar reference and compare single thread throughput (default box)
+bool test_sat_spot_kernel() {
+    if (!test_cpu_spot_kernel<sat_kernel, int16_t>() || !test_cpu_spot_kernel<sat_kernel, int32_t>()) {
+        std::cerr << "Summed-area-table spot finding: output differs from scalar reference" << std::endl;
+        return false;
+    }
+    std::cout << "Summed-area-table spot finding: host " << measure_cpu_spot_kernel<sat_kernel, int16_t>()
+              << " fragments/s (scalar " << measure_cpu_spot_kernel<scalar_kernel, int16_t>() << " fragments/s)" << std::endl;
+    return true;
+}
+
+// Select the fastest checked implementation separately for 16-bit and 32-bit images, measure scaling and start thread pool
+// 16-bit images use exact double arithmetic on all vector units, 32-bit images need 64-bit integers (AVX-512 only)
+// force_scalar = true keeps scalar reference implementation
+int setup_cpu_spot_finding(int nthreads, bool force_scalar) {
+    if (force_scalar) std::cout << "CPU spot finding: scalar" << std::endl;
+    else {
+        double best16 = measure_cpu_spot_kernel<scalar_kernel, int16_t>();
+        double best32 = measure_cpu_spot_kernel<scalar_kernel, int32_t>();
+        const char *name16 = scalar_kernel::name();
+        const char *name32 = scalar_kernel::name();
+        std::cout << "CPU spot finding: scalar " << best16 << " fragments/s (16-bit) "
+                  << best32 << " fragments/s (32-bit) per core" << std::endl;
+#if defined(__VSX__)
+        select_cpu_spot_kernel<vector_kernel, int16_t>(colspot_fragment16, best16, name16);
+#elif defined(__x86_64__)
+        select_cpu_spot_kernel<vector_kernel, int16_t>(colspot_fragment16, best16, name16);
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            select_cpu_spot_kernel<avx2_kernel, int16_t>(colspot_fragment16, best16, name16);
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")
+            && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl")) {
+            select_cpu_spot_kernel<avx512_kernel, int16_t>(colspot_fragment16, best16, name16);
+            select_cpu_spot_kernel<avx512_kernel, int32_t>(colspot_fragment32, best32, name32);
+        }
+#endif
+        std::cout << "CPU spot finding: using " << name16 << " (16-bit), " << name32 << " (32-bit)" << std::endl;
+    }
+
+    benchmark_cpu_spot_finding(nthreads);
+
+    cpu_out = (strong_pixel *) calloc(NCUDA_STREAMS * NIMAGES_PER_STREAM * 2 * MAX_STRONG, sizeof(strong_pixel));
+    cpu_index = (strong_pixel_index_t *) calloc(NCUDA_STREAMS * NIMAGES_PER_STREAM * 2, sizeof(strong_pixel_index_t));
+    if ((cpu_out == NULL) || (cpu_index == NULL)) {
+        std::cerr << "CPU spot finding: Mem alloc. error (output)" << std::endl;
+        return 1;
+    }
+
+    // Same synchronization with send threads as for GPU
+    for (int i = 0; i < NCUDA_STREAMS*CUDA_TO_IB_BUFFER; i++) {
+        pthread_mutex_init(cuda_stream_ready_mutex+i, NULL);
+        pthread_cond_init(cuda_stream_ready_cond+i, NULL);
+        pthread_mutex_init(chunk_written_mutex+i, NULL);
+        pthread_cond_init(chunk_written_cond+i, NULL);
+    }
+
+    cpu_spot_pool_stop = false;
+    cpu_spot_workers.resize(nthreads);
+    for (int i = 0; i < nthreads; i++) {
+        int ret = pthread_create(&cpu_spot_workers[i], NULL, run_cpu_spot_worker, NULL);
+        PTHREAD_ERROR(ret,pthread_create);
+    }
+    return 0;
+}
+
+int close_cpu_spot_finding() {
+    pthread_mutex_lock(&cpu_spot_pool_mutex);
+    cpu_spot_pool_stop = true;
+    pthread_cond_broadcast(&cpu_spot_pool_cond);
+    pthread_mutex_unlock(&cpu_spot_pool_mutex);
+
+    for (size_t i = 0; i < cpu_spot_workers.size(); i++) {
+        int ret = pthread_join(cpu_spot_workers[i], NULL);
+        PTHREAD_ERROR(ret,pthread_join);
+    }
+    cpu_spot_workers.clear();
+
+    for (int i = 0; i < NCUDA_STREAMS*CUDA_TO_IB_BUFFER; i++) {
+        pthread_mutex_destroy(cuda_stream_ready_mutex+i);
+        pthread_cond_destroy(cuda_stream_ready_cond+i);
+        pthread_mutex_destroy(chunk_written_mutex+i);
+        pthread_cond_destroy(chunk_written_cond+i);
+    }
+
+    free(cpu_out);
+    free(cpu_index);
+    cpu_out = NULL;
+    cpu_index = NULL;
+    return 0;
+}
+
+// Same as GPU thread, but strong pixels are found directly in IB buffer,
+// so the buffer can be released only after chunk is analyzed
+void *run_cpu_spot_thread(void *in_threadarg) {
+    ThreadArg *arg = (ThreadArg *) in_threadarg;
+
+    size_t images_per_stream = NIMAGES_PER_STREAM * 2 / experiment_settings.pixel_depth;
+    size_t fragment_size = ((NMODULES/2) * COLS * LINES * experiment_settings.pixel_depth);
+
+    size_t total_chunks = experiment_settings.nimages_to_write / images_per_stream;
+    // Account for leftover
+    if (experiment_settings.nimages_to_write - total_chunks * images_per_stream > 0)
+        total_chunks++;
+
+    size_t thread_id = arg->ThreadID;
+    strong_pixel *out = cpu_out + thread_id * images_per_stream * 2 * MAX_STRONG;
+    strong_pixel_index_t *index = cpu_index + thread_id * images_per_stream * 2;
+
+    for (size_t chunk = thread_id;
+         chunk < total_chunks;
+         chunk += NCUDA_STREAMS) {
+
+        std::vector<spot_t> spots;
+
+        size_t ib_slice = chunk % (NCUDA_STREAMS*CUDA_TO_IB_BUFFER);
+
+        size_t images = experiment_settings.nimages_to_write - chunk * images_per_stream;
+        if (images > images_per_stream) images = images_per_stream;
+
+        pthread_mutex_lock(chunk_written_mutex+ib_slice);
+        // Wait till all images of the chunk are written
+        while (chunk_images_written[ib_slice].load() < images)
+            pthread_cond_wait(chunk_written_cond+ib_slice,
+                              chunk_written_mutex+ib_slice);
+        chunk_images_written[ib_slice] = 0;
+        pthread_mutex_unlock(chunk_written_mutex+ib_slice);
+        trace_event(TRACE_RING_GPU(thread_id), TRACE_GPU_TAKEN, chunk * images_per_stream, images);
+
+        find_spots_cpu(ib_buffer + ib_slice * images_per_stream * fragment_size, out, index, images * 2,
+                       experiment_settings.pixel_depth, experiment_settings.strong_pixel,
+                       experiment_settings.spot_finding_nbx, experiment_settings.spot_finding_nby);
+
+        // Broadcast to everyone waiting, that buffer can be overwritten by next iteration
+        pthread_mutex_lock(cuda_stream_ready_mutex+ib_slice);
+        cuda_stream_ready[ib_slice] = chunk + NCUDA_STREAMS*CUDA_TO_IB_BUFFER;
+        pthread_cond_broadcast(cuda_stream_ready_cond+ib_slice);
+        pthread_mutex_unlock(cuda_stream_ready_mutex+ib_slice);
+
+        size_t overflow_images = analyze_spots(out, index, spots, strong_pixel_histogram[thread_id],
+                                               experiment_settings.connect_spots_between_frames,
+                                               images, chunk * images_per_stream, chunk);
+
+        queue_spots(chunk, chunk * images_per_stream, images, overflow_images, spots);
+    }
+    pthread_exit(0);
+}
@@ -21,11 +21,11 @@ size_t status_buffer_size = 0;
 size_t gain_pedestal_data_size = 0;
 size_t jf_packet_headers_size = 0;
 const size_t ib_buffer_size = COMPOSED_IMAGE_SIZE * RDMA_SQ_SIZE * sizeof(int16_t);
-const size_t strong_pixel_count_size = LINES * COLS * (NMODULES/2) * sizeof(uint64_t);
 
 receiver_settings_t receiver_settings;
 ib_settings_t ib_settings;
 experiment_settings_t experiment_settings;
+detector_geometry_t receiver_geometry;
 
 // Last frame with trigger - for consistency measured only for a single module, protected by mutex
 uint32_t trigger_frame = 0;
@@ -33,14 +33,28 @@ pthread_mutex_t trigger_frame_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t  trigger_frame_cond = PTHREAD_COND_INITIALIZER;
 
 // IB buffer usage
-int16_t ib_buffer_occupancy[RDMA_SQ_SIZE];
-pthread_mutex_t ib_buffer_occupancy_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t ib_buffer_occupancy_cond = PTHREAD_COND_INITIALIZER;
+std::atomic<uint32_t> ib_slot_sequence[RDMA_SQ_SIZE];
+std::atomic<uint32_t> ib_slot_waiters[RDMA_SQ_SIZE];
+bool ib_slot_zero_copy[RDMA_SQ_SIZE];
+uint32_t ib_slot_batch_prev[RDMA_SQ_SIZE];
+ib_slot_statistics_t ib_slot_statistics;
+std::vector<uint32_t> ib_slot_overrun_images;
+
+// Latency tracing
+bool trace_enabled = false;
+trace_ring_t *trace_rings = NULL;
+latency_statistics_t latency_statistics;
+std::atomic<bool> trace_thread_stop;
+
+// Frame arrival
+std::atomic<uint32_t> frame_arrival_seq;
+std::atomic<uint32_t> frame_arrival_waiters;
+std::atomic<bool> frame_watcher_stop;
+std::atomic<uint64_t> frame_wait_histogram[FRAME_WAIT_HISTOGRAM_BINS];
 
 // TCP/IP socket
 int sockfd;
 int accepted_socket; // There is only one accepted socket at the time
-pthread_mutex_t accepted_socket_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 // Buffers for communication with the FPGA
 int16_t *frame_buffer = NULL;
@@ -50,16 +64,22 @@ char *status_buffer = NULL;
 uint16_t *gain_pedestal_data = NULL;
 char *packet_counter = NULL;
 char *ib_buffer = NULL;
+ibv_mr *frame_buffer_mr = NULL;
+char *ib_compressed_buffer = NULL;
+size_t ib_compressed_buffer_size = 0;
+ibv_mr *ib_compressed_buffer_mr = NULL;
 
 pthread_mutex_t cuda_stream_ready_mutex[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
 pthread_cond_t  cuda_stream_ready_cond[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
 int cuda_stream_ready[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
 
-pthread_mutex_t writer_threads_done_mutex[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
-pthread_cond_t writer_threads_done_cond[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
-int writer_threads_done[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
+pthread_mutex_t chunk_written_mutex[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
+pthread_cond_t chunk_written_cond[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
+std::atomic<size_t> chunk_images_written[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
 
-std::set<std::pair<int16_t, int16_t> > bad_pixels;
+uint64_t bad_pixel_mask[BAD_PIXEL_MASK_WORDS];
+size_t bad_pixel_count = 0;
 
-uint64_t *strong_pixel_count = NULL;
-pthread_mutex_t strong_pixel_count_mutex = PTHREAD_MUTEX_INITIALIZER;
+strong_pixel_histogram_t strong_pixel_histogram[NCUDA_STREAMS];
+std::atomic<uint64_t> strong_pixel_overflow_images(0);
+std::atomic<uint64_t> strong_pixel_overflow_pixels(0);
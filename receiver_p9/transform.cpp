@@ -0,0 +1,559 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Geometry transform of module lines (expanding multi-pixels and placing modules in composed image)
+// Transform executes remap description built by setup_geometry() (see common/Geometry.cpp)
+// There is scalar reference implementation and vector implementations for VSX (POWER9) and SSE2/AVX2 (x86)
+// Vector implementations expand the whole module line at once: chips are copied with vector loads/stores
+// and only the multi-pixels at chip edges are written as scalars
+// Implementation is selected at runtime by setup_transform(), based on measured throughput
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+
+#include "JFReceiver.h"
+
+#if defined(__VSX__)
+#include <altivec.h>
+#elif defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Take half of the number, but only if not bad pixel/overload
+inline int16_t half16(int16_t in) {
+    int16_t tmp = in;
+    if ((in > INT16_MIN + 10) && (in < INT16_MAX - 10)) tmp /= 2;
+    return tmp;
+}
+
+// Take quarter of the number, but only if not bad pixel/overload
+inline int16_t quarter16(int16_t in) {
+    int16_t tmp = in;
+    if ((in > INT16_MIN + 10) && (in < INT16_MAX - 10)) tmp /= 4;
+    return tmp;
+}
+
+inline int32_t half32(int32_t in) {
+    int32_t tmp = in;
+    if ((in > INT32_MIN) && (in < INT32_MAX)) tmp /= 2;
+    return tmp;
+}
+
+inline int32_t quarter32(int32_t in) {
+    int32_t tmp = in;
+    if ((in > INT32_MIN) && (in < INT32_MAX)) tmp /= 4;
+    return tmp;
+}
+
+// Scalar kernels - these are reference for vector implementations
+struct scalar_kernel {
+    static const char *name() { return "scalar"; }
+
+    // Copy run of pixels, halve them and write to two destinations (regular pixels in multi-pixel line)
+    static void half_run(int16_t *dst, int16_t *dst2, const int16_t *src, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            int16_t tmp = half16(src[i]);
+            dst[i] = tmp;
+            dst2[i] = tmp;
+        }
+    }
+
+    static void half_run(int32_t *dst, int32_t *dst2, const int32_t *src, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            int32_t tmp = half32(src[i]);
+            dst[i] = tmp;
+            dst2[i] = tmp;
+        }
+    }
+};
+
+#if defined(__VSX__)
+// POWER9 - 128-bit VSX
+struct vsx_kernel {
+    static const char *name() { return "VSX"; }
+
+    // Copy n bytes (at least 16), destination of chip is not aligned in composed image
+    // so stores are aligned and first/last vector are written unaligned (overlapping)
+    static void copy(void *dst, const void *src, size_t n) {
+        const unsigned char *in = (const unsigned char *) src;
+        unsigned char *out = (unsigned char *) dst;
+        vector unsigned char first = vec_xl(0, in);
+        vector unsigned char last = vec_xl(n - 16, in);
+        for (size_t i = (-(uintptr_t) out) & 15; i + 16 <= n; i += 16)
+            vec_xst(vec_xl(i, in), i, out);
+        vec_xst(first, 0, out);
+        vec_xst(last, n - 16, out);
+    }
+
+    static void half_run(int16_t *dst, int16_t *dst2, const int16_t *src, size_t n) {
+        const vector signed short low = vec_splats((signed short) (INT16_MIN + 10));
+        const vector signed short high = vec_splats((signed short) (INT16_MAX - 10));
+        const vector unsigned short one = vec_splats((unsigned short) 1);
+        const vector unsigned short sign_shift = vec_splats((unsigned short) 15);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            vector signed short in = vec_xl(0, (signed short *) (src + i));
+            // Round towards zero, like C division: add 1 for negative numbers before shift
+            vector signed short bias = (vector signed short) vec_sr((vector unsigned short) in, sign_shift);
+            vector signed short half = vec_sra(vec_add(in, bias), one);
+            vector bool short mask = vec_and(vec_cmpgt(in, low), vec_cmplt(in, high));
+            vector signed short out = vec_sel(in, half, mask);
+            vec_xst(out, 0, (signed short *) (dst + i));
+            vec_xst(out, 0, (signed short *) (dst2 + i));
+        }
+        scalar_kernel::half_run(dst + i, dst2 + i, src + i, n - i);
+    }
+
+    static void half_run(int32_t *dst, int32_t *dst2, const int32_t *src, size_t n) {
+        const vector signed int min = vec_splats((signed int) INT32_MIN);
+        const vector signed int max = vec_splats((signed int) INT32_MAX);
+        const vector unsigned int one = vec_splats((unsigned int) 1);
+        const vector unsigned int sign_shift = vec_splats((unsigned int) 31);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            vector signed int in = vec_xl(0, (signed int *) (src + i));
+            // Round towards zero, like C division: add 1 for negative numbers before shift
+            vector signed int bias = (vector signed int) vec_sr((vector unsigned int) in, sign_shift);
+            vector signed int half = vec_sra(vec_add(in, bias), one);
+            vector bool int keep = vec_or(vec_cmpeq(in, min), vec_cmpeq(in, max));
+            vector signed int out = vec_sel(half, in, keep);
+            vec_xst(out, 0, (signed int *) (dst + i));
+            vec_xst(out, 0, (signed int *) (dst2 + i));
+        }
+        scalar_kernel::half_run(dst + i, dst2 + i, src + i, n - i);
+    }
+};
+#endif
+
+#if defined(__x86_64__)
+// x86 - SSE2 is always present in x86-64
+struct sse2_kernel {
+    static const char *name() { return "SSE2"; }
+
+    // Copy n bytes (at least 16), destination of chip is not aligned in composed image
+    // so stores are aligned and first/last vector are written unaligned (overlapping)
+    static void copy(void *dst, const void *src, size_t n) {
+        const char *in = (const char *) src;
+        char *out = (char *) dst;
+        __m128i first = _mm_loadu_si128((const __m128i *) in);
+        __m128i last = _mm_loadu_si128((const __m128i *) (in + n - 16));
+        for (size_t i = (-(uintptr_t) out) & 15; i + 16 <= n; i += 16)
+            _mm_store_si128((__m128i *) (out + i), _mm_loadu_si128((const __m128i *) (in + i)));
+        _mm_storeu_si128((__m128i *) out, first);
+        _mm_storeu_si128((__m128i *) (out + n - 16), last);
+    }
+
+    static void half_run(int16_t *dst, int16_t *dst2, const int16_t *src, size_t n) {
+        const __m128i low = _mm_set1_epi16(INT16_MIN + 10);
+        const __m128i high = _mm_set1_epi16(INT16_MAX - 10);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m128i in = _mm_loadu_si128((const __m128i *) (src + i));
+            __m128i half = _mm_srai_epi16(_mm_add_epi16(in, _mm_srli_epi16(in, 15)), 1);
+            __m128i mask = _mm_and_si128(_mm_cmpgt_epi16(in, low), _mm_cmpgt_epi16(high, in));
+            __m128i out = _mm_or_si128(_mm_and_si128(mask, half), _mm_andnot_si128(mask, in));
+            _mm_storeu_si128((__m128i *) (dst + i), out);
+            _mm_storeu_si128((__m128i *) (dst2 + i), out);
+        }
+        scalar_kernel::half_run(dst + i, dst2 + i, src + i, n - i);
+    }
+
+    static void half_run(int32_t *dst, int32_t *dst2, const int32_t *src, size_t n) {
+        const __m128i min = _mm_set1_epi32(INT32_MIN);
+        const __m128i max = _mm_set1_epi32(INT32_MAX);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m128i in = _mm_loadu_si128((const __m128i *) (src + i));
+            __m128i half = _mm_srai_epi32(_mm_add_epi32(in, _mm_srli_epi32(in, 31)), 1);
+            __m128i keep = _mm_or_si128(_mm_cmpeq_epi32(in, min), _mm_cmpeq_epi32(in, max));
+            __m128i out = _mm_or_si128(_mm_and_si128(keep, in), _mm_andnot_si128(keep, half));
+            _mm_storeu_si128((__m128i *) (dst + i), out);
+            _mm_storeu_si128((__m128i *) (dst2 + i), out);
+        }
+        scalar_kernel::half_run(dst + i, dst2 + i, src + i, n - i);
+    }
+};
+
+// AVX2 - compiled for AVX2 target, but only called if CPU supports it
+struct avx2_kernel {
+    static const char *name() { return "AVX2"; }
+
+    // Copy n bytes (at least 32), as in sse2_kernel::copy
+    __attribute__((target("avx2")))
+    static void copy(void *dst, const void *src, size_t n) {
+        const char *in = (const char *) src;
+        char *out = (char *) dst;
+        __m256i first = _mm256_loadu_si256((const __m256i *) in);
+        __m256i last = _mm256_loadu_si256((const __m256i *) (in + n - 32));
+        for (size_t i = (-(uintptr_t) out) & 31; i + 32 <= n; i += 32)
+            _mm256_store_si256((__m256i *) (out + i), _mm256_loadu_si256((const __m256i *) (in + i)));
+        _mm256_storeu_si256((__m256i *) out, first);
+        _mm256_storeu_si256((__m256i *) (out + n - 32), last);
+    }
+
+    __attribute__((target("avx2")))
+    static void half_run(int16_t *dst, int16_t *dst2, const int16_t *src, size_t n) {
+        const __m256i low = _mm256_set1_epi16(INT16_MIN + 10);
+        const __m256i high = _mm256_set1_epi16(INT16_MAX - 10);
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m256i in = _mm256_loadu_si256((const __m256i *) (src + i));
+            __m256i half = _mm256_srai_epi16(_mm256_add_epi16(in, _mm256_srli_epi16(in, 15)), 1);
+            __m256i mask = _mm256_and_si256(_mm256_cmpgt_epi16(in, low), _mm256_cmpgt_epi16(high, in));
+            __m256i out = _mm256_blendv_epi8(in, half, mask);
+            _mm256_storeu_si256((__m256i *) (dst + i), out);
+            _mm256_storeu_si256((__m256i *) (dst2 + i), out);
+        }
+        sse2_kernel::half_run(dst + i, dst2 + i, src + i, n - i);
+    }
+
+    __attribute__((target("avx2")))
+    static void half_run(int32_t *dst, int32_t *dst2, const int32_t *src, size_t n) {
+        const __m256i min = _mm256_set1_epi32(INT32_MIN);
+        const __m256i max = _mm256_set1_epi32(INT32_MAX);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256i in = _mm256_loadu_si256((const __m256i *) (src + i));
+            __m256i half = _mm256_srai_epi32(_mm256_add_epi32(in, _mm256_srli_epi32(in, 31)), 1);
+            __m256i keep = _mm256_or_si256(_mm256_cmpeq_epi32(in, min), _mm256_cmpeq_epi32(in, max));
+            __m256i out = _mm256_blendv_epi8(half, in, keep);
+            _mm256_storeu_si256((__m256i *) (dst + i), out);
+            _mm256_storeu_si256((__m256i *) (dst2 + i), out);
+        }
+        sse2_kernel::half_run(dst + i, dst2 + i, src + i, n - i);
+    }
+};
+#endif
+
+inline int16_t split_value(int16_t in, int divisor_shift) {
+    if (divisor_shift == 1) return half16(in);
+    if (divisor_shift == 2) return quarter16(in);
+    return in;
+}
+
+inline int32_t split_value(int32_t in, int divisor_shift) {
+    if (divisor_shift == 1) return half32(in);
+    if (divisor_shift == 2) return quarter32(in);
+    return in;
+}
+
+// Transform nlines module lines, starting from line0
+// input points to line0 of the module, output to the composed image
+// Regular runs are copied with memcpy or vector kernel, multi-pixels (single pixel segments) as scalars
+template <class K, class T> void transform_lines_t(const detector_geometry_t &geometry, T *output, const T *input,
+                                                   size_t module, size_t line0, size_t nlines) {
+    const T *in = input - line0 * MODULE_COLS;
+    size_t first = geometry.line_first_segment[module * MODULE_LINES + line0];
+    size_t last  = geometry.line_first_segment[module * MODULE_LINES + line0 + nlines];
+
+    for (size_t s = first; s < last; s++) {
+        const geometry_segment_t &segment = geometry.segments[s];
+        if ((segment.ncopies == 1) && (segment.divisor_shift == 0))
+            memcpy(output + segment.destination[0], in + segment.source, segment.length * sizeof(T));
+        else if ((segment.ncopies == 2) && (segment.divisor_shift == 1) && (segment.length > 1))
+            K::half_run(output + segment.destination[0], output + segment.destination[1], in + segment.source, segment.length);
+        else {
+            for (int i = 0; i < segment.length; i++) {
+                T tmp = split_value(in[segment.source + i], segment.divisor_shift);
+                for (int c = 0; c < segment.ncopies; c++)
+                    output[segment.destination[c] + i] = tmp;
+            }
+        }
+    }
+}
+
+// Module line in composed image is made of MODULE_CHIPS chips of CHIP_COLS pixels, each expanded by 2 pixels
+// Chip edge pixels (except module edges) are multi-pixels, split into 2 composed image pixels
+#define CHIP_COLS          256L
+#define EXPANDED_CHIP_COLS 258L
+#define MODULE_CHIPS       (MODULE_COLS / CHIP_COLS)
+
+// Module column (source) of composed image column within module line, edge = true for multi-pixel
+static int64_t expanded_line_source(int64_t col_out, bool &edge) {
+    int64_t chip = std::min(col_out / EXPANDED_CHIP_COLS, MODULE_CHIPS - 1);
+    int64_t col = col_out - chip * EXPANDED_CHIP_COLS;
+    edge = true;
+    if ((chip > 0) && (col == 0)) return chip * CHIP_COLS;
+    if ((chip < MODULE_CHIPS - 1) && (col >= CHIP_COLS - 1))
+        return (col < CHIP_COLS + 1) ? chip * CHIP_COLS + CHIP_COLS - 1 : (chip + 1) * CHIP_COLS;
+    edge = false;
+    return chip * CHIP_COLS + col;
+}
+
+// Module line is either expanded into one composed image line (nlines = 1), split into two image lines,
+// as multi-pixel line (nlines = 2), or handled by segments (nlines = 0)
+struct transform_line_plan_t {
+    int nlines;
+    uint32_t destination[2]; // first pixel of each image line
+};
+
+static std::vector<transform_line_plan_t> transform_line_plan;
+
+// Line is expanded by line kernel only if its segments are exactly what the line kernel does
+static transform_line_plan_t plan_line(const detector_geometry_t &geometry, size_t module, size_t line) {
+    transform_line_plan_t plan;
+    plan.nlines = 0;
+    size_t first = geometry.line_first_segment[module * MODULE_LINES + line];
+    size_t last  = geometry.line_first_segment[module * MODULE_LINES + line + 1];
+    if ((first == last) || (geometry.segments[first].source != line * MODULE_COLS)) return plan;
+
+    int nlines = geometry.segments[first].ncopies;
+    if ((nlines != 1) && (nlines != 2)) return plan;
+    for (int l = 0; l < nlines; l++) plan.destination[l] = geometry.segments[first].destination[l];
+
+    std::vector<bool> written(nlines * EXPANDED_MODULE_COLS, false);
+    for (size_t s = first; s < last; s++) {
+        const geometry_segment_t &segment = geometry.segments[s];
+        int64_t col0 = (int64_t) segment.source - (int64_t) line * MODULE_COLS;
+        for (int c = 0; c < segment.ncopies; c++) {
+            int l = c * nlines / segment.ncopies;
+            int64_t col_out0 = (int64_t) segment.destination[c] - (int64_t) plan.destination[l];
+            if ((col_out0 < 0) || (col_out0 + segment.length > EXPANDED_MODULE_COLS)) return plan;
+            for (int i = 0; i < segment.length; i++) {
+                bool edge;
+                if ((expanded_line_source(col_out0 + i, edge) != col0 + i)
+                    || (segment.ncopies != nlines * (edge ? 2 : 1))
+                    || (segment.divisor_shift != nlines - 1 + (edge ? 1 : 0))
+                    || written[l * EXPANDED_MODULE_COLS + col_out0 + i])
+                    return plan;
+                written[l * EXPANDED_MODULE_COLS + col_out0 + i] = true;
+            }
+        }
+    }
+    if (std::find(written.begin(), written.end(), false) != written.end()) return plan;
+    plan.nlines = nlines;
+    return plan;
+}
+
+static void setup_line_plan(const detector_geometry_t &geometry) {
+    transform_line_plan.resize(geometry.nmodules * MODULE_LINES);
+    for (int64_t module = 0; module < geometry.nmodules; module++) {
+        for (size_t line = 0; line < MODULE_LINES; line++)
+            transform_line_plan[module * MODULE_LINES + line] = plan_line(geometry, module, line);
+    }
+}
+
+// Regular line - chips are copied, then edges are overwritten with split multi-pixels
+template <class K, class T> inline void expand_line(T *out, const T *in) {
+    for (int chip = 0; chip < MODULE_CHIPS; chip++)
+        K::copy(out + chip * EXPANDED_CHIP_COLS, in + chip * CHIP_COLS, CHIP_COLS * sizeof(T));
+    for (int chip = 0; chip < MODULE_CHIPS - 1; chip++) {
+        T left  = split_value(in[chip * CHIP_COLS + CHIP_COLS - 1], 1);
+        T right = split_value(in[(chip + 1) * CHIP_COLS], 1);
+        T *edge = out + chip * EXPANDED_CHIP_COLS + CHIP_COLS - 1;
+        edge[0] = left;
+        edge[1] = left;
+        edge[2] = right;
+        edge[3] = right;
+    }
+}
+
+// Multi-pixel line - halved chips are written to both lines, edges are corners split in 4
+template <class K, class T> inline void expand_split_line(T *out, T *out2, const T *in) {
+    for (int chip = 0; chip < MODULE_CHIPS; chip++)
+        K::half_run(out + chip * EXPANDED_CHIP_COLS, out2 + chip * EXPANDED_CHIP_COLS, in + chip * CHIP_COLS, CHIP_COLS);
+    for (int chip = 0; chip < MODULE_CHIPS - 1; chip++) {
+        T left  = split_value(in[chip * CHIP_COLS + CHIP_COLS - 1], 2);
+        T right = split_value(in[(chip + 1) * CHIP_COLS], 2);
+        T *edge = out + chip * EXPANDED_CHIP_COLS + CHIP_COLS - 1;
+        T *edge2 = out2 + chip * EXPANDED_CHIP_COLS + CHIP_COLS - 1;
+        edge[0] = left;
+        edge[1] = left;
+        edge[2] = right;
+        edge[3] = right;
+        edge2[0] = left;
+        edge2[1] = left;
+        edge2[2] = right;
+        edge2[3] = right;
+    }
+}
+
+// Vector implementation - line kernels for lines with standard layout, segments otherwise
+template <class K, class T> void transform_lines_vector_t(const detector_geometry_t &geometry, T *output, const T *input,
+                                                          size_t module, size_t line0, size_t nlines) {
+    if (transform_line_plan.size() != (size_t) (geometry.nmodules * MODULE_LINES)) {
+        transform_lines_t<K, T>(geometry, output, input, module, line0, nlines);
+        return;
+    }
+    for (size_t line = line0; line < line0 + nlines; line++) {
+        const transform_line_plan_t &plan = transform_line_plan[module * MODULE_LINES + line];
+        const T *in = input + (line - line0) * MODULE_COLS;
+        if (plan.nlines == 1)
+            expand_line<K, T>(output + plan.destination[0], in);
+        else if (plan.nlines == 2)
+            expand_split_line<K, T>(output + plan.destination[0], output + plan.destination[1], in);
+        else
+            transform_lines_t<K, T>(geometry, output, in, module, line, 1);
+    }
+}
+
+void (*transform_lines16)(const detector_geometry_t &geometry, int16_t *output, const int16_t *input,
+                          size_t module, size_t line0, size_t nlines) = transform_lines_t<scalar_kernel, int16_t>;
+void (*transform_lines32)(const detector_geometry_t &geometry, int32_t *output, const int32_t *input,
+                          size_t module, size_t line0, size_t nlines) = transform_lines_t<scalar_kernel, int32_t>;
+
+// Frame summation (summation > 1)
+// Sum of int16 values cannot overflow int32 for allowed summation (5000 * INT16_MAX < INT32_MAX),
+// so only sentinels need special treatment. These are tracked in mask lane:
+// bit 1 = bad pixel in any of the frames (result INT32_MIN), bit 0 = overload in any of the frames (result INT32_MAX)
+// Loops are branch-free, so they are vectorized by the compiler.
+
+#define SUM_MASK_OVERLOAD 1
+#define SUM_MASK_BAD      2
+
+void sum_frames_accumulate(int32_t *__restrict__ sum, int16_t *__restrict__ mask, const int16_t *__restrict__ source, size_t npixel) {
+    for (size_t i = 0; i < npixel; i++) {
+        int16_t tmp = source[i];
+        mask[i] |= ((tmp < INT16_MIN + 10) ? SUM_MASK_BAD : 0) | ((tmp > INT16_MAX - 10) ? SUM_MASK_OVERLOAD : 0);
+        sum[i] += tmp;
+    }
+}
+
+// Replace sum with sentinel values, bad pixel takes precedence over overload
+void sum_frames_finalize(int32_t *__restrict__ sum, const int16_t *__restrict__ mask, size_t npixel) {
+    for (size_t i = 0; i < npixel; i++) {
+        int32_t tmp = (mask[i] & SUM_MASK_OVERLOAD) ? INT32_MAX : sum[i];
+        sum[i] = (mask[i] & SUM_MASK_BAD) ? INT32_MIN : tmp;
+    }
+}
+
+// Pixel values that hit all the corner cases of half/quarter functions
+static const int32_t test_values[] = {INT16_MIN, INT16_MIN + 10, INT16_MIN + 11, -5, -4, -3, -2, -1, 0, 1, 2, 3, 5,
+                                      INT16_MAX - 11, INT16_MAX - 10, INT16_MAX - 9, INT16_MAX,
+                                      INT32_MIN, INT32_MIN + 1, INT32_MAX - 1, INT32_MAX};
+
+static double time_diff(const timespec &start, const timespec &end) {
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+typedef void (*transform16_t)(const detector_geometry_t &geometry, int16_t *output, const int16_t *input,
+                              size_t module, size_t line0, size_t nlines);
+typedef void (*transform32_t)(const detector_geometry_t &geometry, int32_t *output, const int32_t *input,
+                              size_t module, size_t line0, size_t nlines);
+
+// Best of several repetitions of transforming all modules, output GB/s on a single core
+template <class T> static double measure_transform(const detector_geometry_t &geometry,
+                                                   void (*transform)(const detector_geometry_t &, T *, const T *, size_t, size_t, size_t),
+                                                   T *output, const T *input) {
+    double best = 0;
+    for (int r = 0; r < 8; r++) {
+        timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int module = 0; module < geometry.nmodules; module++)
+            transform(geometry, output, input + module * MODULE_LINES * MODULE_COLS, module, 0, MODULE_LINES);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        best = std::max(best, geometry.xpixel * geometry.ypixel * sizeof(T) / time_diff(start, end) / 1e9);
+    }
+    return best;
+}
+
+// Compare implementation with scalar reference on synthetic modules and measure throughput for 16-bit and 32-bit images
+static bool test_transform(const detector_geometry_t &geometry, transform16_t transform16, transform32_t transform32,
+                           double &gb_per_s16, double &gb_per_s32) {
+    size_t nvalues = sizeof(test_values) / sizeof(int32_t);
+    size_t in_size = geometry.nmodules * MODULE_LINES * MODULE_COLS;
+    size_t out_size = geometry.xpixel * geometry.ypixel;
+
+    int16_t *in16 = (int16_t *) calloc(in_size, sizeof(int16_t));
+    int32_t *in32 = (int32_t *) calloc(in_size, sizeof(int32_t));
+    int16_t *ref16 = (int16_t *) calloc(out_size, sizeof(int16_t));
+    int16_t *out16 = (int16_t *) calloc(out_size, sizeof(int16_t));
+    int32_t *ref32 = (int32_t *) calloc(out_size, sizeof(int32_t));
+    int32_t *out32 = (int32_t *) calloc(out_size, sizeof(int32_t));
+
+    // Pseudo-random pattern with corner case values injected
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < in_size; i++) {
+        seed = seed * 1103515245 + 12345;
+        if (seed % 7 == 0) {
+            in32[i] = test_values[(seed >> 8) % nvalues];
+            in16[i] = (int16_t) std::max(std::min(in32[i], (int32_t) INT16_MAX), (int32_t) INT16_MIN);
+        } else {
+            in16[i] = (int16_t) (seed >> 16);
+            in32[i] = (int32_t) seed;
+        }
+    }
+
+    for (int module = 0; module < geometry.nmodules; module++) {
+        size_t offset = module * MODULE_LINES * MODULE_COLS;
+        transform_lines_t<scalar_kernel, int16_t>(geometry, ref16, in16 + offset, module, 0, MODULE_LINES);
+        transform16(geometry, out16, in16 + offset, module, 0, MODULE_LINES);
+        transform_lines_t<scalar_kernel, int32_t>(geometry, ref32, in32 + offset, module, 0, MODULE_LINES);
+        // 32-bit images are transformed in blocks of lines (frame summation)
+        for (size_t line0 = 0; line0 < MODULE_LINES; line0 += 64)
+            transform32(geometry, out32, in32 + offset + line0 * MODULE_COLS, module, line0, 64);
+    }
+    bool ok = (memcmp(ref16, out16, out_size * sizeof(int16_t)) == 0) && (memcmp(ref32, out32, out_size * sizeof(int32_t)) == 0);
+
+    gb_per_s16 = measure_transform<int16_t>(geometry, transform16, out16, in16);
+    gb_per_s32 = measure_transform<int32_t>(geometry, transform32, out32, in32);
+
+    free(in16);
+    free(in32);
+    free(ref16);
+    free(out16);
+    free(ref32);
+    free(out32);
+    return ok;
+}
+
+// Implementation is used for each pixel depth only if it is faster than the one selected so far
+template <class K> void select_transform(const detector_geometry_t &geometry, double &best16, double &best32,
+                                         const char *&name16, const char *&name32) {
+    double gb_per_s16, gb_per_s32;
+    if (!test_transform(geometry, transform_lines_vector_t<K, int16_t>, transform_lines_vector_t<K, int32_t>,
+                        gb_per_s16, gb_per_s32)) {
+        std::cerr << "Transform: " << K::name() << " output differs from scalar reference, not used" << std::endl;
+        return;
+    }
+    std::cout << "Transform: " << K::name() << " " << gb_per_s16 << " GB/s (16-bit) "
+              << gb_per_s32 << " GB/s (32-bit) per core" << std::endl;
+    if (gb_per_s16 > best16) {
+        transform_lines16 = transform_lines_vector_t<K, int16_t>;
+        best16 = gb_per_s16;
+        name16 = K::name();
+    }
+    if (gb_per_s32 > best32) {
+        transform_lines32 = transform_lines_vector_t<K, int32_t>;
+        best32 = gb_per_s32;
+        name32 = K::name();
+    }
+}
+
+// Select the fastest implementation supported by the CPU, separately for 16-bit and 32-bit images
+// force_scalar = true keeps scalar reference implementation
+void setup_transform(const detector_geometry_t &geometry, bool force_scalar) {
+    double best16, best32;
+    const char *name16 = scalar_kernel::name();
+    const char *name32 = scalar_kernel::name();
+    transform_lines16 = transform_lines_t<scalar_kernel, int16_t>;
+    transform_lines32 = transform_lines_t<scalar_kernel, int32_t>;
+    test_transform(geometry, transform_lines16, transform_lines32, best16, best32);
+    std::cout << "Transform: scalar " << best16 << " GB/s (16-bit) " << best32 << " GB/s (32-bit) per core" << std::endl;
+    if (force_scalar) return;
+
+    setup_line_plan(geometry);
+#if defined(__VSX__)
+    select_transform<vsx_kernel>(geometry, best16, best32, name16, name32);
+#elif defined(__x86_64__)
+    select_transform<sse2_kernel>(geometry, best16, best32, name16, name32);
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) select_transform<avx2_kernel>(geometry, best16, best32, name16, name32);
+#endif
+    std::cout << "Transform: using " << name16 << " (16-bit), " << name32 << " (32-bit)" << std::endl;
+}
@@ -15,6 +15,7 @@
  */
 
 #include <sys/stat.h>
+#include <algorithm>
 #include <string>
 #include <iostream>
 #include <fstream>
@@ -407,26 +408,11 @@ int SaveAngleContainer(hid_t location, std::string const& name, double start, do
 void transform_and_write_mask(hid_t grp, bool replace = false) {
     uint32_t *pixel_mask = (uint32_t *) calloc(XPIXEL * YPIXEL, sizeof(uint32_t));
 
-    for (int module = 0; module < NMODULES*NCARDS; module ++) {
-        for (uint64_t line = 0; line < MODULE_LINES; line ++) {
-            size_t pixel_in = (module * MODULE_LINES + line) * MODULE_COLS;
-            size_t line_out = (513L - line - (line / 256) * 2L + 514L * (3 - (module / 2))) * 2L + module % 2;
-            // Modules are interleaved to make 2 modules in one line
-            for (uint64_t column = 0; column < MODULE_COLS; column ++) {
-                size_t pixel_out = line_out * (XPIXEL/2) + column + (column / 256) * 2L;
-                pixel_mask[pixel_out] = gain_pedestal.pixel_mask[pixel_in + column];
-                // Vertical multipixel lines
-                if ((column % 256 == 0) && (column != 0)) pixel_mask[pixel_out - 1] = pixel_mask[pixel_out];
-                if ((column % 256 == 255) && (column != MODULE_COLS)) pixel_mask[pixel_out + 1] = pixel_mask[pixel_out];
-            }
-        }
-    }
+    // Modules of all cards are arranged 2 per row, with card 0 at the bottom of the image
+    detector_geometry_t geometry;
+    setup_geometry(geometry, NMODULES * NCARDS, 2, true);
+    geometry_transform_mask(geometry, gain_pedestal.pixel_mask, pixel_mask);
 
-    // Copy horizontal multi-pixel lines
-    for (int i = 0; i < NMODULES * NCARDS / 2; i ++) {
-        memcpy(pixel_mask + (514 * i + 256) * 1030 * 2, pixel_mask + (514 * i + 255) * 1030 * 2, 2 * 1030 * sizeof(uint32_t));
-        memcpy(pixel_mask + (514 * i + 257) * 1030 * 2, pixel_mask + (514 * i + 258) * 1030 * 2, 2 * 1030 * sizeof(uint32_t));
-    }
     if (replace) {
         hid_t dataset_id = H5Dopen(master_file_id, "/entry/instrument/detector/pixel_mask", H5P_DEFAULT);
         herr_t status = H5Dwrite(dataset_id, H5T_NATIVE_UINT, H5S_ALL, H5S_ALL, H5P_DEFAULT,
@@ -716,6 +702,17 @@ int write_spots() {
     saveDouble2D(grp, "spot_coord", tmp, "", spots.size(), 2);
 
     free(tmp);
+
+    // Number of images, in which pixel was strong - summed from histograms of all cards
+    auto hot_pixels = (uint32_t *) calloc(XPIXEL * YPIXEL, sizeof(uint32_t));
+    for (int card = 0; card < NCARDS; card++) {
+        for (auto &entry : strong_pixel_counts[card]) {
+            if (entry.pixel < XPIXEL * YPIXEL) hot_pixels[entry.pixel] += entry.count;
+        }
+    }
+    saveUInt2D(grp, "strong_pixel_count", hot_pixels, "", YPIXEL, XPIXEL);
+    free(hot_pixels);
+
     H5Gclose(grp);
     return 0;
 }
@@ -795,6 +792,14 @@ int close_master_hdf5() {
     saveString(grp, "pedestal_G1_time", time_UTC(time_pedestalG1.tv_sec));
     saveString(grp, "pedestal_G2_time", time_UTC(time_pedestalG2.tv_sec));
 
+    // Images, which could be overwritten by detector during zero-copy send on any card
+    std::vector<int> overrun;
+    for (int card = 0; card < NCARDS; card++)
+        overrun.insert(overrun.end(), overrun_images[card].begin(), overrun_images[card].end());
+    std::sort(overrun.begin(), overrun.end());
+    overrun.erase(std::unique(overrun.begin(), overrun.end()), overrun.end());
+    if (!overrun.empty()) saveInt1D(grp, "overrun_images", overrun.data(), "", overrun.size());
+
     H5Gclose(grp);
 
     grp = createGroup(master_file_id, "/entry/instrument/detector/detectorSpecific/adu_to_photon","NXcollection");
@@ -34,6 +34,9 @@ double mean_pedestalG1[NMODULES*NCARDS];
 double mean_pedestalG2[NMODULES*NCARDS];
 size_t bad_pixels[NMODULES*NCARDS];
 
+// Counter of dTLB misses during data collection (-1 if not available)
+int dtlb_miss_counter = -1;
+
 int jfwriter_setup() {
     // Register HDF5 bitshuffle filter
     H5Zregister(bshuf_H5Filter);
@@ -103,6 +106,8 @@ int jfwriter_start() {
     for (int i = 0; i < NCARDS; i++)
         if (exchange_magic_number(writer_connection_settings[i].sockfd)) return 1;
 
+    dtlb_miss_counter = open_dtlb_miss_counter();
+
     // Start writer threads - these threads receive images via IB Verbs
     if (experiment_settings.nimages_to_write > 0) {
         if (writer_settings.write_mode == JF_WRITE_HDF5)
@@ -149,6 +154,11 @@ int jfwriter_stop() {
         if (writer_settings.write_mode == JF_WRITE_HDF5)
             close_data_hdf5();
     }
+
+    int64_t dtlb_misses = close_dtlb_miss_counter(dtlb_miss_counter);
+    dtlb_miss_counter = -1;
+    if (dtlb_misses >= 0)
+        std::cout << "dTLB misses: " << dtlb_misses << std::endl;
     // Record end time, as time when everything has ended
     clock_gettime(CLOCK_REALTIME, &time_end);
 
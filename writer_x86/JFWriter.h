@@ -135,6 +135,7 @@ extern writer_thread_arg_t metadata_thread_arg[NCARDS];
 
 extern gain_pedestal_t gain_pedestal;
 extern online_statistics_t online_statistics[NCARDS];
+extern latency_statistics_t latency_statistics[NCARDS];
 
 extern experiment_settings_t experiment_settings;
 extern writer_connection_settings_t writer_connection_settings[NCARDS];
@@ -155,6 +156,11 @@ extern std::vector<bool> preview_image_available;
 extern std::vector<spot_t> spots;
 extern pthread_mutex_t spots_mutex;
 
+// Hot pixel histograms received from each card (each metadata thread fills own entry)
+extern std::vector<strong_pixel_count_t> strong_pixel_counts[NCARDS];
+// Raw images, which receiver sent from frame buffer and could be overwritten by detector before send completed
+extern std::vector<uint32_t> overrun_images[NCARDS];
+
 extern std::vector<double> spot_count_per_image;
 extern spot_statistics_t spot_statistics;
 extern int spot_statistics_sequence; // spot statistics sequence is incremented every time these are updated, so plot can be changed then
@@ -71,32 +71,48 @@ void *run_metadata_thread(void* thread_arg) {
     if (experiment_settings.enable_spot_finding) {
         size_t omega_range = std::lround(experiment_settings.nimages_to_write * experiment_settings.omega_angle_per_image);
 
-        for (int chunk = 0; chunk < total_chunks; chunk++) {
-            // Receive spots found by spot finder
-            size_t spot_data_size;
-            tcp_receive(writer_connection_settings[card_id].sockfd,(char *) &spot_data_size, sizeof(size_t));
+        std::vector<bool> chunk_received(total_chunks, false);
+        size_t overflow_images = 0;
+        std::vector<spot_t> received;
+
+        for (int message = 0; message < total_chunks; message++) {
+            // Receive spots found by spot finder - header, then spots
+            spot_message_header_t header;
+            if (tcp_receive(writer_connection_settings[card_id].sockfd, (char *) &header, sizeof(spot_message_header_t)) != 0)
+                break;
+            if ((header.magic != SPOT_MESSAGE_MAGIC) || (header.version != SPOT_STREAM_VERSION)
+                || (header.length != header.nspots * sizeof(spot_t))) {
+                std::cerr << "Receiver " << card_id << ": spot stream error (magic " << std::hex << header.magic << std::dec
+                          << " version " << header.version << ")" << std::endl;
+                break;
+            }
+            if ((header.chunk >= total_chunks) || chunk_received[header.chunk])
+                std::cerr << "Receiver " << card_id << ": unexpected spot chunk " << header.chunk << std::endl;
+            else chunk_received[header.chunk] = true;
+            if (header.flags & SPOT_MESSAGE_OVERFLOW) overflow_images += header.overflow_images;
 
-            std::vector<spot_t> local_spots(spot_data_size);
-            if (spot_data_size > 0)
-                tcp_receive(writer_connection_settings[card_id].sockfd, (char *) local_spots.data(), spot_data_size * sizeof(spot_t));
+            // Spots are received into buffer of this thread, network read must not hold locks
+            received.resize(header.nspots);
+            if ((header.nspots > 0) &&
+                (tcp_receive(writer_connection_settings[card_id].sockfd, (char *) received.data(), header.length) != 0))
+                break;
 
-            // Merge spots with the global list
             pthread_mutex_lock(&spots_mutex);
-            spots.insert(spots.end(), local_spots.begin(), local_spots.end());
+            spots.insert(spots.end(), received.begin(), received.end());
             pthread_mutex_unlock(&spots_mutex);
 
             // Update spots per frame statistics
             pthread_mutex_lock(&spots_statistics_mutex);
-            for (int i = 0; i < local_spots.size() ; i++) {
-                size_t omega = (size_t) std::lround(local_spots[i].z * experiment_settings.omega_angle_per_image);
+            for (size_t i = 0; i < received.size(); i++) {
+                size_t omega = (size_t) std::lround(received[i].z * experiment_settings.omega_angle_per_image);
                 if ((omega >= 0) && (omega < omega_range))
                     spot_count_per_image[omega]++;
 
-                if (local_spots[i].d > spot_statistics.resolution_limit) {
-                    float one_over_d2 = 1 / (local_spots[i].d * local_spots[i].d);
+                if (received[i].d > spot_statistics.resolution_limit) {
+                    float one_over_d2 = 1 / (received[i].d * received[i].d);
                     int bin = int(spot_statistics.resolution_limit * spot_statistics.resolution_limit * one_over_d2 * spot_statistics.resolution_bins);
 
-                    spot_statistics.intensity[bin] += local_spots[i].photons;
+                    spot_statistics.intensity[bin] += received[i].photons;
                     spot_statistics.count[bin] += 1;
                 }
             }
@@ -113,11 +129,23 @@ void *run_metadata_thread(void* thread_arg) {
             spot_statistics_sequence++;
             pthread_mutex_unlock(&spots_statistics_mutex);
         }
+
+        if (std::find(chunk_received.begin(), chunk_received.end(), false) != chunk_received.end())
+            std::cerr << "Receiver " << card_id << ": spots of some chunks missing" << std::endl;
+        if (overflow_images > 0)
+            std::cout << "Receiver " << card_id << ": strong pixel overflow in " << overflow_images
+                      << " images, spots are incomplete" << std::endl;
     }
 
     // Send pedestal, header data and collection statistics
     read(writer_connection_settings[card_id].sockfd,
          &(online_statistics[card_id]), sizeof(online_statistics_t));
+    tcp_receive(writer_connection_settings[card_id].sockfd,
+                (char *) &(latency_statistics[card_id]), sizeof(latency_statistics_t));
+    if (experiment_settings.latency_trace) {
+        std::cout << "Receiver " << card_id << " pipeline latency:" << std::endl;
+        print_latency_statistics(latency_statistics[card_id]);
+    }
 
     tcp_receive(writer_connection_settings[card_id].sockfd,
                 (char *) (gain_pedestal.gainG0 + card_id * NPIXEL), NPIXEL * sizeof(uint16_t));
@@ -134,6 +162,25 @@ void *run_metadata_thread(void* thread_arg) {
     tcp_receive(writer_connection_settings[card_id].sockfd,
                 (char *) (gain_pedestal.pixel_mask + card_id * NPIXEL), NPIXEL * sizeof(uint16_t));
 
+    // Hot pixel histogram - number of entries, then entries
+    size_t strong_pixel_counts_size;
+    tcp_receive(writer_connection_settings[card_id].sockfd, (char *) &strong_pixel_counts_size, sizeof(size_t));
+    strong_pixel_counts[card_id].resize(strong_pixel_counts_size);
+    if (strong_pixel_counts_size > 0)
+        tcp_receive(writer_connection_settings[card_id].sockfd, (char *) strong_pixel_counts[card_id].data(),
+                    strong_pixel_counts_size * sizeof(strong_pixel_count_t));
+
+    // Possibly corrupted zero-copy images - number of entries, then entries
+    size_t overrun_images_size;
+    tcp_receive(writer_connection_settings[card_id].sockfd, (char *) &overrun_images_size, sizeof(size_t));
+    overrun_images[card_id].resize(overrun_images_size);
+    if (overrun_images_size > 0) {
+        tcp_receive(writer_connection_settings[card_id].sockfd, (char *) overrun_images[card_id].data(),
+                    overrun_images_size * sizeof(uint32_t));
+        std::cerr << "Receiver " << card_id << ": " << overrun_images_size
+                  << " raw images could be overwritten by detector during send (see overrun_images in master file)" << std::endl;
+    }
+
     // Check magic number again - but don't quit, as the program is finishing anyway soon
     exchange_magic_number(writer_connection_settings[card_id].sockfd);
 
@@ -71,6 +71,7 @@ void TCP_exchange_IB_parameters(int sockfd, ib_settings_t &ib_settings, ib_comm_
 	ib_comm_settings_t local;
 	local.qp_num = ib_settings.qp->qp_num;
 	local.dlid = ib_settings.port_attr.lid;
+	local.gid = ib_settings.gid;
 
 	// Receive parameters
 	read(sockfd, remote, sizeof(ib_comm_settings_t));
@@ -84,8 +85,8 @@ int setup_infiniband(int card_id) {
 	setup_ibverbs(writer_connection_settings[card_id].ib_settings,
 			writer_connection_settings[card_id].ib_dev_name, 1, RDMA_RQ_SIZE+1);
 
-        // IB buffer
-        writer_connection_settings[card_id].ib_buffer = (char *) malloc(RDMA_RQ_SIZE * COMPOSED_IMAGE_SIZE * sizeof(uint16_t));
+        // IB buffer (with huge pages, if available)
+        writer_connection_settings[card_id].ib_buffer = (char *) mmap_huge(RDMA_RQ_SIZE * COMPOSED_IMAGE_SIZE * sizeof(uint16_t), "IB buffer");
 	if (writer_connection_settings[card_id].ib_buffer == NULL) {
 		std::cerr << "Memory allocation error" << std::endl;
 		return 1;
@@ -100,6 +101,8 @@ int setup_infiniband(int card_id) {
 		std::cerr << "Failed to register IB memory region." << std::endl;
 		return 1;
 	}
+        // Registration pins the memory, so page size is known
+        print_page_size(writer_connection_settings[card_id].ib_buffer, "IB buffer");
         return 0;
 }
 
@@ -109,7 +112,7 @@ int close_infiniband(int card_id) {
 	close_ibverbs(writer_connection_settings[card_id].ib_settings);
 
 	// Free memory buffer
-	free(writer_connection_settings[card_id].ib_buffer);
+	munmap_huge(writer_connection_settings[card_id].ib_buffer);
         return  0;
 }
 
@@ -160,7 +163,7 @@ int connect_to_power9(int card_id) {
 
 	// Switch to ready to receive
 	switch_to_rtr(writer_connection_settings[card_id].ib_settings,
-			remote.rq_psn, remote.dlid, remote.qp_num);
+			remote.rq_psn, remote.dlid, remote.qp_num, remote.gid);
 
 	return 0;
 }
@@ -209,6 +209,16 @@ std::map<std::string, parameter_t> detector_options = {
                                [](nlohmann::json &in) {  experiment_settings.min_pixels_per_spot = in.get<uint16_t>(); },
                                "Spots with less pixels than this value are discarded"
                        }},
+        {"spot_finding_nbx",{"", PARAMETER_UINT, 1.0, SPOT_BOX_MAX_HALF_WIDTH, false,
+                               [](nlohmann::json &out) { out = experiment_settings.spot_finding_nbx; },
+                               [](nlohmann::json &in) {  experiment_settings.spot_finding_nbx = in.get<uint16_t>(); },
+                               "Local background box for strong pixels is 2*NBX+1 pixels wide"
+                       }},
+        {"spot_finding_nby",{"", PARAMETER_UINT, 1.0, SPOT_BOX_MAX_HALF_WIDTH, false,
+                               [](nlohmann::json &out) { out = experiment_settings.spot_finding_nby; },
+                               [](nlohmann::json &in) {  experiment_settings.spot_finding_nby = in.get<uint16_t>(); },
+                               "Local background box for strong pixels is 2*NBY+1 pixels high"
+                       }},
         {"spot_finding_dimensions", {"", PARAMETER_STRING, 0.0, 0.0, false,
                                [](nlohmann::json &out) { experiment_settings.connect_spots_between_frames? out = "3D": out="2D";},
                                [](nlohmann::json &in) { if (in.get<std::string>() == "2D") experiment_settings.connect_spots_between_frames = false;
@@ -234,6 +244,16 @@ std::map<std::string, parameter_t> detector_options = {
                                },
                                "Compression algorithm", {"none", "bslz4", "bszstd"}
                        }},
+        {"receiver_compression",{"", PARAMETER_BOOL, 0.0, 0.0, false,
+                               [](nlohmann::json &out) { out = experiment_settings.receiver_compression; },
+                               [](nlohmann::json &in) {  experiment_settings.receiver_compression = in.get<bool>(); },
+                               "Compress images with bitshuffle/LZ4 on receiver before sending over InfiniBand"
+                       }},
+        {"latency_trace",{"", PARAMETER_BOOL, 0.0, 0.0, false,
+                               [](nlohmann::json &out) { out = experiment_settings.latency_trace; },
+                               [](nlohmann::json &in) {  experiment_settings.latency_trace = in.get<bool>(); },
+                               "Measure latency of receiver pipeline stages for each image"
+                       }},
         {"write_mode",{"", PARAMETER_STRING, 0.0, 0.0, false,
                                [](nlohmann::json &out) {
                                    if (writer_settings.write_mode == JF_WRITE_BINARY) out = "binary";
@@ -314,8 +334,12 @@ void set_default_parameters() {
     experiment_settings.conversion_mode = MODE_CONV;
     experiment_settings.enable_spot_finding = false;
     experiment_settings.connect_spots_between_frames = true;
+    experiment_settings.receiver_compression = false;
+    experiment_settings.latency_trace = false;
     experiment_settings.strong_pixel = 5.0;
     experiment_settings.min_pixels_per_spot = 3.0;
+    experiment_settings.spot_finding_nbx = SPOT_BOX_DEFAULT_HALF_WIDTH;
+    experiment_settings.spot_finding_nby = SPOT_BOX_DEFAULT_HALF_WIDTH;
     experiment_settings.spot_finding_resolution_limit = 1.5;
 
     writer_settings.compression = JF_COMPRESSION_BSHUF_LZ4;
@@ -56,6 +56,11 @@ void *run_writer_thread(void* thread_arg) {
     if (writer_settings.compression == JF_COMPRESSION_BSHUF_ZSTD)
         compression_buffer = (char *) malloc(bshuf_compress_zstd_bound(COMPOSED_IMAGE_SIZE,experiment_settings.pixel_depth, ZSTD_BLOCK_SIZE) + 12);
 
+    // Buffer for images compressed by receiver, which need to be decompressed for preview or different compression
+    char *decompression_buffer = NULL;
+    if (experiment_settings.receiver_compression)
+        decompression_buffer = (char *) malloc(COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth);
+
     // RDMA buffer size is constant, so only half slots are allocated if pixel is 32-bit (with summation)
     size_t number_of_rqs = RDMA_RQ_SIZE;
     if (experiment_settings.pixel_depth == 4) number_of_rqs = RDMA_RQ_SIZE / 2;
@@ -103,12 +108,30 @@ void *run_writer_thread(void* thread_arg) {
         }
 
         // Frame ID is saved as immediate value, outside of the buffer
-        uint32_t frame_id = ntohl(ib_wc.imm_data);
+        uint32_t frame_id = ntohl(ib_wc.imm_data) & ~RDMA_IMM_COMPRESSED;
+        // Image was compressed by receiver with bitshuffle/LZ4
+        bool precompressed = ntohl(ib_wc.imm_data) & RDMA_IMM_COMPRESSED;
         // Frame length in bytes
         size_t   frame_size = ib_wc.byte_len;
         // Location in buffer is based on work request ID
         char *ib_buffer_location = writer_connection_settings[card_id].ib_buffer
                                    + COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth * ib_wc.wr_id;
+        // Uncompressed image
+        char *image_location = ib_buffer_location;
+
+        // Compressed chunk can be written directly, only if writer uses the same compression
+        // otherwise (and for preview) image needs to be decompressed
+        bool write_precompressed = precompressed && (writer_settings.compression == JF_COMPRESSION_BSHUF_LZ4);
+        if (precompressed && (!write_precompressed || (frame_id % PREVIEW_STRIDE == 0))) {
+            size_t image_size = COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth;
+            if (bshuf_decompress_lz4(ib_buffer_location + 12, decompression_buffer, image_size / experiment_settings.pixel_depth,
+                                     experiment_settings.pixel_depth, 0) < 0) {
+                std::cerr << "Decompression of image " << frame_id << " failed" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            image_location = decompression_buffer;
+            frame_size = image_size;
+        }
 
         // For every i-th frame, save frame content for preview
         // Although there is risk, that preview might be read, while being written, it is less of a problem
@@ -121,10 +144,10 @@ void *run_writer_thread(void* thread_arg) {
             if (experiment_settings.pixel_depth == 4) {
                 for (int i = 0; i < XPIXEL * YPIXEL / NCARDS; i++)
                     // Card id needs flipping, to correctly get up-down
-                    preview[preview_id * PREVIEW_SIZE + i+(1-card_id) * (XPIXEL * YPIXEL / NCARDS)] = ((int32_t *) ib_buffer_location)[i];
+                    preview[preview_id * PREVIEW_SIZE + i+(1-card_id) * (XPIXEL * YPIXEL / NCARDS)] = ((int32_t *) image_location)[i];
             } else {
                 for (int i = 0; i < XPIXEL * YPIXEL / NCARDS; i++)
-                    preview[preview_id * PREVIEW_SIZE + i+(1-card_id) * (XPIXEL * YPIXEL / NCARDS)] = ((int16_t *) ib_buffer_location)[i];
+                    preview[preview_id * PREVIEW_SIZE + i+(1-card_id) * (XPIXEL * YPIXEL / NCARDS)] = ((int16_t *) image_location)[i];
             }
             preview_image_available[preview_id*NCARDS+card_id] = true;
         }
@@ -133,10 +156,14 @@ void *run_writer_thread(void* thread_arg) {
         size_t output_size;
 
         // Compress
-        switch(writer_settings.compression) {
+        if (write_precompressed) {
+            // Chunk compressed by receiver is saved directly from the buffer
+            output_buffer = ib_buffer_location;
+            output_size = ib_wc.byte_len;
+        } else switch(writer_settings.compression) {
             case JF_COMPRESSION_NONE:
                 // If there is no compression, data are saved directly from the buffer
-                output_buffer = ib_buffer_location;
+                output_buffer = image_location;
                 output_size = frame_size;
                 break;
 
@@ -145,7 +172,7 @@ void *run_writer_thread(void* thread_arg) {
                 bshuf_write_uint64_BE(compression_buffer, frame_size);
                 bshuf_write_uint32_BE(compression_buffer + 8, LZ4_BLOCK_SIZE);
                 // Compress
-                output_size = bshuf_compress_lz4(ib_buffer_location, compression_buffer + 12, frame_size / experiment_settings.pixel_depth, experiment_settings.pixel_depth, LZ4_BLOCK_SIZE) + 12;
+                output_size = bshuf_compress_lz4(image_location, compression_buffer + 12, frame_size / experiment_settings.pixel_depth, experiment_settings.pixel_depth, LZ4_BLOCK_SIZE) + 12;
                 output_buffer = compression_buffer;
                 break;
 
@@ -154,7 +181,7 @@ void *run_writer_thread(void* thread_arg) {
                 bshuf_write_uint64_BE(compression_buffer, frame_size);
                 bshuf_write_uint32_BE(compression_buffer + 8, ZSTD_BLOCK_SIZE);
                 // Compress
-                output_size = bshuf_compress_zstd(ib_buffer_location, compression_buffer + 12, frame_size / experiment_settings.pixel_depth, experiment_settings.pixel_depth, ZSTD_BLOCK_SIZE) + 12;
+                output_size = bshuf_compress_zstd(image_location, compression_buffer + 12, frame_size / experiment_settings.pixel_depth, experiment_settings.pixel_depth, ZSTD_BLOCK_SIZE) + 12;
                 output_buffer = compression_buffer;
                 break;
         }
@@ -191,6 +218,7 @@ void *run_writer_thread(void* thread_arg) {
 
     // Release compression buffer
     if (compression_buffer != NULL) free(compression_buffer);
+    if (decompression_buffer != NULL) free(decompression_buffer);
 
     pthread_exit(0);
 }
@@ -25,6 +25,7 @@ writer_thread_arg_t metadata_thread_arg[NCARDS];
 writer_settings_t writer_settings;
 gain_pedestal_t gain_pedestal;
 online_statistics_t online_statistics[NCARDS];
+latency_statistics_t latency_statistics[NCARDS];
 
 experiment_settings_t experiment_settings;
 writer_connection_settings_t writer_connection_settings[NCARDS];
@@ -56,6 +57,9 @@ std::vector<bool> preview_image_available(MAX_PREVIEW*NCARDS);
 std::vector<spot_t> spots;
 pthread_mutex_t spots_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+std::vector<strong_pixel_count_t> strong_pixel_counts[NCARDS];
+std::vector<uint32_t> overrun_images[NCARDS];
+
 std::vector<double> spot_count_per_image;
 spot_statistics_t spot_statistics;
 int spot_statistics_sequence = 0;